@@ -0,0 +1,129 @@
+#include "qsync.h"
+
+#ifndef WIN32
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+using namespace std;
+namespace fs = std::filesystem;
+
+#ifndef WIN32
+//
+// Parses a kernel CPU or node list like "0-15,32-47".
+//
+vector<uint32_t>
+ParseCpuList(
+    const string& List)
+{
+    vector<uint32_t> Result;
+    size_t Position = 0;
+    while (Position < List.size()) {
+        size_t End = List.find(',', Position);
+        if (End == string::npos) {
+            End = List.size();
+        }
+        auto Range = List.substr(Position, End - Position);
+        auto Dash = Range.find('-');
+        char* Rest;
+        uint32_t First = (uint32_t)strtoul(Range.c_str(), &Rest, 10);
+        uint32_t Last = Dash == string::npos ? First : (uint32_t)strtoul(Range.c_str() + Dash + 1, &Rest, 10);
+        for (auto Cpu = First; Cpu <= Last; ++Cpu) {
+            Result.push_back(Cpu);
+        }
+        Position = End + 1;
+    }
+    return Result;
+}
+
+bool
+ReadSysfsList(
+    const fs::path& Path,
+    vector<uint32_t>& List)
+{
+    ifstream Input(Path);
+    string Line;
+    if (!Input.good() || !getline(Input, Line)) {
+        return false;
+    }
+    List = ParseCpuList(Line);
+    return !List.empty();
+}
+#endif
+
+CpuTopology::CpuTopology()
+{
+#ifndef WIN32
+    vector<uint32_t> Nodes;
+    if (ReadSysfsList("/sys/devices/system/node/online", Nodes)) {
+        for (auto Node : Nodes) {
+            vector<uint32_t> Cpus;
+            if (ReadSysfsList("/sys/devices/system/node/node" + to_string(Node) + "/cpulist", Cpus)) {
+                NodeCpus.push_back(std::move(Cpus));
+            }
+        }
+    }
+#endif
+    if (NodeCpus.size() <= 1) {
+        NodeCpus.clear();
+        NodeCpus.emplace_back();
+        for (auto Cpu = 0u; Cpu < max(thread::hardware_concurrency(), 1u); ++Cpu) {
+            NodeCpus[0].push_back(Cpu);
+        }
+    }
+    for (auto Node = 0u; Node < NodeCpus.size(); ++Node) {
+        for (auto Cpu : NodeCpus[Node]) {
+            if (Cpu >= CpuNodes.size()) {
+                CpuNodes.resize(Cpu + 1, 0);
+            }
+            CpuNodes[Cpu] = Node;
+        }
+    }
+}
+
+const CpuTopology&
+CpuTopology::Get()
+{
+    static CpuTopology Topology;
+    return Topology;
+}
+
+uint32_t
+CpuTopology::CurrentNode() const
+{
+    if (NodeCpus.size() == 1) {
+        return 0;
+    }
+#ifndef WIN32
+    int Cpu = sched_getcpu();
+    if (Cpu >= 0 && (size_t)Cpu < CpuNodes.size()) {
+        return CpuNodes[Cpu];
+    }
+#endif
+    return 0;
+}
+
+bool
+CpuTopology::PinCurrentThread(
+    uint32_t Node) const
+{
+    if (NodeCpus.size() == 1 || Node >= NodeCpus.size()) {
+        // Nothing to gain from pinning on a single node.
+        return true;
+    }
+#ifndef WIN32
+    cpu_set_t Set;
+    CPU_ZERO(&Set);
+    for (auto Cpu : NodeCpus[Node]) {
+        if (Cpu < CPU_SETSIZE) {
+            CPU_SET(Cpu, &Set);
+        }
+    }
+    int Error = pthread_setaffinity_np(pthread_self(), sizeof(Set), &Set);
+    if (Error != 0) {
+        LogError() << "Failed to pin thread to NUMA node " << Node << " " << strerror(Error);
+        return false;
+    }
+#endif
+    return true;
+}
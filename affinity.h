@@ -0,0 +1,41 @@
+#pragma once
+
+//
+// Which CPUs belong to which NUMA node, read once from sysfs. Machines we
+// can't tell about, and non-Linux builds, look like a single node holding
+// every CPU, where placement is left to the OS.
+//
+class CpuTopology {
+    // CPUs of each node, by node index (not necessarily the kernel's node id).
+    std::vector<std::vector<uint32_t>> NodeCpus;
+    // Node index of each CPU.
+    std::vector<uint32_t> CpuNodes;
+
+    CpuTopology();
+
+public:
+    CpuTopology(const CpuTopology&) = delete;
+    CpuTopology& operator= (const CpuTopology&) = delete;
+
+    static
+    const CpuTopology&
+    Get();
+
+    uint32_t
+    NodeCount() const { return (uint32_t)NodeCpus.size(); }
+
+    //
+    // Node of the CPU the calling thread is running on right now. MsQuic
+    // callbacks run on the worker of the connection's partition, so from
+    // there this is the node the connection's data arrives on.
+    //
+    uint32_t
+    CurrentNode() const;
+
+    //
+    // Restricts the calling thread to the CPUs of Node.
+    //
+    bool
+    PinCurrentThread(
+        uint32_t Node) const;
+};
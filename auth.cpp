@@ -9,6 +9,8 @@
 #include "openssl/rand.h"
 #include "openssl/x509v3.h"
 
+#include <array>
+
 #ifndef ED448_KEYLEN
 #define ED448_KEYLEN 57
 #endif
@@ -16,15 +18,61 @@
 const int PBKDFIterations = 15000;
 const int SigningSaltLength = 64;
 const char* CertName = "quiccat";
+// Signing keys kept for peers that verified, oldest dropped first.
+const size_t SigningKeyCacheSize = 256;
+// A persisted identity is replaced this long before its certificate expires.
+const long IdentityRenewSeconds = 30 * 24 * 60 * 60;
+
+//
+// PBKDF2 is deliberately slow, and every connection's certificate check
+// would otherwise redo it. A peer presents the same certificate, so the same
+// salt, on each of its connections and, with a persisted identity, across
+// restarts. Only keys that verified a certificate are kept, so peers can't
+// fill the cache with salts of their choosing.
+//
+struct SigningKeyCache {
+    std::mutex Mutex;
+    // Password followed by salt, to the raw key derived from them.
+    std::unordered_map<std::string, std::array<uint8_t, ED448_KEYLEN>> Keys;
+    std::deque<std::string> Order;
+} SigningKeys;
+
+std::string
+SigningKeyCacheKey(
+    _In_ const std::string& Password,
+    _In_ const uint8_t* const Salt,
+    _In_ const uint32_t SaltLen)
+{
+    std::string Key(Password);
+    Key.append((const char*)Salt, SaltLen);
+    return Key;
+}
 
 void
-PrintHexBuffer(const char* const Label, const uint8_t*const Buf, uint32_t Len)
+QcCacheSigningKey(
+    _In_ const std::string& Password,
+    _In_ const uint8_t* const Salt,
+    _In_ const uint32_t SaltLen,
+    _In_ EVP_PKEY* SigningKey)
 {
-    std::cerr << Label << ": ";
-    for(unsigned i = 0; i < Len; i++) {
-        printf("%02x", (unsigned char)Buf[i]);
-    }
-    std::cerr << std::endl;
+    std::array<uint8_t, ED448_KEYLEN> KeyBytes;
+    size_t KeyLength = KeyBytes.size();
+    if (EVP_PKEY_get_raw_private_key(SigningKey, KeyBytes.data(), &KeyLength) != 1 ||
+        KeyLength != KeyBytes.size()) {
+        return;
+    }
+    auto CacheKey = SigningKeyCacheKey(Password, Salt, SaltLen);
+    std::lock_guard<std::mutex> Lock(SigningKeys.Mutex);
+    if (SigningKeys.Keys.emplace(CacheKey, KeyBytes).second) {
+        SigningKeys.Order.push_back(std::move(CacheKey));
+        if (SigningKeys.Order.size() > SigningKeyCacheSize) {
+            auto Oldest = SigningKeys.Keys.find(SigningKeys.Order.front());
+            OPENSSL_cleanse(Oldest->second.data(), Oldest->second.size());
+            SigningKeys.Keys.erase(Oldest);
+            SigningKeys.Order.pop_front();
+        }
+    }
+    OPENSSL_cleanse(KeyBytes.data(), KeyBytes.size());
 }
 
 EVP_PKEY*
@@ -34,18 +82,32 @@ QcGenerateSigningKey(
     _In_ const uint32_t SaltLen)
 {
     EVP_PKEY* SigningKey = nullptr;
+    bool Cached = false;
 
     uint8_t SigningKeyBytes[ED448_KEYLEN];
-    int Ret = PKCS5_PBKDF2_HMAC(Password.c_str(), (int)Password.length(), Salt, SaltLen, PBKDFIterations, EVP_sha512(), sizeof(SigningKeyBytes), SigningKeyBytes);
-    if (Ret != 1) {
-        std::cerr << "Failed to run PBKDF2!\n";
-        goto Error;
+    {
+        std::lock_guard<std::mutex> Lock(SigningKeys.Mutex);
+        auto Entry = SigningKeys.Keys.find(SigningKeyCacheKey(Password, Salt, SaltLen));
+        if (Entry != SigningKeys.Keys.end()) {
+            memcpy(SigningKeyBytes, Entry->second.data(), sizeof(SigningKeyBytes));
+            Cached = true;
+        }
+    }
+    if (Cached) {
+        Metrics.SigningKeyCacheHits.Add(1);
+    } else {
+        int Ret = PKCS5_PBKDF2_HMAC(Password.c_str(), (int)Password.length(), Salt, SaltLen, PBKDFIterations, EVP_sha512(), sizeof(SigningKeyBytes), SigningKeyBytes);
+        if (Ret != 1) {
+            LogError() << "Failed to run PBKDF2!";
+            goto Error;
+        }
+        Metrics.SigningKeysDerived.Add(1);
     }
 
     SigningKey = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED448, nullptr, SigningKeyBytes, sizeof(SigningKeyBytes));
     if (SigningKey == nullptr) {
-        std::cerr << "Failed to create signing key!\n";
-        ERR_print_errors_cb([](const char* str, size_t /*len*/, void* /*u*/){std::cerr << str << std::endl; return 1;}, nullptr);
+        LogError() << "Failed to create signing key!";
+        ERR_print_errors_cb([](const char* str, size_t /*len*/, void* /*u*/){LogError() << str; return 1;}, nullptr);
         goto Error;
     }
 
@@ -78,55 +140,55 @@ QcGenerateAuthCertificate(
 
     EVP_PKEY_CTX *KeyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_ED448, NULL);
     if (KeyContext == nullptr) {
-        std::cerr << "Failed to allocate Key context!\n";
+        LogError() << "Failed to allocate Key context!";
         goto Error;
     }
 
     Ret = EVP_PKEY_keygen_init(KeyContext);
     if (Ret != 1) {
-        std::cerr << "Keygen init failed!\n";
+        LogError() << "Keygen init failed!";
         goto Error;
     }
 
     Ret = EVP_PKEY_keygen(KeyContext, &PrivateKey);
     if (Ret != 1) {
-        std::cerr << "Keygen failed!\n";
+        LogError() << "Keygen failed!";
         goto Error;
     }
 
     Ret = RAND_bytes(Salt, sizeof(Salt));
     if (Ret != 1) {
-        std::cerr << "Failed to get random bytes!\n";
+        LogError() << "Failed to get random bytes!";
         goto Error;
     }
 
     Cert = X509_new();
     if (Cert == nullptr) {
-        std::cerr << "Failed to allocate X509!\n";
+        LogError() << "Failed to allocate X509!";
         goto Error;
     }
 
     Ret = X509_set_version(Cert, 2);
     if (Ret != 1) {
-        std::cerr << "Failed to set certificate version!\n";
+        LogError() << "Failed to set certificate version!";
         goto Error;
     }
 
     SaltBn = BN_bin2bn(Salt, sizeof(Salt), nullptr);
     if (SaltBn == nullptr) {
-        std::cerr << "Failed to convert Salt to BIGNUM!\n";
+        LogError() << "Failed to convert Salt to BIGNUM!";
         goto Error;
     }
 
     SerialNumber = BN_to_ASN1_INTEGER(SaltBn, nullptr);
     if (SerialNumber == nullptr) {
-        std::cerr << "Failed to allocate serial number!\n";
+        LogError() << "Failed to allocate serial number!";
         goto Error;
     }
 
     Ret = X509_set_serialNumber(Cert, SerialNumber);
     if (Ret != 1) {
-        std::cerr << "Failed to set serial number!\n";
+        LogError() << "Failed to set serial number!";
         goto Error;
     }
 
@@ -135,24 +197,24 @@ QcGenerateAuthCertificate(
 
     Ret = X509_set_pubkey(Cert, PrivateKey);
     if (Ret != 1) {
-        std::cerr << "Failed to set public key on cert!\n";
+        LogError() << "Failed to set public key on cert!";
         goto Error;
     }
 
     Name = X509_get_subject_name(Cert);
     if (Name == nullptr) {
-        std::cerr << "Failed to allocate subject name!\n";
+        LogError() << "Failed to allocate subject name!";
         goto Error;
     }
     Ret = X509_NAME_add_entry_by_txt(Name, "CN", MBSTRING_ASC, (unsigned char*)CertName, -1, -1, 0);
     if (Ret != 1) {
-        std::cerr << "Failed to set subject name!\n";
+        LogError() << "Failed to set subject name!";
         goto Error;
     }
 
     Ret = X509_set_issuer_name(Cert, Name);
     if (Ret != 1) {
-        std::cerr << "Failed to set issuer name!\n";
+        LogError() << "Failed to set issuer name!";
         goto Error;
     }
 
@@ -163,20 +225,20 @@ QcGenerateAuthCertificate(
 
     Ret = X509_sign(Cert, SigningKey, nullptr);
     if (Ret == 0) {
-        std::cerr << "Failed to sign certificate!\n";
-        ERR_print_errors_cb([](const char* str, size_t /*len*/, void* /*u*/){std::cerr << str << std::endl; return 1;}, nullptr);
+        LogError() << "Failed to sign certificate!";
+        ERR_print_errors_cb([](const char* str, size_t /*len*/, void* /*u*/){LogError() << str; return 1;}, nullptr);
         goto Error;
     }
 
     NewPkcs12 = PKCS12_create("", CertName, PrivateKey, Cert, nullptr, -1, -1, 0, 0, 0);
     if (NewPkcs12 == nullptr) {
-        std::cerr << "Failed to create new PKCS12!\n";
+        LogError() << "Failed to create new PKCS12!";
         goto Error;
     }
 
     Ret = i2d_PKCS12(NewPkcs12, nullptr);
     if (Ret <= 0) {
-        std::cerr << "Failed to get export buffer size of NewPkcs12!\n";
+        LogError() << "Failed to get export buffer size of NewPkcs12!";
         goto Error;
     }
 
@@ -184,7 +246,7 @@ QcGenerateAuthCertificate(
 
     Pkcs12Buffer = new (std::nothrow) uint8_t[Pkcs12Length];
     if (Pkcs12Buffer == nullptr) {
-        std::cerr << "Failed to allocate " << Pkcs12Length << " bytes for Pkcs12!\n";
+        LogError() << "Failed to allocate " << Pkcs12Length << " bytes for Pkcs12!";
         goto Error;
     }
 
@@ -192,12 +254,12 @@ QcGenerateAuthCertificate(
 
     Ret = i2d_PKCS12(NewPkcs12, &Pkcs12BufferPtr);
     if (Ret < 0) {
-        std::cerr << "Failed to export NewPkcs12!\n";
+        LogError() << "Failed to export NewPkcs12!";
         goto Error;
     }
 
     if ((uint32_t)Ret != Pkcs12Length) {
-        std::cerr << "Pkcs12 export length changed between calls!\n";
+        LogError() << "Pkcs12 export length changed between calls!";
         goto Error;
     }
 
@@ -259,18 +321,18 @@ QcVerifyCertificate(
 
     SaltBn = ASN1_INTEGER_to_BN(SerialNumber, nullptr);
     if (SaltBn == nullptr) {
-        std::cerr << "Failed to convert ASN SerialNumber to BIGNUM Salt!\n";
+        LogError() << "Failed to convert ASN SerialNumber to BIGNUM Salt!";
         goto Error;
     }
 
     if (BN_num_bytes(SaltBn) > (int)sizeof(Salt)) {
-        std::cerr << "Serial number is not correct size! " << BN_num_bytes(SaltBn) << " vs " << sizeof(Salt) << std::endl;
+        LogError() << "Serial number is not correct size! " << BN_num_bytes(SaltBn) << " vs " << sizeof(Salt);
         goto Error;
     }
 
     Ret = BN_bn2binpad(SaltBn, Salt, sizeof(Salt));
     if (Ret != sizeof(Salt)) {
-        std::cerr << "BIGNUM conversion to binary is wrong size! " << Ret << " vs " << sizeof(Salt) << std::endl;
+        LogError() << "BIGNUM conversion to binary is wrong size! " << Ret << " vs " << sizeof(Salt);
         goto Error;
     }
 
@@ -281,17 +343,18 @@ QcVerifyCertificate(
 
     Ret = X509_verify(PeerCert, SigningKey);
     if (Ret == 1) {
+        QcCacheSigningKey(Password, Salt, sizeof(Salt), SigningKey);
         Result = true;
     } else if (Ret == 0) {
-        std::cerr << "Certificate failed signature verification!\n";
+        LogError() << "Certificate failed signature verification!";
         goto Error;
     } else if (Ret == -1) {
-        std::cerr << "Certificate signature is malformed!\n";
-        ERR_print_errors_cb([](const char* str, size_t /*len*/, void* /*u*/){std::cerr << str << std::endl; return 1;}, nullptr);
+        LogError() << "Certificate signature is malformed!";
+        ERR_print_errors_cb([](const char* str, size_t /*len*/, void* /*u*/){LogError() << str; return 1;}, nullptr);
         goto Error;
     } else {
-        std::cerr << "Certificate failed validation for another reason!\n";
-        ERR_print_errors_cb([](const char* str, size_t /*len*/, void* /*u*/){std::cerr << str << std::endl; return 1;}, nullptr);
+        LogError() << "Certificate failed validation for another reason!";
+        ERR_print_errors_cb([](const char* str, size_t /*len*/, void* /*u*/){LogError() << str; return 1;}, nullptr);
         goto Error;
     }
 
@@ -305,4 +368,158 @@ Error:
     }
 
     return Result;
-}
\ No newline at end of file
+}
+
+bool
+QcLoadAuthCertificate(
+    _In_ const std::string& Password,
+    _In_ const std::string& Path,
+    _Out_ std::unique_ptr<uint8_t[]>& Pkcs12,
+    _Out_ uint32_t& Pkcs12Length)
+{
+    PKCS12* LoadedPkcs12 = nullptr;
+    EVP_PKEY* PrivateKey = nullptr;
+    X509* Cert = nullptr;
+    const uint8_t* Pkcs12BufferPtr = nullptr;
+    time_t RenewBy = time(nullptr) + IdentityRenewSeconds;
+    std::error_code Error;
+    bool Result = false;
+
+    Pkcs12 = nullptr;
+    Pkcs12Length = 0;
+
+    auto FileSize = std::filesystem::file_size(Path, Error);
+    if (Error || FileSize == 0 || FileSize > UINT32_MAX) {
+        // Not created yet.
+        return false;
+    }
+    std::unique_ptr<uint8_t[]> Buffer(new (std::nothrow) uint8_t[FileSize]);
+    if (Buffer == nullptr) {
+        LogError() << "Failed to allocate " << FileSize << " bytes for identity!";
+        return false;
+    }
+    std::ifstream Input(Path, std::ios::binary | std::ios::in);
+    if (!Input.read((char*)Buffer.get(), FileSize)) {
+        LogWarning() << "Failed to read identity " << Path << "; generating a new one";
+        return false;
+    }
+
+    Pkcs12BufferPtr = Buffer.get();
+    LoadedPkcs12 = d2i_PKCS12(nullptr, &Pkcs12BufferPtr, (long)FileSize);
+    if (LoadedPkcs12 == nullptr ||
+        PKCS12_parse(LoadedPkcs12, "", &PrivateKey, &Cert, nullptr) != 1 ||
+        Cert == nullptr) {
+        LogWarning() << "Identity " << Path << " is not a PKCS#12 qsync created; generating a new one";
+        goto Error;
+    }
+
+    if (X509_cmp_time(X509_get0_notAfter(Cert), &RenewBy) < 0) {
+        LogInfo() << "Identity " << Path << " expires soon; generating a new one";
+        goto Error;
+    }
+
+    //
+    // One PBKDF2 run, rather than keygen and signing too, and a changed
+    // password is caught here instead of by every peer.
+    //
+    if (!QcVerifyCertificate(Password, (QUIC_CERTIFICATE*)Cert)) {
+        LogWarning() << "Identity " << Path << " was made with another password; generating a new one";
+        goto Error;
+    }
+
+    Result = true;
+    Pkcs12 = std::move(Buffer);
+    Pkcs12Length = (uint32_t)FileSize;
+
+Error:
+    if (Cert != nullptr) {
+        X509_free(Cert);
+    }
+
+    if (PrivateKey != nullptr) {
+        EVP_PKEY_free(PrivateKey);
+    }
+
+    if (LoadedPkcs12 != nullptr) {
+        PKCS12_free(LoadedPkcs12);
+    }
+
+    return Result;
+}
+
+bool
+QcSavePrivateFile(
+    _In_ const std::string& Path,
+    _In_ const uint8_t* Data,
+    _In_ uint32_t Length)
+{
+    namespace fs = std::filesystem;
+    //
+    // Nobody else gets to read it, and it is renamed into place so a crash
+    // can't leave half of one behind.
+    //
+    auto TempPath = Path + ".tmp";
+    std::error_code Error;
+    {
+        std::ofstream Output(TempPath, std::ios::binary | std::ios::out | std::ios::trunc);
+        if (!Output.good()) {
+            LogWarning() << "Failed to create " << TempPath << " " << strerror(errno);
+            return false;
+        }
+        fs::permissions(TempPath, fs::perms::owner_read | fs::perms::owner_write, Error);
+        if (Error) {
+            LogWarning() << "Failed to restrict permissions on " << TempPath << ": " << Error;
+            Output.close();
+            fs::remove(TempPath, Error);
+            return false;
+        }
+        Output.write((const char*)Data, Length);
+        if (!Output.good()) {
+            LogWarning() << "Failed to write " << TempPath;
+            Output.close();
+            fs::remove(TempPath, Error);
+            return false;
+        }
+    }
+    fs::rename(TempPath, Path, Error);
+    if (Error) {
+        LogWarning() << "Failed to move " << TempPath << " into place: " << Error;
+        fs::remove(TempPath, Error);
+        return false;
+    }
+    return true;
+}
+
+bool
+QcGetAuthCertificate(
+    _In_ const std::string& Password,
+    _In_ const std::string& IdentityPath,
+    _Out_ std::unique_ptr<uint8_t[]>& Pkcs12,
+    _Out_ uint32_t& Pkcs12Length)
+{
+    if (!IdentityPath.empty() &&
+        QcLoadAuthCertificate(Password, IdentityPath, Pkcs12, Pkcs12Length)) {
+        LogDebug().With("path", IdentityPath) << "Loaded identity";
+        return true;
+    }
+    if (!QcGenerateAuthCertificate(Password, Pkcs12, Pkcs12Length)) {
+        return false;
+    }
+    if (!IdentityPath.empty() &&
+        QcSavePrivateFile(IdentityPath, Pkcs12.get(), Pkcs12Length)) {
+        LogInfo().With("path", IdentityPath) << "Saved new identity";
+    }
+    return true;
+}
+
+bool
+QcGenerateSessionToken(
+    _Out_ uint8_t* Token,
+    _In_ uint32_t Length)
+{
+    if (RAND_bytes(Token, (int)Length) != 1) {
+        LogError() << "Failed to get random bytes for session token!";
+        return false;
+    }
+    return true;
+}
@@ -8,7 +8,35 @@ QcGenerateAuthCertificate(
     _Out_ std::unique_ptr<uint8_t[]>& Pkcs12,
     _Out_ uint32_t& Pkcs12Length);
 
+//
+// Loads the identity persisted at IdentityPath if it is still good for
+// Password, else generates one and, if IdentityPath is set, saves it there
+// for next time. Reusing an identity skips keygen and signing, and lets
+// peers find its signing key in their cache.
+//
+bool
+QcGetAuthCertificate(
+    _In_ const std::string& Password,
+    _In_ const std::string& IdentityPath,
+    _Out_ std::unique_ptr<uint8_t[]>& Pkcs12,
+    _Out_ uint32_t& Pkcs12Length);
+
 bool
 QcVerifyCertificate(
     _In_ const std::string& Password,
     _In_ QUIC_CERTIFICATE* Cert);
+
+//
+// Writes a file only its owner can read, such as a private key or a
+// resumption ticket, replacing Path atomically.
+//
+bool
+QcSavePrivateFile(
+    _In_ const std::string& Path,
+    _In_ const uint8_t* Data,
+    _In_ uint32_t Length);
+
+bool
+QcGenerateSessionToken(
+    _Out_ uint8_t* Token,
+    _In_ uint32_t Length);
@@ -0,0 +1,67 @@
+#include "qsync.h"
+
+using namespace std;
+
+bool
+ControlCaptureWriter::Open(
+    const string& Path,
+    const SessionHello& Hello)
+{
+    Output.open(Path, ios::binary | ios::out | ios::trunc);
+    if (!Output.good()) {
+        LogError() << "Failed to open capture " << Path << " " << strerror(errno);
+        return false;
+    }
+    ControlCaptureHeader Header;
+    memcpy(Header.Magic, ControlCaptureMagic, sizeof(ControlCaptureMagic));
+    Header.Version = ControlCaptureVersion;
+    Header.Hello = Hello;
+    Output.write((const char*)&Header, sizeof(Header));
+    return Output.good();
+}
+
+void
+ControlCaptureWriter::Write(
+    const uint8_t* Data,
+    uint32_t Length)
+{
+    if (Length == 0 || !Output.good()) {
+        return;
+    }
+    Output.write((const char*)&Length, sizeof(Length));
+    Output.write((const char*)Data, Length);
+}
+
+bool
+ReadControlCapture(
+    const string& Path,
+    ControlCapture& Capture)
+{
+    ifstream Input(Path, ios::binary | ios::in);
+    if (!Input.good()) {
+        LogError() << "Failed to open capture " << Path << " " << strerror(errno);
+        return false;
+    }
+    ControlCaptureHeader Header;
+    Input.read((char*)&Header, sizeof(Header));
+    if (!Input.good() ||
+        memcmp(Header.Magic, ControlCaptureMagic, sizeof(ControlCaptureMagic)) != 0 ||
+        Header.Version != ControlCaptureVersion) {
+        LogError() << "Not a control stream capture: " << Path;
+        return false;
+    }
+    Capture.Hello = Header.Hello;
+    Capture.Buffers.clear();
+    Capture.TotalBytes = 0;
+    uint32_t Length;
+    while (Input.read((char*)&Length, sizeof(Length))) {
+        vector<uint8_t> Buffer(Length);
+        if (!Input.read((char*)Buffer.data(), Length)) {
+            LogWarning() << "Capture " << Path << " is truncated; replaying what is there";
+            break;
+        }
+        Capture.TotalBytes += Length;
+        Capture.Buffers.push_back(std::move(Buffer));
+    }
+    return true;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+//
+// Raw control-stream captures, so the server's metadata path can be
+// replayed without a client or QUIC (see control_replay.cpp). A capture is
+// the session hello followed by the bytes of each receive buffer exactly
+// as it arrived, each prefixed with its uint32_t length.
+//
+const char ControlCaptureMagic[4] = {'Q', 'S', 'C', 'C'};
+const uint32_t ControlCaptureVersion = 1;
+
+#pragma pack(push, 1)
+struct ControlCaptureHeader {
+    char Magic[4];
+    uint32_t Version;
+    SessionHello Hello;
+};
+#pragma pack(pop)
+
+//
+// Written from the control stream's receive callbacks, which MsQuic never
+// runs concurrently for one stream.
+//
+class ControlCaptureWriter {
+    std::ofstream Output;
+
+public:
+    bool Open(const std::string& Path, const SessionHello& Hello);
+    void Write(const uint8_t* Data, uint32_t Length);
+};
+
+struct ControlCapture {
+    SessionHello Hello;
+    // The receive buffers, in order.
+    std::vector<std::vector<uint8_t>> Buffers;
+    uint64_t TotalBytes;
+};
+
+bool
+ReadControlCapture(
+    const std::string& Path,
+    ControlCapture& Capture);
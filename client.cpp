@@ -6,6 +6,53 @@ const MsQuicAlpn Alpn(QSYNC_ALPN);
 const uint16_t CONTROL_STREAM_PRIORITY = 0x7FFF;
 const uint32_t MAX_OUTSTANDING_SENDS = 4;
 const uint32_t FILE_IO_SIZE = 0xFFFF;
+const uint32_t FILE_COMPRESS_BOUND = ZSTD_COMPRESSBOUND(FILE_IO_SIZE);
+// Speculative pushes open at once; each holds a file handle and a stream.
+const uint32_t MAX_SPECULATIVE_PUSHES = 32;
+// Most FileInfo records the sender packs into one control stream send.
+const uint64_t CONTROL_SEND_BATCH = 0x10000;
+
+void
+QsyncClient::DataStreamContext::CompressChunk(
+    DataChunkHeader* Header,
+    QUIC_BUFFER* Payload,
+    uint8_t* Scratch)
+{
+    int Level = Client->Compression.Level();
+    if (Level == 0) {
+        return;
+    }
+    if (CCtx == nullptr) {
+        CCtx = ZSTD_createCCtx();
+        if (CCtx == nullptr) {
+            LogError() << "Failed to allocate compression context!";
+            Compress = false;
+            return;
+        }
+    }
+    auto Start = chrono::steady_clock::now();
+    size_t Result = ZSTD_compressCCtx(CCtx, Scratch, FILE_COMPRESS_BOUND, Payload->Buffer, Payload->Length, Level);
+    auto Elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - Start);
+    if (ZSTD_isError(Result)) {
+        LogError() << "Compression failed: " << ZSTD_getErrorName(Result);
+        Compress = false;
+        return;
+    }
+    Client->Compression.OnCompressed(Payload->Length, Result, Elapsed.count());
+    if (!CompressionProbed) {
+        // If the first chunk doesn't shrink by at least 10%, send the rest raw.
+        CompressionProbed = true;
+        if (Result * 10 > (size_t)Payload->Length * 9) {
+            Compress = false;
+        }
+    }
+    if (Result < Payload->Length) {
+        Header->Flags = DataChunkCompressed;
+        Header->Length = (uint32_t)Result;
+        Payload->Buffer = Scratch;
+        Payload->Length = (uint32_t)Result;
+    }
+}
 
 void
 QsyncClient::DataStreamContext::FileIoWorker()
@@ -13,32 +60,135 @@ QsyncClient::DataStreamContext::FileIoWorker()
     if (EndOfFile) {
         return;
     }
-    QUIC_BUFFER* Buffer = (QUIC_BUFFER*)malloc(sizeof(QUIC_BUFFER) + FILE_IO_SIZE);
-    if (Buffer == nullptr) {
-        cerr << "Failed to allocate buffer for file IO!" << endl;
+    const auto BufferCount = 3u;
+    size_t AllocSize =
+        (BufferCount * sizeof(QUIC_BUFFER)) + sizeof(DataRequest) + (2 * sizeof(DataChunkHeader)) +
+        FILE_IO_SIZE + (Compress ? FILE_COMPRESS_BOUND : 0);
+    QUIC_BUFFER* Buffers = (QUIC_BUFFER*)malloc(AllocSize);
+    if (Buffers == nullptr) {
+        LogError() << "Failed to allocate buffer for file IO!";
+        return;
     }
-    Buffer->Buffer = (uint8_t*)(Buffer + 1);
-    Buffer->Length = FILE_IO_SIZE;
+    DataRequest* RequestHeader = (DataRequest*)(Buffers + BufferCount);
+    DataChunkHeader* Header = (DataChunkHeader*)(RequestHeader + 1);
+    DataChunkHeader* EndMarker = Header + 1;
+    uint8_t* FileData = (uint8_t*)(EndMarker + 1);
+    if (RequestSent) {
+        Buffers[0].Buffer = (uint8_t*)Header;
+        Buffers[0].Length = sizeof(*Header);
+    } else {
+        // The stream's first bytes tell the server which range it carries.
+        *RequestHeader = Request;
+        Buffers[0].Buffer = (uint8_t*)RequestHeader;
+        Buffers[0].Length = sizeof(*RequestHeader) + sizeof(*Header);
+    }
+    Buffers[1].Buffer = FileData;
+    Buffers[2].Buffer = (uint8_t*)EndMarker;
+    Buffers[2].Length = 0;
 
-    FileReadStream.read((char*)Buffer->Buffer, Buffer->Length);
-    auto BytesRead = FileReadStream.gcount();
-    if (BytesRead < Buffer->Length || FileReadStream.eof()) {
-        EndOfFile = true;
-        Buffer->Length = (uint32_t)BytesRead;
+    // Skip over holes; only the data extents of the requested range are sent.
+    uint32_t BytesToRead = 0;
+    while (ExtentIndex < Extents.size()) {
+        const auto& Extent = Extents[ExtentIndex];
+        if (Extent.Offset >= RangeEnd) {
+            break;
+        }
+        ReadOffset = max(ReadOffset, Extent.Offset);
+        uint64_t ExtentEnd = min(Extent.Offset + Extent.Length, RangeEnd);
+        if (ReadOffset < ExtentEnd) {
+            BytesToRead = (uint32_t)min<uint64_t>(FILE_IO_SIZE, ExtentEnd - ReadOffset);
+            break;
+        }
+        ++ExtentIndex;
+    }
+    if (BytesToRead > 0) {
+        if (StreamOffset != ReadOffset) {
+            FileReadStream.seekg(ReadOffset);
+        }
+        FileReadStream.read((char*)FileData, BytesToRead);
+        if ((uint32_t)FileReadStream.gcount() != BytesToRead) {
+            LogError() << "File shrank while reading at offset " << ReadOffset;
+            free(Buffers);
+            if (RequestSent) {
+                EndOfFile = true;
+                Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_ABORTED);
+            } else {
+                SendRequestFailed();
+            }
+            return;
+        }
+    }
+    auto BytesRead = BytesToRead;
+    Header->Offset = ReadOffset;
+    ReadOffset += BytesRead;
+    StreamOffset = ReadOffset;
+    uint64_t DataEnd = Extents.empty() ? 0 : Extents.back().Offset + Extents.back().Length;
+    EndOfFile = BytesRead == 0 || ReadOffset >= min(RangeEnd, DataEnd);
+    Buffers[1].Length = (uint32_t)BytesRead;
+    Header->Flags = DataChunkNone;
+    Header->Length = (uint32_t)BytesRead;
+    Header->RawLength = (uint32_t)BytesRead;
+    if (Compress && BytesRead > 0) {
+        CompressChunk(Header, &Buffers[1], FileData + FILE_IO_SIZE);
+    }
+    if (EndOfFile) {
+        // The server only takes the range as complete once it sees this.
+        *EndMarker = DataChunkHeader{RangeEnd, DataChunkNone, 0, 0};
+        Buffers[2].Length = sizeof(*EndMarker);
     }
+
     QUIC_SEND_FLAGS Flags = EndOfFile ? QUIC_SEND_FLAG_FIN : QUIC_SEND_FLAG_NONE;
-    QUIC_STATUS Status = Stream->Send(Buffer, 1, Flags, Buffer);
+    QUIC_STATUS Status = Stream->Send(Buffers, BufferCount, Flags, Buffers);
     if (QUIC_FAILED(Status)) {
-        cerr << "Data stream send failed with " << std::hex << Status << endl;
-        free(Buffer);
+        LogError() << "Data stream send failed with " << std::hex << Status;
+        free(Buffers);
         return;
     }
+    RequestSent = true;
     ++OutstandingSends;
+    if (EndOfFile) {
+        Tracer.Instant(Request.FileId, TracePushDone);
+    }
     if (!EndOfFile && OutstandingSends < MAX_OUTSTANDING_SENDS) {
         Client->Pool.Enqueue(&QsyncClient::DataStreamContext::FileIoWorker, this);
     }
 }
 
+void
+QsyncClient::DataStreamContext::SendRequestFailed()
+{
+    //
+    // Echo the request with DataRequestFailed set and end the stream, so the
+    // server can tell which range won't be coming.
+    //
+    const auto BufferCount = 3u;
+    QUIC_BUFFER* Buffers = (QUIC_BUFFER*)malloc((BufferCount * sizeof(QUIC_BUFFER)) + sizeof(DataRequest));
+    if (Buffers == nullptr) {
+        LogError() << "Failed to allocate failed request!";
+        Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_OUT_OF_MEMORY);
+        return;
+    }
+    DataRequest* RequestHeader = (DataRequest*)(Buffers + BufferCount);
+    *RequestHeader = Request;
+    RequestHeader->Flags |= DataRequestFailed;
+    Buffers[0].Buffer = (uint8_t*)RequestHeader;
+    Buffers[0].Length = sizeof(*RequestHeader);
+    Buffers[1].Buffer = nullptr;
+    Buffers[1].Length = 0;
+    Buffers[2].Buffer = nullptr;
+    Buffers[2].Length = 0;
+    RequestSent = true;
+    EndOfFile = true;
+    QUIC_STATUS Status = Stream->Send(Buffers, BufferCount, QUIC_SEND_FLAG_FIN, Buffers);
+    if (QUIC_FAILED(Status)) {
+        LogError() << "Data stream send failed with " << std::hex << Status;
+        free(Buffers);
+        Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_ABORTED);
+        return;
+    }
+    ++OutstandingSends;
+}
+
 QUIC_STATUS
 QsyncClient::QSyncClientDataStreamCallback(
     _In_ MsQuicStream* Stream,
@@ -49,86 +199,39 @@ QsyncClient::QSyncClientDataStreamCallback(
     switch (Event->Type) {
     case QUIC_STREAM_EVENT_START_COMPLETE:
         if (QUIC_FAILED(Event->START_COMPLETE.Status)) {
-            cerr << "Data Stream Start failed! " << std::hex << Event->START_COMPLETE.Status << endl;
+            LogError() << "Data Stream Start failed! " << std::hex << Event->START_COMPLETE.Status;
+            This->StartFailed = true;
         } else {
-            cout << "Data Stream opened! " << endl;
+            LogDebug() << "Data Stream opened!";
         }
         break;
-    case QUIC_STREAM_EVENT_RECEIVE: {
-        for (auto i = 0u; i < Event->RECEIVE.BufferCount; i++) {
-            const QUIC_BUFFER* Buffer = Event->RECEIVE.Buffers + i;
-            uint32_t BytesRead = 0;
-            do {
-                if (This->FileIdBytes != 0) {
-                    if (Buffer->Length - BytesRead < sizeof(This->FileId) - This->FileIdBytes) {
-                        // Tiny receive...
-                        memcpy(
-                            This->PartialFileIdBytes + This->FileIdBytes,
-                            Buffer->Buffer + BytesRead,
-                            Buffer->Length - BytesRead);
-                        This->FileIdBytes += Buffer->Length - BytesRead;
-                        BytesRead += Buffer->Length - BytesRead;
-                        continue;
-                    } else {
-                        // Completed the partial
-                        memcpy(
-                            This->PartialFileIdBytes + This->FileIdBytes,
-                            Buffer->Buffer + BytesRead,
-                            sizeof(This->FileId) - This->FileIdBytes);
-                        This->FileIdBytes = 0;
-                        BytesRead += sizeof(This->FileId) - This->FileIdBytes;
-                    }
-                } else {
-                    if (Buffer->Length - BytesRead < sizeof(This->FileId)) {
-                        // Read partial FileId
-                        memcpy(
-                            This->PartialFileIdBytes,
-                            Buffer->Buffer + BytesRead,
-                            Buffer->Length - BytesRead);
-                        This->FileIdBytes = Buffer->Length - BytesRead;
-                        BytesRead += Buffer->Length - BytesRead;
-                        continue;
-                    } else {
-                        memcpy(
-                            This->PartialFileIdBytes,
-                            Buffer->Buffer + BytesRead,
-                            sizeof(This->FileId));
-                        BytesRead += sizeof(This->FileId);
-                    }
-                }
-                auto FileItr = This->Client->FileInfos.find(This->FileId);
-                if (FileItr != This->Client->FileInfos.end()) {
-                    auto Array = kj::ArrayInputStream(kj::ArrayPtr<const uint8_t>(FileItr->second.data(), FileItr->second.size()));
-                    auto Message = capnp::PackedMessageReader(Array);
-                    auto File = Message.getRoot<FileInfo>();
-
-                    u8string_view PathView((char8_t*)File.getPath().cStr());
-                    filesystem::path SyncRoot(This->Client->SyncPath);
-                    auto Source = SyncRoot.has_stem() ? SyncRoot.parent_path() : SyncRoot;
-                    Source /= PathView;
-                    This->FileReadStream = std::fstream(Source, ios::binary | ios::in);
-                    if (!This->FileReadStream.good()) {
-                        cerr << "Failed to open file for reading " << Source << endl;
-                        Stream->Shutdown(QUIC_STATUS_NOT_FOUND);
-                        return QUIC_STATUS_SUCCESS;
-                    }
-                    This->Client->Pool.Enqueue(&QsyncClient::DataStreamContext::FileIoWorker, This);
-                    This->Client->FileInfos.erase(FileItr);
-                } else {
-                    cerr << "No File found for FileId " << This->FileId << endl;
-                }
-            } while (BytesRead < Buffer->Length);
-        }
-        break;
-    }
-    case QUIC_STREAM_EVENT_SEND_COMPLETE:
+    case QUIC_STREAM_EVENT_SEND_COMPLETE: {
         --This->OutstandingSends;
-        free(Event->SEND_COMPLETE.ClientContext);
+        auto Buffers = (QUIC_BUFFER*)Event->SEND_COMPLETE.ClientContext;
+        if (!Event->SEND_COMPLETE.Canceled) {
+            uint32_t Sent = Buffers[0].Length + Buffers[1].Length + Buffers[2].Length;
+            Metrics.BytesSent.Add(Sent);
+            if (This->Client->Compress) {
+                This->Client->Compression.OnSent(Sent);
+            }
+        }
+        free(Buffers);
         if (!This->EndOfFile && This->OutstandingSends < MAX_OUTSTANDING_SENDS) {
             This->Client->Pool.Enqueue(&QsyncClient::DataStreamContext::FileIoWorker, This);
         }
         break;
+    }
+    case QUIC_STREAM_EVENT_PEER_RECEIVE_ABORTED:
+        // The server doesn't want this one, usually a speculative push.
+        This->EndOfFile = true;
+        Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_ABORTED);
+        break;
     case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        if (This->StartFailed) {
+            This->Client->PushStartFailed(This->Request);
+        } else if (This->Request.Flags & DataRequestSpeculative) {
+            This->Client->SpeculativePushFinished();
+        }
         delete This;
         break;
     default:
@@ -147,66 +250,55 @@ QsyncClient::QSyncClientControlStreamCallback(
     switch (Event->Type) {
     case QUIC_STREAM_EVENT_START_COMPLETE:
         if (QUIC_FAILED(Event->START_COMPLETE.Status)) {
-            cerr << "Control Stream Start failed! " << std::hex << Event->START_COMPLETE.Status << endl;
+            LogError() << "Control Stream Start failed! " << std::hex << Event->START_COMPLETE.Status;
         } else {
-            cout << "Control Stream opened! " << endl;
+            LogInfo() << "Control Stream opened!";
         }
         break;
-    case QUIC_STREAM_EVENT_RECEIVE: {
-        for (auto i = 0u; i < Event->RECEIVE.BufferCount; i++) {
-            const QUIC_BUFFER* Buffer = Event->RECEIVE.Buffers + i;
-            uint32_t BytesRead = 0;
-            do {
-                if (This->FileIdBytes != 0) {
-                    if (Buffer->Length - BytesRead < sizeof(This->PartialFileId) - This->FileIdBytes) {
-                        // Tiny receive...
-                        memcpy(
-                            This->PartialFileIdBytes + This->FileIdBytes,
-                            Buffer->Buffer + BytesRead,
-                            Buffer->Length - BytesRead);
-                        This->FileIdBytes += Buffer->Length - BytesRead;
-                        BytesRead += Buffer->Length - BytesRead;
-                        continue;
-                    } else {
-                        // Completed the partial
-                        memcpy(
-                            This->PartialFileIdBytes + This->FileIdBytes,
-                            Buffer->Buffer + BytesRead,
-                            sizeof(This->PartialFileId) - This->FileIdBytes);
-                        This->FileIdBytes = 0;
-                        BytesRead += sizeof(This->PartialFileId) - This->FileIdBytes;
-                    }
-                } else {
-                    if (Buffer->Length - BytesRead < sizeof(This->PartialFileId)) {
-                        // Read partial FileId
-                        memcpy(
-                            This->PartialFileIdBytes,
-                            Buffer->Buffer + BytesRead,
-                            Buffer->Length - BytesRead);
-                        This->FileIdBytes = Buffer->Length - BytesRead;
-                        BytesRead += Buffer->Length - BytesRead;
-                        continue;
-                    } else {
-                        memcpy(
-                            This->PartialFileIdBytes,
-                            Buffer->Buffer + BytesRead,
-                            sizeof(This->PartialFileId));
-                        BytesRead += sizeof(This->PartialFileId);
-                    }
-                }
-                auto FileItr = This->FileInfos.find(This->PartialFileId);
-                if (FileItr != This->FileInfos.end()) {
-                    This->FileInfos.erase(FileItr);
-                }
-            } while (BytesRead < Buffer->Length);
+    case QUIC_STREAM_EVENT_RECEIVE:
+        if (!This->Parser.Parse(
+                Event->RECEIVE.Buffers,
+                Event->RECEIVE.BufferCount,
+                [This](const uint8_t* Frame, uint32_t Length) {
+                    This->OnControlFrame(Frame, Length);
+                })) {
+            LogError() << "Malformed control stream from server, closing connection";
+            This->Connection->Shutdown((QUIC_UINT62)QUIC_STATUS_INTERNAL_ERROR);
         }
         break;
+    case QUIC_STREAM_EVENT_SEND_COMPLETE: {
+        auto Buffer = (QUIC_BUFFER*)Event->SEND_COMPLETE.ClientContext;
+        This->ControlSendWindow.Release(Buffer->Length);
+        Metrics.ControlSendBytes.Add(-(int64_t)Buffer->Length);
+        free(Buffer);
+        break;
+    }
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        LogInfo() << "Control stream shutdown";
+        break;
+    default:
+        break;
     }
+    return QUIC_STATUS_SUCCESS;
+}
+
+QUIC_STATUS
+QsyncClient::QSyncClientJoinStreamCallback(
+    _In_ MsQuicStream* /*Stream*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event)
+{
+    auto Joined = (MsQuicConnection*)Context;
+    switch (Event->Type) {
     case QUIC_STREAM_EVENT_SEND_COMPLETE:
         free(Event->SEND_COMPLETE.ClientContext);
-        break;
-    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
-        cout << "Control stream shutdown" << endl;
+        if (!Event->SEND_COMPLETE.Canceled) {
+            // The server has seen the hello, so it can match data streams
+            // on this connection with the session.
+            auto This = (QsyncClient*)Joined->Context;
+            lock_guard<mutex> Lock(This->PushConnectionsMutex);
+            This->PushConnections.push_back(Joined);
+        }
         break;
     default:
         break;
@@ -216,40 +308,37 @@ QsyncClient::QSyncClientControlStreamCallback(
 
 QUIC_STATUS
 QsyncClient::QsyncClientConnectionCallback(
-    _In_ MsQuicConnection* /*Connection*/,
+    _In_ MsQuicConnection* Connection,
     _In_opt_ void* Context,
     _Inout_ QUIC_CONNECTION_EVENT* Event)
 {
     QsyncClient* This = (QsyncClient*)Context;
     switch (Event->Type) {
     case QUIC_CONNECTION_EVENT_CONNECTED:
-        cout << "Connected!" << endl;
+        LogInfo().With("resumed", Event->CONNECTED.SessionResumed) << "Connected!";
+        if (Event->CONNECTED.SessionResumed) {
+            Metrics.ConnectionsResumed.Add();
+        }
         break;
     case QUIC_CONNECTION_EVENT_PEER_CERTIFICATE_RECEIVED:
         if (!QcVerifyCertificate(This->CertPw, Event->PEER_CERTIFICATE_RECEIVED.Certificate)) {
             return QUIC_STATUS_BAD_CERTIFICATE;
         }
         break;
-    case QUIC_CONNECTION_EVENT_PEER_STREAM_STARTED: {
-        DataStreamContext* StreamContext = new DataStreamContext();
-        if (StreamContext == nullptr) {
-            cerr << "Failed to allocate DataStreamContext" << endl;
-            return QUIC_STATUS_ABORTED;
-        }
-        MsQuicStream* Stream = new MsQuicStream(Event->PEER_STREAM_STARTED.Stream, CleanUpAutoDelete, QsyncClient::QSyncClientDataStreamCallback, StreamContext);
-        if (Stream == nullptr || QUIC_FAILED(Stream->InitStatus)) {
-            cerr << "Failed to create Client Data Stream" << endl;
-            return QUIC_STATUS_ABORTED;
-        }
-        StreamContext->Stream = Stream;
-        StreamContext->Client = This;
+    case QUIC_CONNECTION_EVENT_RESUMPTION_TICKET_RECEIVED:
+        if (Connection == This->Connection.get() && !This->ResumptionPath.empty()) {
+            QcSavePrivateFile(
+                This->ResumptionPath,
+                Event->RESUMPTION_TICKET_RECEIVED.ResumptionTicket,
+                Event->RESUMPTION_TICKET_RECEIVED.ResumptionTicketLength);
+        }
         break;
-    }
     case QUIC_CONNECTION_EVENT_STREAMS_AVAILABLE:
-        cout << "Allowed Streams: " << Event->STREAMS_AVAILABLE.BidirectionalCount << endl;
+        LogDebug() << "Allowed Streams: " << Event->STREAMS_AVAILABLE.BidirectionalCount;
         break;
     case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE:
-        cout << "Connection shutdown" << endl;
+        LogInfo() << "Connection shutdown";
+        RecordConnectionStatistics(Connection);
         break;
     default:
         break;
@@ -257,6 +346,398 @@ QsyncClient::QsyncClientConnectionCallback(
     return QUIC_STATUS_SUCCESS;
 }
 
+bool
+QsyncClient::SendHello(
+    MsQuicStream* Stream,
+    SessionRole Role,
+    QUIC_SEND_FLAGS Flags)
+{
+    QUIC_BUFFER* Buffer = (QUIC_BUFFER*)malloc(sizeof(QUIC_BUFFER) + sizeof(SessionHello));
+    if (Buffer == nullptr) {
+        LogError() << "Failed to allocate session hello";
+        return false;
+    }
+    Buffer->Buffer = (uint8_t*)(Buffer + 1);
+    Buffer->Length = sizeof(SessionHello);
+    SessionHello* Message = (SessionHello*)Buffer->Buffer;
+    *Message = Hello;
+    Message->Role = Role;
+    QUIC_STATUS Status;
+    if (QUIC_FAILED(Status = Stream->Send(Buffer, 1, Flags, Buffer))) {
+        LogError() << "Failed to send session hello: " << std::hex << Status;
+        free(Buffer);
+        return false;
+    }
+    return true;
+}
+
+void
+QsyncClient::LoadResumptionTicket()
+{
+    EarlyDataFlags = QUIC_SEND_FLAG_NONE;
+    if (ResumptionPath.empty()) {
+        return;
+    }
+    ifstream Input(ResumptionPath, ios::binary | ios::in);
+    if (!Input.good()) {
+        // First sync; the server's ticket is saved for the next one.
+        return;
+    }
+    ResumptionTicket.assign(istreambuf_iterator<char>(Input), istreambuf_iterator<char>());
+    if (ResumptionTicket.empty() ||
+        QUIC_FAILED(Connection->SetResumptionTicket(ResumptionTicket.data(), (uint32_t)ResumptionTicket.size()))) {
+        LogWarning() << "Ignoring unusable resumption ticket " << ResumptionPath;
+        ResumptionTicket.clear();
+        return;
+    }
+    //
+    // Sends queued before the handshake completes may go in 0-RTT. If the
+    // server no longer takes the ticket MsQuic falls back to a full
+    // handshake and sends them again in 1-RTT.
+    //
+    EarlyDataFlags = QUIC_SEND_FLAG_ALLOW_0_RTT;
+}
+
+void
+QsyncClient::StartDataConnections()
+{
+    //
+    // Each connection gets its own UDP socket, and so its own source port,
+    // letting RSS spread them across cores on both ends.
+    //
+    const QUIC_STREAM_SCHEDULING_SCHEME RoundRobin = QUIC_STREAM_SCHEDULING_SCHEME_ROUND_ROBIN;
+    for (auto i = 1u; i < ConnectionCount; ++i) {
+        auto DataConnection = make_unique<MsQuicConnection>(*Reg, CleanUpManual, QsyncClientConnectionCallback, this);
+        if (!DataConnection->IsValid()) {
+            LogError() << "Failed to initialize data MsQuicConnection: "
+                << DataConnection->GetInitStatus();
+            return;
+        }
+        if (QUIC_FAILED(DataConnection->SetParam(QUIC_PARAM_CONN_STREAM_SCHEDULING_SCHEME, sizeof(RoundRobin), &RoundRobin))) {
+            LogError() << "Failed to set Round Robin on data MsQuicConnection";
+            return;
+        }
+        auto JoinStream =
+            new MsQuicStream(
+                *DataConnection,
+                QUIC_STREAM_OPEN_FLAG_NONE,
+                CleanUpAutoDelete,
+                QSyncClientJoinStreamCallback,
+                DataConnection.get());
+        if (!JoinStream->IsValid()) {
+            LogError() << "Failed to initialize join stream: " << JoinStream->GetInitStatus();
+            delete JoinStream;
+            return;
+        }
+        QUIC_STATUS Status;
+        if (QUIC_FAILED(Status = JoinStream->Start(
+            QUIC_STREAM_START_FLAG_IMMEDIATE | QUIC_STREAM_START_FLAG_SHUTDOWN_ON_FAIL))) {
+            LogError() << "Failed to start join stream: " << Status;
+            return;
+        }
+        if (!ResumptionTicket.empty() &&
+            QUIC_FAILED(DataConnection->SetResumptionTicket(ResumptionTicket.data(), (uint32_t)ResumptionTicket.size()))) {
+            LogWarning() << "Failed to set resumption ticket on data connection";
+        }
+        if (!SendHello(JoinStream, SessionJoin, QUIC_SEND_FLAG_FIN | EarlyDataFlags)) {
+            return;
+        }
+        if (QUIC_FAILED(Status = DataConnection->Start(*Config, ServerAddr.c_str(), ServerPort))) {
+            LogError() << "Failed to start data connection: " << Status;
+            return;
+        }
+        DataConnections.push_back(std::move(DataConnection));
+    }
+}
+
+void
+QsyncClient::OnControlFrame(
+    const uint8_t* Frame,
+    uint32_t Length)
+{
+    ControlFrameHeader Header;
+    if (Length < sizeof(Header)) {
+        LogError() << "Control frame too short: " << Length;
+        return;
+    }
+    memcpy(&Header, Frame, sizeof(Header));
+    Frame += sizeof(Header);
+    Length -= sizeof(Header);
+    switch (Header.Type) {
+    case ControlFrameSessionAccepted:
+        if (ConnectionCount > 1) {
+            // The server has registered the token; the others can join it.
+            Pool.Enqueue(&QsyncClient::StartDataConnections, this);
+        }
+        break;
+    case ControlFrameFileAck:
+    case ControlFrameFileFailed: {
+        bool Failed = Header.Type == ControlFrameFileFailed;
+        lock_guard<mutex> Lock(FileInfosMutex);
+        for (uint32_t i = 0; i + sizeof(uint64_t) <= Length; i += sizeof(uint64_t)) {
+            uint64_t FileId;
+            memcpy(&FileId, Frame + i, sizeof(FileId));
+            FileInfos.Remove(FileId);
+            if (Failed) {
+                LogWarning() << "Server failed to sync FileId " << std::hex << FileId;
+                ++FilesFailed;
+            } else {
+                Tracer.Instant(FileId, TraceAcked);
+            }
+            Tracer.End(FileId, TraceFile);
+            ++FilesAcked;
+        }
+        if (FilesAcked >= FilesSent) {
+            AcksCv.notify_all();
+            if (ManifestPending) {
+                Pool.Enqueue(&QsyncClient::SaveManifest, this);
+            }
+        }
+        break;
+    }
+    case ControlFrameWantList: {
+        vector<ThreadpoolTask> Pushes;
+        Pushes.reserve(Length / sizeof(DataRequest));
+        for (uint32_t i = 0; i + sizeof(DataRequest) <= Length; i += sizeof(DataRequest)) {
+            DataRequest Request;
+            memcpy(&Request, Frame + i, sizeof(Request));
+            Pushes.emplace_back([this, Request]() { StartPush(Request); });
+        }
+        Pool.EnqueueBatch(std::move(Pushes));
+        break;
+    }
+    default:
+        LogError() << "Unknown control frame type " << (uint32_t)Header.Type;
+        break;
+    }
+}
+
+void
+QsyncClient::StartPush(
+    DataRequest Request)
+{
+    Tracer.Instant(Request.FileId, TracePushStart);
+    MsQuicConnection* Carrier;
+    {
+        // Spread the streams over every connection that has joined.
+        lock_guard<mutex> Lock(PushConnectionsMutex);
+        Carrier = PushConnections[NextPushConnection++ % PushConnections.size()];
+    }
+    auto Context = new DataStreamContext();
+    Context->Client = this;
+    Context->Request = Request;
+    auto Stream =
+        new MsQuicStream(
+            *Carrier,
+            QUIC_STREAM_OPEN_FLAG_NONE,
+            CleanUpAutoDelete,
+            QSyncClientDataStreamCallback,
+            Context);
+    if (!Stream->IsValid()) {
+        LogError() << "Failed to initialize data stream: " << Stream->GetInitStatus();
+        delete Stream;
+        delete Context;
+        PushStartFailed(Request);
+        return;
+    }
+    Context->Stream = Stream;
+    if (Request.Priority != 0 &&
+        QUIC_FAILED(MsQuic->SetParam(
+            Stream->Handle,
+            QUIC_PARAM_STREAM_PRIORITY,
+            sizeof(Request.Priority),
+            &Request.Priority))) {
+        LogError() << "Failed to set priority on data stream";
+    }
+    QUIC_STATUS Status;
+    if (QUIC_FAILED(Status = Stream->Start(QUIC_STREAM_START_FLAG_SHUTDOWN_ON_FAIL))) {
+        // It still shuts down, and PushStartFailed runs from there.
+        LogError() << "Failed to start data stream: " << Status;
+        Context->StartFailed = true;
+        return;
+    }
+    if (Request.Flags & DataRequestFailed) {
+        // Standing in for a push that never started.
+        Context->SendRequestFailed();
+        return;
+    }
+
+    SerializedFileInfo Serialized;
+    {
+        lock_guard<mutex> Lock(FileInfosMutex);
+        if (!FileInfos.Find(Request.FileId, Serialized)) {
+            LogError() << "No File found for FileId " << Request.FileId;
+            Context->SendRequestFailed();
+            return;
+        }
+        // A speculative push can fail over to a want list, so it keeps its
+        // FileInfo until the ack.
+        if ((Request.Flags & DataRequestSpeculative) == 0 &&
+            (Request.RangeCount <= 1 ||
+             ++RangesRequested[Request.FileId] == Request.RangeCount)) {
+            // Last request for this file; nothing else will ask for it.
+            FileInfos.Remove(Request.FileId);
+            RangesRequested.erase(Request.FileId);
+        }
+    }
+    FileInfoMessage Message(Serialized, Unpacked);
+    auto File = Message.Get();
+    if (Request.Flags & DataRequestSpeculative) {
+        Request.Length = File.getSize();
+        Context->Request.Length = Request.Length;
+    }
+
+    u8string_view PathView((char8_t*)File.getPath().cStr());
+    filesystem::path SyncRoot(SyncPath);
+    auto Source = SyncRoot.has_stem() ? SyncRoot.parent_path() : SyncRoot;
+    Source /= PathView;
+    Context->FileReadStream = std::fstream(Source, ios::binary | ios::in);
+    if (!Context->FileReadStream.good()) {
+        LogError() << "Failed to open file for reading " << Source;
+        Context->SendRequestFailed();
+        return;
+    }
+    error_code Error;
+    auto CurrentSize = filesystem::file_size(Source, Error);
+    if (Error || CurrentSize != File.getSize()) {
+        // The server preallocates the scanned size, so a changed file can't be sent.
+        LogError() << "File changed size since it was scanned " << Source;
+        Context->SendRequestFailed();
+        return;
+    }
+    if (!GetFileDataExtents(Source, CurrentSize, Context->Extents)) {
+        Context->SendRequestFailed();
+        return;
+    }
+    if (Request.Offset > CurrentSize ||
+        Request.Length > CurrentSize - Request.Offset) {
+        LogError() << "Requested range " << Request.Offset << "+" << Request.Length
+            << " is past the end of " << Source;
+        Context->SendRequestFailed();
+        return;
+    }
+    // Nonzero for later ranges and when the server is resuming.
+    Context->ReadOffset = Request.Offset;
+    Context->RangeEnd = Request.Offset + Request.Length;
+    Context->Compress = Compress && !IsLikelyIncompressible(Source);
+    Context->FileIoWorker();
+}
+
+void
+QsyncClient::SendFileInfos()
+{
+    vector<ScannedFile> Batch;
+    // Only the first batch may go in 0-RTT; the server holds it until the
+    // handshake is confirmed, and later ones would only queue behind it.
+    QUIC_SEND_FLAGS SendFlags = EarlyDataFlags;
+    while (ScanQueue.PopBatch(Batch, CONTROL_SEND_BATCH)) {
+        uint64_t Length = 0;
+        for (auto& Scanned : Batch) {
+            Length += sizeof(uint32_t) + Scanned.File.size();
+        }
+        // Waits here, and so fills the scan queue, while the server lags.
+        ControlSendWindow.Acquire(Length);
+        QUIC_BUFFER* Buffer = (QUIC_BUFFER*)malloc(sizeof(QUIC_BUFFER) + Length);
+        if (Buffer == nullptr) {
+            LogError() << "Failed to allocate control stream batch";
+            ControlSendWindow.Release(Length);
+            Batch.clear();
+            continue;
+        }
+        Buffer->Buffer = (uint8_t*)(Buffer + 1);
+        Buffer->Length = (uint32_t)Length;
+        uint8_t* Record = Buffer->Buffer;
+        {
+            lock_guard<mutex> Lock(FileInfosMutex);
+            for (auto& Scanned : Batch) {
+                uint32_t Size = (uint32_t)Scanned.File.size();
+                memcpy(Record, &Size, sizeof(Size));
+                memcpy(Record + sizeof(Size), Scanned.File.data(), Size);
+                Record += sizeof(Size) + Size;
+                if (!FileInfos.Add(Scanned.Id, Scanned.File.data(), Size)) {
+                    LogError() << "ERROR: FileId " << std::hex << Scanned.Id << " is out of order!";
+                    exit(0);
+                }
+            }
+            FilesSent += Batch.size();
+        }
+        QUIC_STATUS Status = ControlStream->Send(Buffer, 1, SendFlags, Buffer);
+        SendFlags = QUIC_SEND_FLAG_NONE;
+        if (QUIC_FAILED(Status)) {
+            LogError() << "Error sending buffer: " << std::hex << Status;
+            ControlSendWindow.Release(Length);
+            free(Buffer);
+            lock_guard<mutex> Lock(FileInfosMutex);
+            FilesSent -= Batch.size();
+            FilesFailed += Batch.size();
+        } else {
+            Metrics.FilesSent.Add(Batch.size());
+            Metrics.ControlSendBytes.Add(Length);
+            for (auto& Scanned : Batch) {
+                Tracer.Instant(Scanned.Id, TraceControlSent);
+            }
+            for (auto& Scanned : Batch) {
+                if (Scanned.Speculative) {
+                    // Start on the data while the server decides whether it wants it.
+                    QueueSpeculativePush(Scanned.Id);
+                }
+            }
+        }
+        Batch.clear();
+    }
+}
+
+void
+QsyncClient::QueueSpeculativePush(
+    uint64_t FileId)
+{
+    DataRequest Request{};
+    Request.FileId = FileId;
+    Request.RangeCount = 1;
+    Request.Flags = DataRequestSpeculative;
+    {
+        lock_guard<mutex> Lock(SpeculativeMutex);
+        if (SpeculativeActive >= MAX_SPECULATIVE_PUSHES) {
+            SpeculativeQueue.push_back(Request);
+            return;
+        }
+        ++SpeculativeActive;
+    }
+    Pool.Enqueue(&QsyncClient::StartPush, this, Request);
+}
+
+void
+QsyncClient::SpeculativePushFinished()
+{
+    DataRequest Next;
+    {
+        lock_guard<mutex> Lock(SpeculativeMutex);
+        if (SpeculativeQueue.empty()) {
+            --SpeculativeActive;
+            return;
+        }
+        Next = SpeculativeQueue.front();
+        SpeculativeQueue.pop_front();
+    }
+    Pool.Enqueue(&QsyncClient::StartPush, this, Next);
+}
+
+void
+QsyncClient::PushStartFailed(
+    DataRequest Request)
+{
+    if ((Request.Flags & DataRequestFailed) == 0) {
+        // A speculative push keeps its slot until this one is done too.
+        Request.Flags |= DataRequestFailed;
+        Pool.Enqueue(&QsyncClient::StartPush, this, Request);
+        return;
+    }
+    LogError() << "Failed to tell the server a push of FileId " << std::hex << Request.FileId << " failed";
+    if (Request.Flags & DataRequestSpeculative) {
+        SpeculativePushFinished();
+    }
+}
+
 bool
 QsyncClient::Start(
         const std::string& ServerAddr,
@@ -270,13 +751,13 @@ QsyncClient::Start(
             QUIC_EXECUTION_PROFILE_TYPE_MAX_THROUGHPUT,
             true);
     if (!Reg->IsValid()) {
-        cerr <<
+        LogError() <<
             "Failed to initialize client MsQuicRegistration: "
-            << Reg->GetInitStatus() << endl;
+            << Reg->GetInitStatus();
         return false;
     }
 
-    if (!QcGenerateAuthCertificate(Password, Pkcs12, Pkcs12Length)) {
+    if (!QcGetAuthCertificate(Password, IdentityPath, Pkcs12, Pkcs12Length)) {
         return false;
     }
 
@@ -300,91 +781,141 @@ QsyncClient::Start(
     }
 
     MsQuicSettings Settings;
-    Settings.SetPeerBidiStreamCount(10);
     Settings.SetDisconnectTimeoutMs(10000);
     Settings.SetSendBufferingEnabled(false);
 
     Config = make_unique<MsQuicConfiguration>(*Reg, Alpn, Settings, Creds);
     if (!Config->IsValid()) {
-        cerr <<
+        LogError() <<
             "Failed to initialize client MsQuicConfiguration: "
-            << Config->GetInitStatus() << endl;
+            << Config->GetInitStatus();
         return false;
     }
 
     Connection = make_unique<MsQuicConnection>(*Reg, CleanUpManual, QsyncClientConnectionCallback, this);
     if (!Connection->IsValid()) {
-        cerr << "Failed to initialize MsQuicConnection: "
-            << Connection->GetInitStatus() << endl;
+        LogError() << "Failed to initialize MsQuicConnection: "
+            << Connection->GetInitStatus();
         return false;
     }
 
     const QUIC_STREAM_SCHEDULING_SCHEME RoundRobin = QUIC_STREAM_SCHEDULING_SCHEME_ROUND_ROBIN;
     if (QUIC_FAILED(Connection->SetParam(QUIC_PARAM_CONN_STREAM_SCHEDULING_SCHEME, sizeof(RoundRobin), &RoundRobin))) {
-        cerr << "Failed to set Round Robin on MsQuicConnection" << endl;
+        LogError() << "Failed to set Round Robin on MsQuicConnection";
         return false;
     }
 
     this->ControlStream = make_unique<MsQuicStream>(*Connection, QUIC_STREAM_OPEN_FLAG_NONE, CleanUpManual, QSyncClientControlStreamCallback, this);
     if (!this->ControlStream->IsValid()) {
-        cerr << "Failed to initialize MsQuicStream: "
-            << this->ControlStream->GetInitStatus() << endl;
+        LogError() << "Failed to initialize MsQuicStream: "
+            << this->ControlStream->GetInitStatus();
         return false;
     }
 
     uint16_t Priority = CONTROL_STREAM_PRIORITY;
     if (QUIC_FAILED(MsQuic->SetParam(this->ControlStream->Handle, QUIC_PARAM_STREAM_PRIORITY, sizeof(Priority), &Priority))) {
-        cerr << "Failed to set priority on ControlStream" << endl;
+        LogError() << "Failed to set priority on ControlStream";
         return false;
     }
 
+    LoadResumptionTicket();
+
     QUIC_STATUS Status;
     if (QUIC_FAILED(Status = this->ControlStream->Start(
         QUIC_STREAM_START_FLAG_IMMEDIATE | QUIC_STREAM_START_FLAG_SHUTDOWN_ON_FAIL))) {
-        cerr << "Failed to start control stream: " << Status << endl;
+        LogError() << "Failed to start control stream: " << Status;
+        return false;
+    }
+
+    memcpy(Hello.Magic, SessionHelloMagic, sizeof(SessionHelloMagic));
+    Hello.Flags = Unpacked ? SessionFlagUnpacked : SessionFlagNone;
+    memset(Hello.Reserved, 0, sizeof(Hello.Reserved));
+    // Everything sent on the control stream counts against its window.
+    ControlSendWindow.Acquire(sizeof(SessionHello));
+    Metrics.ControlSendBytes.Add(sizeof(SessionHello));
+    if (!QcGenerateSessionToken(Hello.Token, sizeof(Hello.Token)) ||
+        !SendHello(ControlStream.get(), SessionControl, EarlyDataFlags)) {
         return false;
     }
+    this->ServerAddr = ServerAddr;
+    this->ServerPort = ServerPort;
+    // The control stream's hello arrives ahead of any want list.
+    PushConnections.push_back(Connection.get());
 
     if (QUIC_FAILED(Status = Connection->Start(*Config, ServerAddr.c_str(), ServerPort))) {
-        cerr << "Failed to start connection: " << Status << endl;
+        LogError() << "Failed to start connection: " << Status;
         return false;
     }
     SyncPath = StartPath;
+    // Same units as FileInfo::modifiedTime, so it can be compared against it.
+    uint64_t ScanTime =
+        chrono::time_point_cast<chrono::seconds>(
+            chrono::file_clock::to_utc(chrono::file_clock::now())).time_since_epoch().count();
+    if (!ManifestPath.empty() && !Manifest.Load(ManifestPath)) {
+        LogWarning() << "Move detection disabled for this sync";
+    }
+    if (Speculate && ManifestPath.empty()) {
+        LogWarning() << "Speculative push needs a manifest (-m); disabled for this sync";
+    }
+    // Scan here while a second stage batches the results onto the control stream.
+    thread Sender(&QsyncClient::SendFileInfos, this);
     FindFiles(
         SyncPath,
-        [this](uint64_t Id, SerializedFileInfo&& File) {
-            if (auto Search = this->FileInfos.find(Id); Search != this->FileInfos.end()) {
-                auto Array = kj::ArrayInputStream(kj::ArrayPtr<const uint8_t>(File.data(), File.size()));
-                auto Message = capnp::PackedMessageReader(Array);
-                auto ParsedFile = Message.getRoot<FileInfo>();
-                cout << "ERROR: " << ParsedFile.getPath().cStr() << " and ";
-                auto Array2 = kj::ArrayInputStream(
-                    kj::ArrayPtr<const uint8_t>(Search->second.data(), Search->second.size()));
-                auto Message2 = capnp::PackedMessageReader(Array2);
-                auto ParsedFile2 = Message2.getRoot<FileInfo>();
-                cerr << ParsedFile2.getPath().cStr() << " hash to the same value!" << std::hex << Id << endl;
-                exit(0);
-            }
-            const auto BufferCount = 2u;
-            uint64_t AllocSize = (BufferCount * sizeof(QUIC_BUFFER)) + sizeof(uint32_t);
-            QUIC_BUFFER* Buffer = (QUIC_BUFFER*)malloc(AllocSize);
-            Buffer->Buffer = (uint8_t*)(Buffer + BufferCount);
-            Buffer->Length = sizeof(uint32_t);
-            uint32_t Size = (uint32_t)File.size();
-            memcpy(Buffer->Buffer, &Size, sizeof(Size));
-            // Advance to the second QUIC_BUFFER
-            QUIC_BUFFER* FileBuffer = Buffer + 1;
-            FileBuffer->Buffer = File.data();
-            FileBuffer->Length = (uint32_t)File.size();
-            auto Result = this->FileInfos.emplace(Id, std::move(File));
-            QUIC_STATUS Status;
-            if (QUIC_FAILED(Status = this->ControlStream->Send(Buffer, BufferCount, QUIC_SEND_FLAG_NONE, Buffer))) {
-                cerr << "Error sending buffer: " << std::hex << Status << endl;
-                free(Buffer);
-            }
-    });
+        [this](uint64_t Id, SerializedFileInfo&& File, bool Speculative) {
+            uint64_t Size = File.size();
+            Metrics.FilesScanned.Add();
+            Tracer.Begin(Id, TraceFile);
+            Tracer.Instant(Id, TraceScanned);
+            this->ScanQueue.Push(ScannedFile{Id, std::move(File), Speculative}, Size);
+        },
+        ManifestPath.empty() ? nullptr : &Manifest,
+        Speculate,
+        Unpacked);
+    ScanQueue.Close();
+    Sender.join();
+    if (!ManifestPath.empty()) {
+        // The next sync trusts it for move and change detection, so it waits
+        // until the server has applied everything this one sent.
+        bool AllAcked;
+        {
+            lock_guard<mutex> Lock(FileInfosMutex);
+            ManifestScanTime = ScanTime;
+            ManifestPending = true;
+            AllAcked = FilesAcked >= FilesSent;
+        }
+        if (AllAcked) {
+            SaveManifest();
+        }
+    }
     if (QUIC_FAILED(Status = ControlStream->Shutdown((QUIC_UINT62)QUIC_STATUS_SUCCESS, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL))) {
-        cerr << "Failed to shutdown control stream " << std::hex << Status << endl;
+        LogError() << "Failed to shutdown control stream " << std::hex << Status;
     }
     return true;
 }
+
+void
+QsyncClient::SaveManifest()
+{
+    {
+        lock_guard<mutex> Lock(FileInfosMutex);
+        if (!ManifestPending || FilesAcked < FilesSent) {
+            return;
+        }
+        ManifestPending = false;
+        if (FilesFailed != 0) {
+            LogWarning() << "Manifest not updated; " << FilesFailed << " files failed to sync";
+            return;
+        }
+    }
+    Manifest.Save(ManifestPath, ManifestScanTime);
+}
+
+bool
+QsyncClient::WaitForAcks(
+    chrono::milliseconds Timeout)
+{
+    unique_lock<mutex> Lock(FileInfosMutex);
+    return
+        AcksCv.wait_for(Lock, Timeout, [this]() { return FilesAcked >= FilesSent; }) &&
+        FilesFailed == 0;
+}
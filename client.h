@@ -1,21 +1,48 @@
 #pragma once
 
+//
+// Serialized FileInfos the scanner may get ahead of the control stream.
+//
+const uint64_t SCAN_QUEUE_BYTES = 0x1000000;
+
+//
+// Control stream bytes sent but not yet acknowledged by the server. With
+// send buffering off MsQuic holds on to our buffers until then.
+//
+const uint64_t CONTROL_SEND_WINDOW = 0x400000;
+
 class QsyncClient {
+    // A scanned file on its way from FindFiles to the control stream.
+    struct ScannedFile {
+        uint64_t Id;
+        SerializedFileInfo File;
+        bool Speculative;
+    };
+
     struct DataStreamContext {
         QsyncClient* Client;
         MsQuicStream* Stream;
         std::fstream FileReadStream;
-        union {
-            uint64_t FileId;
-            uint8_t PartialFileIdBytes[sizeof(FileId)];
-        };
-        uint32_t FileIdBytes;
+        std::vector<FileExtent> Extents;
+        size_t ExtentIndex;
+        uint64_t ReadOffset;
+        uint64_t RangeEnd;
+        uint64_t StreamOffset;
+        // Echoed at the front of the stream so the server can match it up.
+        DataRequest Request;
+        bool RequestSent;
         std::atomic_uint32_t OutstandingSends;
+        ZSTD_CCtx* CCtx;
+        bool Compress;
+        bool CompressionProbed;
         bool EndOfFile;
+        bool StartFailed;
 
         DataStreamContext() = default;
-        ~DataStreamContext() = default;
+        ~DataStreamContext() { ZSTD_freeCCtx(CCtx); }
         void FileIoWorker();
+        void SendRequestFailed();
+        void CompressChunk(DataChunkHeader* Header, QUIC_BUFFER* Payload, uint8_t* Scratch);
     };
 
     uint32_t Pkcs12Length;
@@ -27,17 +54,75 @@ class QsyncClient {
     std::unique_ptr<MsQuicConfiguration> Config;
     std::unique_ptr<MsQuicConnection> Connection;
     std::unique_ptr<MsQuicStream> ControlStream;
-    std::unordered_map<uint64_t, SerializedFileInfo> FileInfos;
+    // Scanned files waiting for the sender, and control stream bytes sent
+    // but not yet acknowledged; both stall the stage before them when full.
+    BoundedQueue<ScannedFile> ScanQueue;
+    ByteBudget ControlSendWindow;
+    // Extra connections that only carry data streams; see SessionHello.
+    std::vector<std::unique_ptr<MsQuicConnection>> DataConnections;
+    std::mutex PushConnectionsMutex;
+    // Connections the server knows the session of, ready for data streams.
+    std::vector<MsQuicConnection*> PushConnections;
+    uint32_t NextPushConnection;
+    std::mutex SpeculativeMutex;
+    // Speculative pushes beyond MAX_SPECULATIVE_PUSHES wait here.
+    std::deque<DataRequest> SpeculativeQueue;
+    uint32_t SpeculativeActive;
+    SessionHello Hello;
+    uint32_t ConnectionCount;
+    std::string ServerAddr;
+    uint16_t ServerPort;
+    std::mutex FileInfosMutex;
+    PendingFileTable FileInfos;
+    // FileInfos sent and FileAcks received, under FileInfosMutex.
+    uint64_t FilesSent;
+    uint64_t FilesAcked;
+    // Of those acked, the ones the server could not sync, plus any that
+    // never made it onto the control stream.
+    uint64_t FilesFailed;
+    // Set once the scan is done; the manifest is saved when the last ack
+    // arrives, and only if nothing failed.
+    bool ManifestPending;
+    uint64_t ManifestScanTime;
+    std::condition_variable AcksCv;
+    // Ranges requested so far of files the server split across streams.
+    std::unordered_map<uint64_t, uint32_t> RangesRequested;
     std::string CertPw;
     std::string SyncPath;
-    union {
-        uint64_t PartialFileId;
-        uint8_t PartialFileIdBytes[8];
-    };
-    uint32_t FileIdBytes;
+    std::string ManifestPath;
+    std::string IdentityPath;
+    std::string ResumptionPath;
+    std::vector<uint8_t> ResumptionTicket;
+    // QUIC_SEND_FLAG_ALLOW_0_RTT once a resumption ticket has been set. Used
+    // for the hellos and the first FileInfo batch only.
+    QUIC_SEND_FLAGS EarlyDataFlags;
+    SyncManifest Manifest;
+    AdaptiveCompression Compression;
+    bool Compress;
+    bool Speculate;
+    bool Unpacked;
+    ControlStreamParser Parser;
 
 public:
-    QsyncClient() : Pool(1) {};
+    QsyncClient(const QsyncSettings& Settings) :
+        Pool(1, false, "client"),
+        ScanQueue(SCAN_QUEUE_BYTES),
+        ControlSendWindow(CONTROL_SEND_WINDOW),
+        NextPushConnection(0),
+        SpeculativeActive(0),
+        ConnectionCount(std::max(Settings.ClientSettings.Connections, 1u)),
+        FilesSent(0),
+        FilesAcked(0),
+        FilesFailed(0),
+        ManifestPending(false),
+        ManifestScanTime(0),
+        ManifestPath(Settings.ClientSettings.ManifestPath ? Settings.ClientSettings.ManifestPath : ""),
+        IdentityPath(Settings.IdentityPath ? Settings.IdentityPath : ""),
+        ResumptionPath(Settings.ClientSettings.ResumptionPath ? Settings.ClientSettings.ResumptionPath : ""),
+        EarlyDataFlags(QUIC_SEND_FLAG_NONE),
+        Compress(Settings.ClientSettings.Compress),
+        Speculate(Settings.ClientSettings.Speculate),
+        Unpacked(Settings.ClientSettings.Unpacked) {};
     QsyncClient(const QsyncClient&) = delete;
     QsyncClient(QsyncClient&&) = default;
     ~QsyncClient() = default;
@@ -49,6 +134,15 @@ public:
         const std::string& SyncPath,
         const std::string& Password);
 
+    //
+    // Waits until the server has acked every file Start sent. Returns true
+    // if each one was current or is now in place, and false on timeout or
+    // if the server failed any of them.
+    //
+    bool
+    WaitForAcks(
+        std::chrono::milliseconds Timeout);
+
 private:
     static
     QUIC_STATUS
@@ -64,6 +158,13 @@ private:
         _In_opt_ void* Context,
         _Inout_ QUIC_STREAM_EVENT* Event);
 
+    static
+    QUIC_STATUS
+    QSyncClientJoinStreamCallback(
+        _In_ MsQuicStream* /*Stream*/,
+        _In_opt_ void* Context,
+        _Inout_ QUIC_STREAM_EVENT* Event);
+
     static
     QUIC_STATUS
     QSyncClientDataStreamCallback(
@@ -71,4 +172,49 @@ private:
         _In_opt_ void* Context,
         _Inout_ QUIC_STREAM_EVENT* Event);
 
+    bool
+    SendHello(
+        MsQuicStream* Stream,
+        SessionRole Role,
+        QUIC_SEND_FLAGS Flags);
+
+    //
+    // Sets the ticket saved by the last sync, if any, on Connection so its
+    // handshake resumes that session and early sends can go in 0-RTT.
+    //
+    void
+    LoadResumptionTicket();
+
+    void
+    StartDataConnections();
+
+    void
+    OnControlFrame(
+        const uint8_t* Frame,
+        uint32_t Length);
+
+    void
+    StartPush(
+        DataRequest Request);
+
+    void
+    SendFileInfos();
+
+    void
+    QueueSpeculativePush(
+        uint64_t FileId);
+
+    void
+    SpeculativePushFinished();
+
+    void
+    SaveManifest();
+
+    //
+    // For a push whose stream never started: tells the server on a new
+    // stream, so it doesn't wait on the range, and its slot, forever.
+    //
+    void
+    PushStartFailed(
+        DataRequest Request);
 };
@@ -0,0 +1,116 @@
+#include "qsync.h"
+
+#include <algorithm>
+#include <cctype>
+
+using namespace std;
+namespace fs = std::filesystem;
+
+const int MIN_COMPRESSION_LEVEL = 1;
+const int MAX_COMPRESSION_LEVEL = 9;
+const auto COMPRESSION_WINDOW = chrono::milliseconds(250);
+const auto COMPRESSION_PROBE_INTERVAL = chrono::seconds(2);
+
+//
+// Formats which are already compressed; zstd won't gain anything on these.
+//
+static const char* const IncompressibleExtensions[] = {
+    ".7z", ".avi", ".br", ".bz2", ".gif", ".gz", ".heic", ".jar", ".jpeg",
+    ".jpg", ".lz4", ".lzma", ".m4a", ".mkv", ".mov", ".mp3", ".mp4", ".ogg",
+    ".png", ".rar", ".tgz", ".webm", ".webp", ".xz", ".zip", ".zst",
+};
+
+bool
+IsLikelyIncompressible(
+    const fs::path& Path)
+{
+    auto Extension = Path.extension().string();
+    transform(
+        Extension.begin(),
+        Extension.end(),
+        Extension.begin(),
+        [](unsigned char c) { return (char)tolower(c); });
+    for (auto Known : IncompressibleExtensions) {
+        if (Extension == Known) {
+            return true;
+        }
+    }
+    return false;
+}
+
+AdaptiveCompression::AdaptiveCompression() :
+    CurrentLevel(MIN_COMPRESSION_LEVEL),
+    CompressedRawBytes(0),
+    CompressedWireBytes(0),
+    CompressNanoseconds(0),
+    SentWireBytes(0),
+    WindowStart(chrono::steady_clock::now()),
+    LastProbe(WindowStart)
+{
+}
+
+void
+AdaptiveCompression::OnCompressed(
+    uint64_t RawBytes,
+    uint64_t WireBytes,
+    uint64_t Nanoseconds)
+{
+    CompressedRawBytes += RawBytes;
+    CompressedWireBytes += WireBytes;
+    CompressNanoseconds += Nanoseconds;
+}
+
+void
+AdaptiveCompression::OnSent(
+    uint64_t WireBytes)
+{
+    SentWireBytes += WireBytes;
+    if (chrono::steady_clock::now() - WindowStart >= COMPRESSION_WINDOW) {
+        UpdateLevel();
+    }
+}
+
+void
+AdaptiveCompression::UpdateLevel()
+{
+    unique_lock<mutex> Lock(Mutex, try_to_lock);
+    if (!Lock.owns_lock()) {
+        return;
+    }
+    auto Now = chrono::steady_clock::now();
+    chrono::duration<double> Window = Now - WindowStart;
+    if (Window < COMPRESSION_WINDOW) {
+        return;
+    }
+    WindowStart = Now;
+    uint64_t WireBytes = CompressedWireBytes.exchange(0);
+    uint64_t Nanoseconds = CompressNanoseconds.exchange(0);
+    uint64_t Sent = SentWireBytes.exchange(0);
+    CompressedRawBytes = 0;
+
+    int Level = CurrentLevel;
+    if (Level == 0) {
+        if (Now - LastProbe >= COMPRESSION_PROBE_INTERVAL) {
+            LastProbe = Now;
+            CurrentLevel = MIN_COMPRESSION_LEVEL;
+        }
+        return;
+    }
+    if (Nanoseconds == 0 || Sent == 0) {
+        return;
+    }
+
+    //
+    // Compare how fast the compressor can emit bytes against how fast the
+    // connection is actually taking them. If the connection keeps up with
+    // the compressor, compression is what limits throughput.
+    //
+    double OutputRate = WireBytes / (Nanoseconds / 1e9);
+    double SendRate = Sent / Window.count();
+    if (OutputRate < SendRate * 1.25) {
+        CurrentLevel = Level - 1 < MIN_COMPRESSION_LEVEL ? 0 : Level - 1;
+        LastProbe = Now;
+    } else if (OutputRate > SendRate * 4 && Level < MAX_COMPRESSION_LEVEL) {
+        CurrentLevel = Level + 1;
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+bool
+IsLikelyIncompressible(
+    const std::filesystem::path& Path);
+
+//
+// Chooses the zstd level for outgoing data chunks. The level is raised while
+// the compressor produces output faster than the connection drains it, and
+// lowered when the compressor becomes the bottleneck. Level 0 means chunks
+// are sent raw; while raw, compression is periodically re-probed.
+//
+class AdaptiveCompression {
+    std::atomic_int CurrentLevel;
+    std::atomic_uint64_t CompressedRawBytes;
+    std::atomic_uint64_t CompressedWireBytes;
+    std::atomic_uint64_t CompressNanoseconds;
+    std::atomic_uint64_t SentWireBytes;
+    std::chrono::steady_clock::time_point WindowStart;
+    std::chrono::steady_clock::time_point LastProbe;
+    std::mutex Mutex;
+
+    void
+    UpdateLevel();
+
+public:
+    AdaptiveCompression();
+    AdaptiveCompression(const AdaptiveCompression&) = delete;
+    AdaptiveCompression& operator= (const AdaptiveCompression&) = delete;
+
+    int
+    Level() const { return CurrentLevel; }
+
+    void
+    OnCompressed(
+        uint64_t RawBytes,
+        uint64_t WireBytes,
+        uint64_t Nanoseconds);
+
+    void
+    OnSent(
+        uint64_t WireBytes);
+};
@@ -0,0 +1,76 @@
+#include "qsync.h"
+
+using namespace std;
+
+const uint32_t MIN_CONCURRENCY_WINDOW = 4;
+const uint32_t INITIAL_CONCURRENCY_WINDOW = 10;
+const auto MIN_CONCURRENCY_INTERVAL = chrono::milliseconds(250);
+const uint32_t CONCURRENCY_INTERVAL_RTTS = 4;
+
+//
+// A finished range counts as this many bytes of progress, so trees of tiny
+// files still show the benefit of more streams.
+//
+const uint64_t RANGE_FINISHED_WEIGHT = 0x10000;
+
+//
+// Disk writers are considered behind when more receives than this many per
+// I/O thread are waiting for them.
+//
+const size_t IO_QUEUE_PER_THREAD_HIGH = 4;
+
+AdaptiveConcurrency::AdaptiveConcurrency() :
+    CurrentWindow(INITIAL_CONCURRENCY_WINDOW),
+    ProgressBytes(0),
+    PreviousWindow(INITIAL_CONCURRENCY_WINDOW),
+    PreviousGoodput(0),
+    WindowStart(chrono::steady_clock::now())
+{
+}
+
+void
+AdaptiveConcurrency::OnRangeFinished()
+{
+    ProgressBytes += RANGE_FINISHED_WEIGHT;
+}
+
+void
+AdaptiveConcurrency::Update(
+    uint32_t RttUs,
+    size_t IoQueueDepth,
+    size_t IoThreads,
+    bool Limited,
+    uint32_t MaxWindow)
+{
+    unique_lock<mutex> Lock(Mutex, try_to_lock);
+    if (!Lock.owns_lock()) {
+        return;
+    }
+    auto Now = chrono::steady_clock::now();
+    auto Interval =
+        max<chrono::steady_clock::duration>(
+            MIN_CONCURRENCY_INTERVAL,
+            chrono::microseconds((uint64_t)RttUs * CONCURRENCY_INTERVAL_RTTS));
+    if (Now - WindowStart < Interval) {
+        return;
+    }
+    double Seconds = chrono::duration<double>(Now - WindowStart).count();
+    double Goodput = ProgressBytes.exchange(0) / Seconds;
+    WindowStart = Now;
+
+    uint32_t Window = CurrentWindow;
+    uint32_t NewWindow = Window;
+    if (IoQueueDepth > IoThreads * IO_QUEUE_PER_THREAD_HIGH) {
+        // More streams would only queue more writes.
+        NewWindow = Window - Window / 4;
+    } else if (Window > PreviousWindow && Goodput < PreviousGoodput * 1.05) {
+        // The last increase didn't help; go back.
+        NewWindow = PreviousWindow;
+    } else if (Limited) {
+        NewWindow = Window + Window / 4 + 1;
+    }
+    NewWindow = clamp(NewWindow, MIN_CONCURRENCY_WINDOW, max(MaxWindow, MIN_CONCURRENCY_WINDOW));
+    PreviousWindow = Window;
+    PreviousGoodput = Goodput;
+    CurrentWindow = NewWindow;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+//
+// Chooses how many data streams a session keeps open. The window grows
+// while opening more streams keeps raising goodput, backs off when the
+// last step didn't pay off, and shrinks when the server's disk writers
+// fall behind. Measurements span several round trips so short-lived
+// streams on high-latency links are judged fairly.
+//
+class AdaptiveConcurrency {
+    std::atomic_uint32_t CurrentWindow;
+    std::atomic_uint64_t ProgressBytes;
+    uint32_t PreviousWindow;
+    double PreviousGoodput;
+    std::chrono::steady_clock::time_point WindowStart;
+    std::mutex Mutex;
+
+public:
+    AdaptiveConcurrency();
+    AdaptiveConcurrency(const AdaptiveConcurrency&) = delete;
+    AdaptiveConcurrency& operator= (const AdaptiveConcurrency&) = delete;
+
+    uint32_t
+    Window() const { return CurrentWindow; }
+
+    void
+    OnWritten(
+        uint64_t Bytes) { ProgressBytes += Bytes; }
+
+    void
+    OnRangeFinished();
+
+    //
+    // Re-evaluates the window once per measurement interval. Limited says
+    // whether transfers were waiting on the window; MaxWindow is the stream
+    // credit the client granted across the session's connections.
+    //
+    void
+    Update(
+        uint32_t RttUs,
+        size_t IoQueueDepth,
+        size_t IoThreads,
+        bool Limited,
+        uint32_t MaxWindow);
+};
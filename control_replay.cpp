@@ -0,0 +1,78 @@
+//
+// Replays a control stream recorded with `qsync s ... -c capture_path`
+// straight into the server's parser and per-file decisions, with no client
+// and no QUIC, so the metadata path can be profiled and compared on its own:
+//
+//   control_replay capture_path /scratch/dest -f 1200 -i 5
+//
+// -f re-splits the stream into receive buffers of that many bytes (0, the
+// default, replays the buffers as they arrived) and -b hands the session
+// that many buffers per receive. Directories and links are applied under
+// dest_root as a real sync would; files that need data are only counted.
+//
+#include "qsync.h"
+
+using namespace std;
+
+// Replay never opens a registration; this only satisfies the linker.
+const MsQuicApi* MsQuic = nullptr;
+
+int
+main(
+    int argc,
+    char** argv)
+{
+    uint32_t FragmentBytes = 0;
+    uint32_t BuffersPerReceive = 1;
+    uint32_t Iterations = 1;
+    vector<char*> Positional;
+    for (int i = 1; i < argc; ++i) {
+        string_view Arg(argv[i]);
+        if (Arg == "-f" && i + 1 < argc) {
+            FragmentBytes = (uint32_t)atol(argv[++i]);
+        } else if (Arg == "-b" && i + 1 < argc) {
+            BuffersPerReceive = (uint32_t)atol(argv[++i]);
+        } else if (Arg == "-i" && i + 1 < argc) {
+            Iterations = max((uint32_t)atol(argv[++i]), 1u);
+        } else {
+            Positional.push_back(argv[i]);
+        }
+    }
+    if (Positional.size() != 2) {
+        cerr << "Usage: " << argv[0] << " capture_path dest_root"
+            << " [-f fragment_bytes] [-b buffers_per_receive] [-i iterations]" << endl;
+        return -1;
+    }
+    Logger.Configure(LogLevelWarning, false);
+
+    ControlCapture Capture;
+    if (!ReadControlCapture(Positional[0], Capture)) {
+        Logger.Stop();
+        return -1;
+    }
+    printf("%s: %zu buffers, %llu bytes\n",
+        Positional[0], Capture.Buffers.size(), (unsigned long long)Capture.TotalBytes);
+
+    QsyncSettings Settings = { };
+    QsyncServer Server(Settings);
+    int Result = 0;
+    for (uint32_t i = 0; i < Iterations; ++i) {
+        ReplayResult Replayed = { };
+        if (!Server.Replay(Positional[1], Capture, FragmentBytes, BuffersPerReceive, Replayed)) {
+            cerr << "Replay stopped on a malformed control stream" << endl;
+            Result = -1;
+        }
+        printf("%u: %.3f s, %.0f files/s, %llu received, %llu current, %llu wanted\n",
+            i,
+            Replayed.Seconds,
+            Replayed.Seconds > 0 ? Replayed.FilesReceived / Replayed.Seconds : 0.0,
+            (unsigned long long)Replayed.FilesReceived,
+            (unsigned long long)Replayed.FilesCurrent,
+            (unsigned long long)Replayed.FilesWanted);
+        if (Result != 0) {
+            break;
+        }
+    }
+    Logger.Stop();
+    return Result;
+}
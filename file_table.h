@@ -0,0 +1,139 @@
+#pragma once
+
+//
+// The client's packed FileInfos that the server may still ask for, by file
+// id. The scanner hands out ids in increasing order, so records are
+// appended to an arena per chunk of FILE_TABLE_CHUNK_IDS ids and found by
+// index, at a cost of a 4-byte offset and a pending bit per file. A chunk
+// is freed as soon as every file in it has been acked or requested.
+//
+// Not thread safe; the client guards it with FileInfosMutex.
+//
+const uint32_t FILE_TABLE_CHUNK_SHIFT = 12;
+const uint32_t FILE_TABLE_CHUNK_IDS = 1u << FILE_TABLE_CHUNK_SHIFT;
+
+class PendingFileTable {
+    struct Chunk {
+        std::vector<uint8_t> Arena;
+        // Record i is Arena[Offsets[i], Offsets[i + 1]).
+        uint32_t Offsets[FILE_TABLE_CHUNK_IDS + 1];
+        uint64_t Pending[FILE_TABLE_CHUNK_IDS / 64];
+        uint32_t PendingCount;
+        uint32_t Filled;
+    };
+
+    // Chunks[0] holds ids starting at BaseId. Freed chunks stay as null
+    // until everything before them is freed too.
+    std::deque<std::unique_ptr<Chunk>> Chunks;
+    uint64_t BaseId;
+    uint64_t NextId;
+
+    Chunk*
+    ChunkFor(
+        uint64_t Id) const
+    {
+        if (Id < BaseId || Id >= NextId) {
+            return nullptr;
+        }
+        return Chunks[(Id - BaseId) >> FILE_TABLE_CHUNK_SHIFT].get();
+    }
+
+    void
+    FreeIfDone(
+        uint64_t Id)
+    {
+        size_t Index = (Id - BaseId) >> FILE_TABLE_CHUNK_SHIFT;
+        auto& Slot = Chunks[Index];
+        if (Slot->PendingCount != 0 || Slot->Filled != FILE_TABLE_CHUNK_IDS) {
+            return;
+        }
+        Slot.reset();
+        while (!Chunks.empty() && Chunks.front() == nullptr) {
+            Chunks.pop_front();
+            BaseId += FILE_TABLE_CHUNK_IDS;
+        }
+    }
+
+public:
+    PendingFileTable() : BaseId(0), NextId(0) {};
+    PendingFileTable(const PendingFileTable&) = delete;
+    PendingFileTable& operator= (const PendingFileTable&) = delete;
+
+    //
+    // Ids must be increasing; ids skipped over are never pending. Returns
+    // false for an id at or below one already added.
+    //
+    bool
+    Add(
+        uint64_t Id,
+        const uint8_t* Record,
+        uint32_t Length)
+    {
+        if (Chunks.empty() && NextId == 0) {
+            BaseId = NextId = Id & ~(uint64_t)(FILE_TABLE_CHUNK_IDS - 1);
+        }
+        if (Id < NextId) {
+            return false;
+        }
+        while (NextId <= Id) {
+            if (((NextId - BaseId) & (FILE_TABLE_CHUNK_IDS - 1)) == 0) {
+                Chunks.push_back(std::make_unique<Chunk>());
+                Chunks.back()->Offsets[0] = 0;
+            }
+            auto Current = Chunks.back().get();
+            uint32_t Slot = Current->Filled++;
+            if (NextId == Id) {
+                Current->Arena.insert(Current->Arena.end(), Record, Record + Length);
+                Current->Pending[Slot / 64] |= 1ull << (Slot % 64);
+                ++Current->PendingCount;
+            }
+            Current->Offsets[Slot + 1] = (uint32_t)Current->Arena.size();
+            ++NextId;
+            if (Current->Filled == FILE_TABLE_CHUNK_IDS) {
+                // Nothing more goes in; drop the arena's growth slack, or the
+                // whole chunk if everything in it is already gone.
+                if (Current->PendingCount != 0) {
+                    Current->Arena.shrink_to_fit();
+                }
+                FreeIfDone(NextId - 1);
+            }
+        }
+        return true;
+    }
+
+    //
+    // Copies out the record for Id. Returns false if it isn't pending.
+    // Unpacked records sit word aligned in the arena, but callers read them
+    // after dropping FileInfosMutex, while the arena may grow and move or
+    // the chunk be freed by a Remove, so they get their own copy.
+    //
+    bool
+    Find(
+        uint64_t Id,
+        SerializedFileInfo& Record) const
+    {
+        auto Current = ChunkFor(Id);
+        uint32_t Slot = (uint32_t)(Id - BaseId) & (FILE_TABLE_CHUNK_IDS - 1);
+        if (Current == nullptr || !(Current->Pending[Slot / 64] & (1ull << (Slot % 64)))) {
+            return false;
+        }
+        Record.assign(
+            Current->Arena.data() + Current->Offsets[Slot],
+            Current->Arena.data() + Current->Offsets[Slot + 1]);
+        return true;
+    }
+
+    void
+    Remove(
+        uint64_t Id)
+    {
+        auto Current = ChunkFor(Id);
+        uint32_t Slot = (uint32_t)(Id - BaseId) & (FILE_TABLE_CHUNK_IDS - 1);
+        if (Current == nullptr || !(Current->Pending[Slot / 64] & (1ull << (Slot % 64)))) {
+            return;
+        }
+        Current->Pending[Slot / 64] &= ~(1ull << (Slot % 64));
+        --Current->PendingCount;
+        FreeIfDone(Id);
+    }
+};
@@ -2,6 +2,12 @@
 
 #include <future>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace std;
 namespace fs = std::filesystem;
 
@@ -13,6 +19,146 @@ namespace fs = std::filesystem;
 static uint64_t FileId = 0;
 const auto FileChunkSize = 100;
 
+//
+// State shared by every folder visited during a single FindFiles walk.
+//
+struct ScanState {
+    SyncManifest* Manifest;
+    bool Speculate;
+    bool Unpacked;
+    // Id and path of the first name seen for each multiply-linked file.
+    unordered_map<FileInodeKey, pair<uint64_t, string>, FileInodeKeyHash> HardLinks;
+    mutex HardLinkMutex;
+};
+
+const char ManifestMagic[4] = {'Q', 'S', 'M', 'F'};
+const uint32_t ManifestVersion = 2;
+
+#pragma pack(push, 1)
+struct ManifestHeader {
+    char Magic[4];
+    uint32_t Version;
+    uint64_t ScanTime;
+};
+
+struct ManifestRecord {
+    uint64_t Device;
+    uint64_t Inode;
+    uint64_t BirthTime;
+    uint32_t PathLength;
+};
+#pragma pack(pop)
+
+bool
+SyncManifest::Load(
+    const fs::path& ManifestPath)
+{
+    error_code Error;
+    if (!fs::exists(ManifestPath, Error)) {
+        // First sync with this manifest; nothing to compare against.
+        return true;
+    }
+    ifstream Input(ManifestPath, ios::binary | ios::in);
+    if (!Input.good()) {
+        LogError() << "Failed to open manifest " << ManifestPath << " " << strerror(errno);
+        return false;
+    }
+    ManifestHeader Header;
+    Input.read((char*)&Header, sizeof(Header));
+    if (!Input.good() ||
+        memcmp(Header.Magic, ManifestMagic, sizeof(ManifestMagic)) != 0 ||
+        Header.Version != ManifestVersion) {
+        LogWarning() << "Ignoring unrecognized manifest " << ManifestPath;
+        return false;
+    }
+    PreviousScanTime = Header.ScanTime;
+    ManifestRecord Record;
+    string Path;
+    while (Input.read((char*)&Record, sizeof(Record))) {
+        Path.resize(Record.PathLength);
+        if (!Input.read(Path.data(), Record.PathLength)) {
+            LogError() << "Manifest " << ManifestPath << " is truncated";
+            break;
+        }
+        Previous.insert_or_assign({Record.Device, Record.Inode}, Entry{Path, Record.BirthTime});
+    }
+    return true;
+}
+
+bool
+SyncManifest::Save(
+    const fs::path& ManifestPath,
+    uint64_t ScanTime)
+{
+    auto TempPath = ManifestPath;
+    TempPath += ".tmp";
+    ofstream Output(TempPath, ios::binary | ios::out | ios::trunc);
+    if (!Output.good()) {
+        LogError() << "Failed to open manifest " << TempPath << " for writing " << strerror(errno);
+        return false;
+    }
+    ManifestHeader Header;
+    memcpy(Header.Magic, ManifestMagic, sizeof(ManifestMagic));
+    Header.Version = ManifestVersion;
+    Header.ScanTime = ScanTime;
+    Output.write((const char*)&Header, sizeof(Header));
+    lock_guard<mutex> Lock(Mutex);
+    for (const auto& [Key, Recorded] : Current) {
+        ManifestRecord Record{Key.Device, Key.Inode, Recorded.BirthTime, (uint32_t)Recorded.Path.size()};
+        Output.write((const char*)&Record, sizeof(Record));
+        Output.write(Recorded.Path.data(), Recorded.Path.size());
+    }
+    Output.close();
+    if (Output.fail()) {
+        LogError() << "Failed to write manifest " << TempPath;
+        return false;
+    }
+    error_code Error;
+    fs::rename(TempPath, ManifestPath, Error);
+    if (Error) {
+        LogError() << "Failed to rename " << TempPath << " to " << ManifestPath << " why " << Error;
+        return false;
+    }
+    return true;
+}
+
+const string*
+SyncManifest::FindPreviousPath(
+    uint64_t Device,
+    uint64_t Inode,
+    uint64_t BirthTime) const
+{
+    auto Itr = Previous.find({Device, Inode});
+    if (Itr == Previous.end() || Itr->second.BirthTime != BirthTime) {
+        return nullptr;
+    }
+    return &Itr->second.Path;
+}
+
+bool
+SyncManifest::IsLikelyChanged(
+    uint64_t Device,
+    uint64_t Inode,
+    uint64_t ModifiedTime) const
+{
+    if (PreviousScanTime == 0) {
+        // No previous sync to compare against.
+        return false;
+    }
+    return ModifiedTime >= PreviousScanTime || !Previous.contains({Device, Inode});
+}
+
+void
+SyncManifest::Record(
+    uint64_t Device,
+    uint64_t Inode,
+    uint64_t BirthTime,
+    const string& Path)
+{
+    lock_guard<mutex> Lock(Mutex);
+    Current.emplace_back(FileInodeKey{Device, Inode}, Entry{Path, BirthTime});
+}
+
 
 bool
 DoesFileNeedUpdate(
@@ -22,6 +168,12 @@ DoesFileNeedUpdate(
     u8string_view PathView((char8_t*)File.getPath().cStr());
     auto FullPath = Destination / PathView;
     error_code Error;
+    if (File.getType() == FileInfo::Type::HARDLINK) {
+        // Current only if it's already a link to the first name.
+        u8string_view LinkView((char8_t*)File.getLinkPath().cStr());
+        auto Equivalent = fs::equivalent(FullPath, Destination / LinkView, Error);
+        return Error || !Equivalent;
+    }
     auto Exists = fs::exists(FullPath, Error);
     if (Error) {
         // Failed to detect if the file exists, don't try to write to it.
@@ -96,6 +248,174 @@ DoesFileNeedUpdate(
     return false;
 }
 
+bool
+MoveFromPreviousPath(
+    const fs::path& Destination,
+    const FileInfo::Reader& File)
+{
+    u8string_view PathView((char8_t*)File.getPath().cStr());
+    u8string_view PreviousView((char8_t*)File.getPreviousPath().cStr());
+    auto FullPath = Destination / PathView;
+    auto PreviousPath = Destination / PreviousView;
+    error_code Error;
+    if (fs::exists(FullPath, Error) || Error) {
+        // Never clobber something already at the new path.
+        return false;
+    }
+    auto Status = fs::symlink_status(PreviousPath, Error);
+    if (Error) {
+        return false;
+    }
+    if (File.getType() == FileInfo::Type::DIR) {
+        if (!fs::is_directory(Status)) {
+            return false;
+        }
+    } else if (File.getType() == FileInfo::Type::FILE) {
+        //
+        // Only reuse the old copy if it still looks exactly like what the
+        // last sync left there; otherwise the data has to be sent anyway.
+        //
+        if (!fs::is_regular_file(Status)) {
+            return false;
+        }
+        auto Size = fs::file_size(PreviousPath, Error);
+        if (Error || Size != File.getSize()) {
+            return false;
+        }
+        auto ModifiedTime = fs::last_write_time(PreviousPath, Error);
+        if (Error) {
+            return false;
+        }
+        chrono::utc_time<chrono::seconds> FileTime(chrono::seconds(File.getModifiedTime()));
+        if (chrono::file_clock::from_utc(FileTime) != chrono::floor<chrono::seconds>(ModifiedTime)) {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    fs::rename(PreviousPath, FullPath, Error);
+    if (Error) {
+        LogError() << "Failed to move " << PreviousPath << " to " << FullPath << " why " << Error;
+        return false;
+    }
+    return true;
+}
+
+bool
+CreateHardLink(
+    const fs::path& Destination,
+    const FileInfo::Reader& File)
+{
+    u8string_view PathView((char8_t*)File.getPath().cStr());
+    u8string_view LinkView((char8_t*)File.getLinkPath().cStr());
+    auto FullPath = Destination / PathView;
+    auto Target = Destination / LinkView;
+    auto TempPath = FullPath;
+    TempPath += ".qsync";
+    error_code Error;
+    fs::remove(TempPath, Error);
+    fs::create_hard_link(Target, TempPath, Error);
+    if (Error) {
+        LogError() << "Failed to link " << FullPath << " to " << Target << " why " << Error;
+        return false;
+    }
+    // Link under a temp name first so an existing file is replaced atomically.
+    fs::rename(TempPath, FullPath, Error);
+    if (Error) {
+        LogError() << "Failed to rename " << TempPath << " to " << FullPath << " why " << Error;
+        fs::remove(TempPath, Error);
+        return false;
+    }
+    return true;
+}
+
+bool
+GetFileDataExtents(
+    const fs::path& Path,
+    uint64_t FileSize,
+    vector<FileExtent>& Extents)
+{
+    Extents.clear();
+#ifndef WIN32
+    int Fd = open(Path.c_str(), O_RDONLY);
+    if (Fd < 0) {
+        LogError() << "Failed to open " << Path << " to find data extents " << strerror(errno);
+        return false;
+    }
+    off_t Position = 0;
+    while ((uint64_t)Position < FileSize) {
+        off_t DataStart = lseek(Fd, Position, SEEK_DATA);
+        if (DataStart < 0) {
+            if (errno == ENXIO) {
+                // No more data before the end of the file; the rest is a hole.
+                break;
+            }
+            // The filesystem can't report holes, so treat the file as dense.
+            Extents.clear();
+            Extents.push_back({0, FileSize});
+            break;
+        }
+        if ((uint64_t)DataStart >= FileSize) {
+            break;
+        }
+        off_t HoleStart = lseek(Fd, DataStart, SEEK_HOLE);
+        if (HoleStart < 0 || (uint64_t)HoleStart > FileSize) {
+            HoleStart = (off_t)FileSize;
+        }
+        Extents.push_back({(uint64_t)DataStart, (uint64_t)(HoleStart - DataStart)});
+        Position = HoleStart;
+    }
+    close(Fd);
+#else
+    UNREFERENCED_PARAMETER(Path);
+    if (FileSize > 0) {
+        Extents.push_back({0, FileSize});
+    }
+#endif
+    return true;
+}
+
+#ifndef WIN32
+bool
+TimedStat(
+    const char* Path,
+    struct stat* Stat)
+{
+    auto Start = MetricNowNs();
+    bool Succeeded = stat(Path, Stat) == 0;
+    Metrics.StatLatency.Record(MetricNowNs() - Start);
+    return Succeeded;
+}
+
+//
+// Nanoseconds since the epoch Path was created at, or 0 if the filesystem
+// doesn't keep it.
+//
+uint64_t
+GetBirthTime(
+    const char* Path)
+{
+    struct statx Stat;
+    if (statx(AT_FDCWD, Path, AT_SYMLINK_NOFOLLOW, STATX_BTIME, &Stat) != 0 ||
+        !(Stat.stx_mask & STATX_BTIME)) {
+        return 0;
+    }
+    return (uint64_t)Stat.stx_btime.tv_sec * 1000000000ull + Stat.stx_btime.tv_nsec;
+}
+
+//
+// Whether nothing is left at Path, so whatever used to be there has moved
+// rather than been copied or replaced.
+//
+bool
+IsPathGone(
+    const fs::path& Path)
+{
+    struct stat Stat;
+    return lstat(Path.c_str(), &Stat) != 0 && (errno == ENOENT || errno == ENOTDIR);
+}
+#endif
+
 template<typename F>
 void
 DirItemToFileInfo(
@@ -103,6 +423,7 @@ DirItemToFileInfo(
     const fs::path& Root,
     const fs::directory_entry& DirItem,
     const FileInfo::Type Type,
+    ScanState& State,
     const fs::path LinkPath = "")
 {
     capnp::MallocMessageBuilder Message;
@@ -120,13 +441,59 @@ DirItemToFileInfo(
         // Use the minimum time in case of error?
         FileTime = fs::file_time_type::min();
     }
-    Builder.setModifiedTime(
+    uint64_t ModifiedTime =
         chrono::time_point_cast<chrono::seconds>(
-            chrono::file_clock::to_utc(FileTime)).time_since_epoch().count());
+            chrono::file_clock::to_utc(FileTime)).time_since_epoch().count();
+    Builder.setModifiedTime(ModifiedTime);
+    bool Speculative = false;
     auto Path = DirItem.path().lexically_relative(Root).generic_u8string();
     Builder.setPath((const char*)Path.data());
     auto Id = ++FileId;
     Builder.setId(Id);
+#ifndef WIN32
+    struct stat Stat;
+    if ((Type == FileInfo::Type::FILE || Type == FileInfo::Type::DIR) &&
+        TimedStat(DirItem.path().c_str(), &Stat)) {
+        Builder.setDevice(Stat.st_dev);
+        Builder.setInode(Stat.st_ino);
+        string PathString((const char*)Path.data(), Path.size());
+        if (Type == FileInfo::Type::FILE && Stat.st_nlink > 1) {
+            //
+            // Only the first name of a hard-linked file carries data; the
+            // rest are sent as links to it and recreated with link().
+            //
+            lock_guard<mutex> Lock(State.HardLinkMutex);
+            auto [Itr, Inserted] =
+                State.HardLinks.try_emplace({(uint64_t)Stat.st_dev, (uint64_t)Stat.st_ino}, Id, PathString);
+            if (!Inserted) {
+                Builder.setType(FileInfo::Type::HARDLINK);
+                Builder.setLinkPath(Itr->second.second.c_str());
+            }
+            Builder.setLinkId(Itr->second.first);
+        }
+        if (State.Manifest != nullptr) {
+            //
+            // A directory's inode is reused as soon as it's removed, and
+            // most trees are mostly directories, so only trust a directory
+            // move when its birth time matches too.
+            //
+            uint64_t BirthTime = Type == FileInfo::Type::DIR ? GetBirthTime(DirItem.path().c_str()) : 0;
+            const string* PreviousPath = nullptr;
+            if (Type != FileInfo::Type::DIR || BirthTime != 0) {
+                PreviousPath = State.Manifest->FindPreviousPath(Stat.st_dev, Stat.st_ino, BirthTime);
+            }
+            if (PreviousPath != nullptr && *PreviousPath != PathString &&
+                IsPathGone(Root / u8string_view((const char8_t*)PreviousPath->c_str()))) {
+                Builder.setPreviousPath(PreviousPath->c_str());
+            } else if (State.Speculate && Builder.getType() == FileInfo::Type::FILE) {
+                // Moved files are renamed on the server, not sent.
+                Speculative = State.Manifest->IsLikelyChanged(Stat.st_dev, Stat.st_ino, ModifiedTime);
+                Builder.setSpeculative(Speculative);
+            }
+            State.Manifest->Record(Stat.st_dev, Stat.st_ino, BirthTime, PathString);
+        }
+    }
+#endif
     if ((Type == FileInfo::Type::FILESYMLINK ||
         Type == FileInfo::Type::DIRSYMLINK) && LinkPath != "") {
         auto LinkPathStr = LinkPath.generic_u8string();
@@ -136,8 +503,13 @@ DirItemToFileInfo(
     SerializedFileInfo Data;
     Data.reserve(Message.sizeInWords() * sizeof(capnp::word));
     VectorStream Stream(Data);
-    capnp::writePackedMessage(Stream, Message);
-    Callback(Id, std::move(Data));
+    if (State.Unpacked) {
+        // Whole words, so the reader can use it in place.
+        capnp::writeMessage(Stream, Message);
+    } else {
+        capnp::writePackedMessage(Stream, Message);
+    }
+    Callback(Id, std::move(Data), Speculative);
 }
 
 template<typename F>
@@ -145,7 +517,8 @@ tuple<vector<fs::path>, bool>
 ProcessFolder(
     F Callback,
     const fs::path& Root,
-    const fs::path& Parent)
+    const fs::path& Parent,
+    ScanState& State)
 {
     bool Success = true;
     error_code Error;
@@ -164,9 +537,9 @@ ProcessFolder(
         }
         if (fs::is_directory(ItemStatus)) {
             Directories.push_back(DirItem.path());
-            DirItemToFileInfo(Callback, Root, DirItem, FileInfo::Type::DIR);
+            DirItemToFileInfo(Callback, Root, DirItem, FileInfo::Type::DIR, State);
         } else if (fs::is_regular_file(ItemStatus)) {
-            DirItemToFileInfo(Callback, Root, DirItem, FileInfo::Type::FILE);
+            DirItemToFileInfo(Callback, Root, DirItem, FileInfo::Type::FILE, State);
         } else if (fs::is_symlink(ItemStatus)) {
             auto LinkPath = fs::read_symlink(DirItem.path(), Error);
             if (Error) {
@@ -182,9 +555,9 @@ ProcessFolder(
             }
             if (fs::is_directory(LinkStatus)) {
                 // Do we traverse symlink directories?
-                DirItemToFileInfo(Callback, Root, DirItem, FileInfo::Type::DIRSYMLINK, LinkPath);
+                DirItemToFileInfo(Callback, Root, DirItem, FileInfo::Type::DIRSYMLINK, State, LinkPath);
             } else if (fs::is_regular_file(LinkStatus)) {
-                DirItemToFileInfo(Callback, Root, DirItem, FileInfo::Type::FILESYMLINK, LinkPath);
+                DirItemToFileInfo(Callback, Root, DirItem, FileInfo::Type::FILESYMLINK, State, LinkPath);
             }
         }
     }
@@ -194,12 +567,15 @@ ProcessFolder(
 bool
 FindFiles(
     const string& Root,
-    std::function<FileResultsCallback> Callback)
+    std::function<FileResultsCallback> Callback,
+    SyncManifest* Manifest,
+    bool Speculate,
+    bool Unpacked)
 {
     error_code Error;
     fs::path RootPath{Root};
     if (!fs::exists(RootPath, Error) || !fs::is_directory(RootPath, Error)) {
-        cerr << "Path doesn't exist or isn't a directory" << endl;
+        LogError() << "Path doesn't exist or isn't a directory";
         return false;
     }
     if (Error) {
@@ -207,13 +583,17 @@ FindFiles(
     }
     fs::path CanonicalRoot = fs::canonical(RootPath, Error);
     if (Error) {
-        cerr << "Could not make canonical path for " << RootPath << endl;
+        LogError() << "Could not make canonical path for " << RootPath;
         return false;
     }
     auto LexicalRoot = !RootPath.has_stem() ? CanonicalRoot : CanonicalRoot.parent_path();
+    ScanState State;
+    State.Manifest = Manifest;
+    State.Speculate = Speculate && Manifest != nullptr;
+    State.Unpacked = Unpacked;
 
     if (RootPath.has_stem()) {
-        DirItemToFileInfo(Callback, LexicalRoot, fs::directory_entry(CanonicalRoot), FileInfo::Type::DIR);
+        DirItemToFileInfo(Callback, LexicalRoot, fs::directory_entry(CanonicalRoot), FileInfo::Type::DIR, State);
     }
 
     bool Result = true;
@@ -225,7 +605,7 @@ FindFiles(
         bool DirSuccess;
         auto CurrentDirectory = UnexploredDirs.front();
         UnexploredDirs.pop_front();
-        std::tie(Directories, DirSuccess) = ProcessFolder(Callback, LexicalRoot, CurrentDirectory);
+        std::tie(Directories, DirSuccess) = ProcessFolder(Callback, LexicalRoot, CurrentDirectory, State);
 
         UnexploredDirs.insert(UnexploredDirs.end(), Directories.begin(), Directories.end());
         if (!DirSuccess) {
@@ -239,12 +619,13 @@ FindFiles(
 bool
 FindFilesParallel(
     const string& Root,
-    std::function<FileResultsCallback> Callback)
+    std::function<FileResultsCallback> Callback,
+    SyncManifest* Manifest = nullptr)
 {
     error_code Error;
     fs::path RootPath{Root};
     if (!fs::exists(RootPath, Error) || !fs::is_directory(RootPath, Error)) {
-        cerr << "Path doesn't exist or isn't a directory" << endl;
+        LogError() << "Path doesn't exist or isn't a directory";
         return false;
     }
     if (Error) {
@@ -252,10 +633,14 @@ FindFilesParallel(
     }
     fs::path CanonicalRoot = fs::canonical(RootPath, Error);
     if (Error) {
-        cerr << "Could not make canonical path for " << RootPath << endl;
+        LogError() << "Could not make canonical path for " << RootPath;
         return false;
     }
     auto LexicalRoot = !RootPath.has_stem() ? CanonicalRoot : CanonicalRoot.parent_path();
+    ScanState State;
+    State.Manifest = Manifest;
+    State.Speculate = false;
+    State.Unpacked = false;
 
     bool Success = true;
     vector<fs::path> UnexploredDirs{};
@@ -265,7 +650,7 @@ FindFilesParallel(
         vector<future<tuple<vector<fs::path>, bool>>> ParallelResults;
         for (auto const& Dir : UnexploredDirs) {
             ParallelResults.push_back(
-                async(launch::async, ProcessFolder<std::function<FileResultsCallback>>, Callback, LexicalRoot, Dir));
+                async(launch::async, ProcessFolder<std::function<FileResultsCallback>>, Callback, LexicalRoot, Dir, ref(State)));
         }
 
         vector<fs::path> Directories{};
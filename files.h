@@ -1,10 +1,114 @@
 using SerializedFileInfo = std::vector<uint8_t>;
 
+struct FileExtent {
+    uint64_t Offset;
+    uint64_t Length;
+};
+
 typedef class QsyncServer QsyncServer;
+typedef class QsyncSession QsyncSession;
+
+struct FileInodeKey {
+    uint64_t Device;
+    uint64_t Inode;
+    bool operator==(const FileInodeKey&) const = default;
+};
+
+struct FileInodeKeyHash {
+    size_t operator()(const FileInodeKey& Key) const {
+        return std::hash<uint64_t>()(Key.Inode * 0x9E3779B97F4A7C15ull ^ Key.Device);
+    }
+};
+
+//
+// Record of where each (device, inode) lived during the previous sync from
+// this client. The scanner looks entries up here to tell the server that a
+// path is really a move of an old one, and records the current tree so the
+// next sync can do the same.
+//
+class SyncManifest {
+    struct Entry {
+        std::string Path;
+        // Directory birth time, so a reused inode isn't taken for a move;
+        // 0 for files and where the filesystem doesn't report it.
+        uint64_t BirthTime;
+    };
+    std::unordered_map<FileInodeKey, Entry, FileInodeKeyHash> Previous;
+    std::vector<std::pair<FileInodeKey, Entry>> Current;
+    std::mutex Mutex;
+    uint64_t PreviousScanTime;
 
-struct ReceivedFileInfo {
-    SerializedFileInfo FileInfo;
-    QsyncServer* Server;
+public:
+    SyncManifest() : PreviousScanTime(0) {};
+
+    bool
+    Load(
+        const std::filesystem::path& ManifestPath);
+
+    bool
+    Save(
+        const std::filesystem::path& ManifestPath,
+        uint64_t ScanTime);
+
+    //
+    // Returns null unless the inode was recorded with the same BirthTime.
+    //
+    const std::string*
+    FindPreviousPath(
+        uint64_t Device,
+        uint64_t Inode,
+        uint64_t BirthTime) const;
+
+    void
+    Record(
+        uint64_t Device,
+        uint64_t Inode,
+        uint64_t BirthTime,
+        const std::string& Path);
+
+    uint64_t
+    GetPreviousScanTime() const { return PreviousScanTime; }
+
+    bool
+    IsLikelyChanged(
+        uint64_t Device,
+        uint64_t Inode,
+        uint64_t ModifiedTime) const;
+};
+
+//
+// Reads a serialized FileInfo in either wire format. Unpacked records are
+// read in place, so they must be word aligned and outlive the reader;
+// packed ones are unpacked into a segment the reader allocates.
+//
+class FileInfoMessage {
+    std::optional<kj::ArrayInputStream> Input;
+    std::optional<capnp::PackedMessageReader> Packed;
+    std::optional<capnp::FlatArrayMessageReader> Flat;
+
+public:
+    FileInfoMessage(
+        const SerializedFileInfo& Record,
+        bool Unpacked)
+    {
+        if (Unpacked) {
+            Flat.emplace(
+                kj::ArrayPtr<const capnp::word>(
+                    (const capnp::word*)Record.data(),
+                    Record.size() / sizeof(capnp::word)));
+        } else {
+            Input.emplace(kj::ArrayPtr<const uint8_t>(Record.data(), Record.size()));
+            Packed.emplace(*Input);
+        }
+    }
+    FileInfoMessage(const FileInfoMessage&) = delete;
+    FileInfoMessage& operator= (const FileInfoMessage&) = delete;
+
+    FileInfo::Reader
+    Get()
+    {
+        return Flat ? Flat->getRoot<FileInfo>() : Packed->getRoot<FileInfo>();
+    }
 };
 
 bool
@@ -12,11 +116,36 @@ DoesFileNeedUpdate(
     const std::filesystem::path& Destination,
     const FileInfo::Reader& File);
 
+bool
+MoveFromPreviousPath(
+    const std::filesystem::path& Destination,
+    const FileInfo::Reader& File);
+
+bool
+CreateHardLink(
+    const std::filesystem::path& Destination,
+    const FileInfo::Reader& File);
+
 typedef void (FileResultsCallback)(
     uint64_t Id,
-    SerializedFileInfo&& File);
+    SerializedFileInfo&& File,
+    bool Speculative);
 
+//
+// With Speculate, files the Manifest says likely changed since the
+// previous sync are flagged speculative, and reported as such. With
+// Unpacked, records are written as plain capnp messages; see FileInfoMessage.
+//
 bool
 FindFiles(
     const std::string& Root,
-    std::function<FileResultsCallback> Callback);
+    std::function<FileResultsCallback> Callback,
+    SyncManifest* Manifest = nullptr,
+    bool Speculate = false,
+    bool Unpacked = false);
+
+bool
+GetFileDataExtents(
+    const std::filesystem::path& Path,
+    uint64_t FileSize,
+    std::vector<FileExtent>& Extents);
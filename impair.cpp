@@ -0,0 +1,317 @@
+#include "impair.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <string_view>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace std::chrono;
+
+const size_t IMPAIR_MAX_DATAGRAM = 0x10000;
+const int IMPAIR_POLL_MS = 100;
+
+bool
+ImpairmentProxy::Later(
+    const Packet& Left,
+    const Packet& Right)
+{
+    if (Left.ReleaseAt != Right.ReleaseAt) {
+        return Left.ReleaseAt > Right.ReleaseAt;
+    }
+    return Left.Sequence > Right.Sequence;
+}
+
+ImpairmentProxy::ImpairmentProxy(
+    const ImpairmentSettings& Settings) :
+    Settings(Settings),
+    TargetLength(0),
+    Listen(-1),
+    Random(random_device{}()),
+    NextSequence(0),
+    Running(false)
+{
+    for (auto& Current : Links) {
+        Current.Free = steady_clock::time_point{};
+        Current.Forwarded = 0;
+        Current.Dropped = 0;
+        Current.Reordered = 0;
+    }
+}
+
+bool
+ImpairmentProxy::Start(
+    uint16_t ListenPort,
+    const string& TargetHost,
+    uint16_t TargetPort)
+{
+    addrinfo Hints = {};
+    Hints.ai_family = AF_UNSPEC;
+    Hints.ai_socktype = SOCK_DGRAM;
+    addrinfo* Resolved = nullptr;
+    int Error = getaddrinfo(TargetHost.c_str(), to_string(TargetPort).c_str(), &Hints, &Resolved);
+    if (Error != 0) {
+        cerr << "Failed to resolve " << TargetHost << " " << gai_strerror(Error) << endl;
+        return false;
+    }
+    memcpy(&Target, Resolved->ai_addr, Resolved->ai_addrlen);
+    TargetLength = Resolved->ai_addrlen;
+    freeaddrinfo(Resolved);
+
+    // Listen in the target's family, on every address.
+    sockaddr_storage Local = {};
+    socklen_t LocalLength;
+    if (Target.ss_family == AF_INET6) {
+        auto Address = (sockaddr_in6*)&Local;
+        Address->sin6_family = AF_INET6;
+        Address->sin6_addr = in6addr_any;
+        Address->sin6_port = htons(ListenPort);
+        LocalLength = sizeof(sockaddr_in6);
+    } else {
+        auto Address = (sockaddr_in*)&Local;
+        Address->sin_family = AF_INET;
+        Address->sin_addr.s_addr = htonl(INADDR_ANY);
+        Address->sin_port = htons(ListenPort);
+        LocalLength = sizeof(sockaddr_in);
+    }
+    Listen = socket(Target.ss_family, SOCK_DGRAM, 0);
+    if (Listen < 0 || bind(Listen, (sockaddr*)&Local, LocalLength) != 0) {
+        cerr << "Failed to listen on UDP port " << ListenPort << " " << strerror(errno) << endl;
+        if (Listen >= 0) {
+            close(Listen);
+            Listen = -1;
+        }
+        return false;
+    }
+    fcntl(Listen, F_SETFL, O_NONBLOCK);
+    Running = true;
+    Receiver = thread(&ImpairmentProxy::Receive, this);
+    Sender = thread(&ImpairmentProxy::Send, this);
+    return true;
+}
+
+void
+ImpairmentProxy::Stop()
+{
+    if (!Running.exchange(false)) {
+        return;
+    }
+    {
+        lock_guard<mutex> Lock(QueueMutex);
+        QueueCv.notify_all();
+    }
+    Receiver.join();
+    Sender.join();
+    for (auto& Entry : Upstreams) {
+        close(Entry.second.Socket);
+    }
+    Upstreams.clear();
+    UpstreamsBySocket.clear();
+    Queue.clear();
+    close(Listen);
+    Listen = -1;
+}
+
+ImpairmentProxy::Upstream*
+ImpairmentProxy::UpstreamFor(
+    const sockaddr_storage& Client,
+    socklen_t ClientLength)
+{
+    string Key((const char*)&Client, ClientLength);
+    auto Found = Upstreams.find(Key);
+    if (Found != Upstreams.end()) {
+        return &Found->second;
+    }
+    int Socket = socket(Target.ss_family, SOCK_DGRAM, 0);
+    if (Socket < 0 || connect(Socket, (const sockaddr*)&Target, TargetLength) != 0) {
+        cerr << "Failed to open an upstream socket " << strerror(errno) << endl;
+        if (Socket >= 0) {
+            close(Socket);
+        }
+        return nullptr;
+    }
+    fcntl(Socket, F_SETFL, O_NONBLOCK);
+    auto& Created = Upstreams[Key];
+    Created.Socket = Socket;
+    Created.Client = Client;
+    Created.ClientLength = ClientLength;
+    UpstreamsBySocket[Socket] = &Created;
+    return &Created;
+}
+
+void
+ImpairmentProxy::Impair(
+    Direction Way,
+    int Socket,
+    const sockaddr_storage* To,
+    socklen_t ToLength,
+    const uint8_t* Data,
+    size_t Length)
+{
+    auto& Current = Links[Way];
+    uniform_real_distribution<double> Chance(0.0, 1.0);
+    if (Settings.LossRate > 0 && Chance(Random) < Settings.LossRate) {
+        ++Current.Dropped;
+        return;
+    }
+    auto Now = steady_clock::now();
+    auto Departure = Now;
+    if (Settings.RateBitsPerSecond != 0) {
+        // The packet waits behind what is already queued, then takes its
+        // own serialization time.
+        auto Start = max(Now, Current.Free);
+        double Backlog = duration<double>(Start - Now).count() * Settings.RateBitsPerSecond / 8;
+        if (Settings.QueueBytes != 0 && Backlog + Length > Settings.QueueBytes) {
+            ++Current.Dropped;
+            return;
+        }
+        Current.Free = Start + nanoseconds((uint64_t)(Length * 8 * 1e9 / Settings.RateBitsPerSecond));
+        Departure = Current.Free;
+    }
+    int64_t DelayUs = Settings.DelayUs;
+    if (Settings.JitterUs != 0) {
+        uniform_int_distribution<int64_t> Jitter(-(int64_t)Settings.JitterUs, Settings.JitterUs);
+        DelayUs = max<int64_t>(DelayUs + Jitter(Random), 0);
+    }
+    if (Settings.ReorderRate > 0 && Chance(Random) < Settings.ReorderRate) {
+        DelayUs = 0;
+        ++Current.Reordered;
+    }
+    Packet Item;
+    Item.ReleaseAt = Departure + microseconds(DelayUs);
+    Item.Sequence = NextSequence++;
+    Item.Socket = Socket;
+    Item.ToLength = ToLength;
+    if (To != nullptr) {
+        memcpy(&Item.To, To, ToLength);
+    }
+    Item.Data.assign(Data, Data + Length);
+    lock_guard<mutex> Lock(QueueMutex);
+    Queue.push_back(std::move(Item));
+    push_heap(Queue.begin(), Queue.end(), Later);
+    QueueCv.notify_one();
+}
+
+void
+ImpairmentProxy::Receive()
+{
+    vector<uint8_t> Buffer(IMPAIR_MAX_DATAGRAM);
+    vector<pollfd> Polled;
+    while (Running) {
+        Polled.clear();
+        Polled.push_back(pollfd{Listen, POLLIN, 0});
+        for (auto& Entry : UpstreamsBySocket) {
+            Polled.push_back(pollfd{Entry.first, POLLIN, 0});
+        }
+        if (poll(Polled.data(), Polled.size(), IMPAIR_POLL_MS) <= 0) {
+            continue;
+        }
+        for (auto& Ready : Polled) {
+            if (!(Ready.revents & POLLIN)) {
+                continue;
+            }
+            while (true) {
+                sockaddr_storage From;
+                socklen_t FromLength = sizeof(From);
+                ssize_t Length = recvfrom(Ready.fd, Buffer.data(), Buffer.size(), 0, (sockaddr*)&From, &FromLength);
+                if (Length < 0) {
+                    break;
+                }
+                if (Ready.fd == Listen) {
+                    auto Out = UpstreamFor(From, FromLength);
+                    if (Out != nullptr) {
+                        Impair(ToTarget, Out->Socket, nullptr, 0, Buffer.data(), Length);
+                    }
+                } else {
+                    auto Out = UpstreamsBySocket[Ready.fd];
+                    Impair(ToClient, Listen, &Out->Client, Out->ClientLength, Buffer.data(), Length);
+                }
+            }
+        }
+    }
+}
+
+void
+ImpairmentProxy::Send()
+{
+    unique_lock<mutex> Lock(QueueMutex);
+    while (Running) {
+        if (Queue.empty()) {
+            QueueCv.wait(Lock);
+            continue;
+        }
+        auto ReleaseAt = Queue.front().ReleaseAt;
+        if (ReleaseAt > steady_clock::now()) {
+            QueueCv.wait_until(Lock, ReleaseAt);
+            continue;
+        }
+        pop_heap(Queue.begin(), Queue.end(), Later);
+        Packet Item = std::move(Queue.back());
+        Queue.pop_back();
+        Lock.unlock();
+        ssize_t Sent;
+        if (Item.ToLength != 0) {
+            Sent = sendto(Item.Socket, Item.Data.data(), Item.Data.size(), 0, (const sockaddr*)&Item.To, Item.ToLength);
+        } else {
+            Sent = send(Item.Socket, Item.Data.data(), Item.Data.size(), 0);
+        }
+        auto& Current = Links[Item.Socket == Listen ? ToClient : ToTarget];
+        if (Sent < 0) {
+            // A full socket buffer is loss too.
+            ++Current.Dropped;
+        } else {
+            ++Current.Forwarded;
+        }
+        Lock.lock();
+    }
+}
+
+void
+ImpairmentProxy::PrintStatistics(
+    ostream& Output) const
+{
+    const char* Names[] = {"to target", "to client"};
+    for (int i = 0; i < 2; ++i) {
+        Output << Names[i] << ": " << Links[i].Forwarded << " forwarded, "
+            << Links[i].Dropped << " dropped, "
+            << Links[i].Reordered << " reordered" << endl;
+    }
+}
+
+bool
+ParseImpairmentArgument(
+    ImpairmentSettings& Settings,
+    int& i,
+    int argc,
+    char** argv)
+{
+    string_view Arg(argv[i]);
+    if (i + 1 >= argc) {
+        return false;
+    }
+    double Value = atof(argv[i + 1]);
+    if (Arg == "-d" || Arg == "--delay") {
+        Settings.DelayUs = (uint32_t)(Value * 1000);
+    } else if (Arg == "-j" || Arg == "--jitter") {
+        Settings.JitterUs = (uint32_t)(Value * 1000);
+    } else if (Arg == "-l" || Arg == "--loss") {
+        Settings.LossRate = Value / 100;
+    } else if (Arg == "-r" || Arg == "--reorder") {
+        Settings.ReorderRate = Value / 100;
+    } else if (Arg == "-b" || Arg == "--rate") {
+        Settings.RateBitsPerSecond = (uint64_t)(Value * 1e6);
+    } else if (Arg == "-q" || Arg == "--queue") {
+        Settings.QueueBytes = (uint32_t)(Value * 1024);
+    } else {
+        return false;
+    }
+    ++i;
+    return true;
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+//
+// A UDP forwarder that impairs the traffic through it the way a WAN path
+// would: delay, jitter, loss, reordering and a rate limit with a bounded
+// queue, applied to each direction on its own. Datagrams to the listen
+// port go to the target from an upstream socket per client address, so
+// the several connections of one client stay apart, and replies go back
+// the same way. Linux/POSIX only; it's for benchmarking on one box.
+//
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <ostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/socket.h>
+
+struct ImpairmentSettings {
+    // One way; a round trip adds it twice.
+    uint32_t DelayUs;
+    // Each packet's delay is moved by up to this much either way.
+    uint32_t JitterUs;
+    double LossRate;
+    // Packets that skip the delay, and so overtake the ones before them.
+    double ReorderRate;
+    // Zero for no limit.
+    uint64_t RateBitsPerSecond;
+    // Packets that would wait behind more than this for the rate limit are
+    // dropped. Zero for no limit.
+    uint32_t QueueBytes;
+
+    bool
+    Any() const
+    {
+        return DelayUs != 0 || JitterUs != 0 || LossRate > 0 || ReorderRate > 0 || RateBitsPerSecond != 0;
+    }
+};
+
+//
+// Reads the option at argv[i], and its value, into Settings; returns false
+// if it isn't one. Delay and jitter are in milliseconds one way, loss and
+// reorder in percent, rate in Mbps and queue in KiB:
+// -d/--delay, -j/--jitter, -l/--loss, -r/--reorder, -b/--rate, -q/--queue.
+//
+bool
+ParseImpairmentArgument(
+    ImpairmentSettings& Settings,
+    int& i,
+    int argc,
+    char** argv);
+
+class ImpairmentProxy {
+    enum Direction {
+        ToTarget = 0,
+        ToClient = 1,
+    };
+
+    struct Packet {
+        std::chrono::steady_clock::time_point ReleaseAt;
+        // Keeps packets released at the same time in arrival order.
+        uint64_t Sequence;
+        int Socket;
+        sockaddr_storage To;
+        socklen_t ToLength;
+        std::vector<uint8_t> Data;
+    };
+
+    struct Upstream {
+        int Socket;
+        sockaddr_storage Client;
+        socklen_t ClientLength;
+    };
+
+    struct Link {
+        // When the rate limit lets the next packet start.
+        std::chrono::steady_clock::time_point Free;
+        std::atomic_uint64_t Forwarded;
+        std::atomic_uint64_t Dropped;
+        std::atomic_uint64_t Reordered;
+    };
+
+    ImpairmentSettings Settings;
+    sockaddr_storage Target;
+    socklen_t TargetLength;
+    int Listen;
+    // Receiver thread only.
+    std::unordered_map<std::string, Upstream> Upstreams;
+    std::unordered_map<int, Upstream*> UpstreamsBySocket;
+    std::mt19937_64 Random;
+    uint64_t NextSequence;
+    Link Links[2];
+    // Packets waiting for their release time, as a heap on ReleaseAt.
+    std::mutex QueueMutex;
+    std::condition_variable QueueCv;
+    std::vector<Packet> Queue;
+    std::atomic_bool Running;
+    std::thread Receiver;
+    std::thread Sender;
+
+    static bool Later(const Packet& Left, const Packet& Right);
+    void Receive();
+    void Send();
+    Upstream* UpstreamFor(const sockaddr_storage& Client, socklen_t ClientLength);
+    void Impair(Direction Way, int Socket, const sockaddr_storage* To, socklen_t ToLength, const uint8_t* Data, size_t Length);
+
+public:
+    ImpairmentProxy(const ImpairmentSettings& Settings);
+    ImpairmentProxy(const ImpairmentProxy&) = delete;
+    ImpairmentProxy& operator= (const ImpairmentProxy&) = delete;
+    ~ImpairmentProxy() { Stop(); }
+
+    bool
+    Start(
+        uint16_t ListenPort,
+        const std::string& TargetHost,
+        uint16_t TargetPort);
+
+    void Stop();
+
+    void PrintStatistics(std::ostream& Output) const;
+};
@@ -0,0 +1,43 @@
+//
+// Forwards UDP through an ImpairmentProxy so qsync can be run over a
+// simulated WAN path on one box, e.g. 80 ms RTT with 0.5% loss at 1 Gbps:
+//
+//   impair_proxy 4478 127.0.0.1 4477 -d 40 -j 2 -l 0.5 -b 1000 -q 4096
+//   qsync c 127.0.0.1 4478 password path
+//
+// See ParseImpairmentArgument for the options.
+//
+#include "impair.h"
+
+#include <iostream>
+
+using namespace std;
+
+int
+main(
+    int argc,
+    char** argv)
+{
+    ImpairmentSettings Settings = { };
+    vector<char*> Positional;
+    for (int i = 1; i < argc; ++i) {
+        if (!ParseImpairmentArgument(Settings, i, argc, argv)) {
+            Positional.push_back(argv[i]);
+        }
+    }
+    if (Positional.size() != 3) {
+        cerr << "Usage: " << argv[0] << " listen_port target_host target_port"
+            << " [-d delay_ms] [-j jitter_ms] [-l loss_%] [-r reorder_%] [-b rate_mbps] [-q queue_kib]" << endl;
+        return -1;
+    }
+    ImpairmentProxy Proxy(Settings);
+    if (!Proxy.Start((uint16_t)atol(Positional[0]), Positional[1], (uint16_t)atol(Positional[2]))) {
+        return -1;
+    }
+    do {
+        cout << "Press enter to exit..." << endl;
+    } while (getchar() != '\n');
+    Proxy.Stop();
+    Proxy.PrintStatistics(cout);
+    return 0;
+}
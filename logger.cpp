@@ -0,0 +1,208 @@
+#include "qsync.h"
+
+#include <ctime>
+
+using namespace std;
+
+AsyncLogger Logger;
+
+static const char* const LevelNames[] = {"debug", "info", "warning", "error"};
+static const char LevelLetters[] = {'D', 'I', 'W', 'E'};
+
+uint32_t
+LogThreadIndex()
+{
+    static atomic_uint32_t NextThread{0};
+    static thread_local uint32_t Thread = ++NextThread;
+    return Thread;
+}
+
+LogLine::~LogLine()
+{
+    if (!Stream) {
+        return;
+    }
+    auto Item = new AsyncLogger::Record();
+    Item->TimeUs = chrono::duration_cast<chrono::microseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    Item->Thread = LogThreadIndex();
+    Item->Level = Level;
+    Item->Message = Stream->str();
+    Item->Fields = std::move(Fields);
+    Logger.Submit(Item);
+}
+
+AsyncLogger::AsyncLogger() :
+    Head(&Stub),
+    Tail(&Stub),
+    Pending(0),
+    Queued(0),
+    Dropped(0),
+    MinimumLevel(LogLevelInfo),
+    Json(false),
+    Running(true)
+{
+    Stub.Next = nullptr;
+    Writer = thread(&AsyncLogger::Run, this);
+}
+
+void
+AsyncLogger::Configure(
+    LogLevel MinimumLevel,
+    bool Json)
+{
+    this->MinimumLevel = MinimumLevel;
+    this->Json = Json;
+}
+
+void
+AsyncLogger::Submit(
+    Record* Item)
+{
+    if (!Running) {
+        static mutex LateMutex;
+        lock_guard<mutex> Lock(LateMutex);
+        WriteRecord(*Item);
+        delete Item;
+        return;
+    }
+    if (Queued.fetch_add(1, memory_order_relaxed) >= LOG_QUEUE_MAX_RECORDS) {
+        Queued.fetch_sub(1, memory_order_relaxed);
+        ++Dropped;
+        delete Item;
+        return;
+    }
+    Item->Next.store(nullptr, memory_order_relaxed);
+    auto Previous = Head.exchange(Item, memory_order_acq_rel);
+    Previous->Next.store(Item, memory_order_release);
+    Pending.fetch_add(1, memory_order_release);
+    Pending.notify_one();
+}
+
+AsyncLogger::Record*
+AsyncLogger::Pop()
+{
+    auto First = Tail;
+    auto Next = First->Next.load(memory_order_acquire);
+    if (First == &Stub) {
+        if (Next == nullptr) {
+            return nullptr;
+        }
+        Tail = Next;
+        First = Next;
+        Next = Next->Next.load(memory_order_acquire);
+    }
+    if (Next != nullptr) {
+        Tail = Next;
+        return First;
+    }
+    if (First != Head.load(memory_order_acquire)) {
+        // A producer is between its exchange and linking Next; come back.
+        return nullptr;
+    }
+    // First is the only record; put Stub behind it so it can be taken.
+    Stub.Next.store(nullptr, memory_order_relaxed);
+    auto Previous = Head.exchange(&Stub, memory_order_acq_rel);
+    Previous->Next.store(&Stub, memory_order_release);
+    Next = First->Next.load(memory_order_acquire);
+    if (Next != nullptr) {
+        Tail = Next;
+        return First;
+    }
+    return nullptr;
+}
+
+void
+AsyncLogger::WriteRecord(
+    const Record& Item)
+{
+    auto& Output = Item.Level >= LogLevelWarning ? cerr : cout;
+    time_t Seconds = (time_t)(Item.TimeUs / 1000000);
+    tm Local;
+#ifdef WIN32
+    localtime_s(&Local, &Seconds);
+#else
+    localtime_r(&Seconds, &Local);
+#endif
+    char Time[32];
+    size_t Length = strftime(Time, sizeof(Time), "%Y-%m-%dT%H:%M:%S", &Local);
+    snprintf(Time + Length, sizeof(Time) - Length, ".%06u", (uint32_t)(Item.TimeUs % 1000000));
+    if (!Json) {
+        Output << Time << ' ' << LevelLetters[Item.Level] << " [" << Item.Thread << "] " << Item.Message;
+        for (size_t i = 0; i + 1 < Item.Fields.size(); i += 2) {
+            Output << ' ' << Item.Fields[i] << '=' << Item.Fields[i + 1];
+        }
+        Output << '\n';
+        return;
+    }
+    auto Quote = [&Output](const string& Text) {
+        Output << '"';
+        for (unsigned char c : Text) {
+            if (c == '"' || c == '\\') {
+                Output << '\\' << c;
+            } else if (c < 0x20) {
+                char Escaped[8];
+                snprintf(Escaped, sizeof(Escaped), "\\u%04x", c);
+                Output << Escaped;
+            } else {
+                Output << c;
+            }
+        }
+        Output << '"';
+    };
+    Output << "{\"time\": \"" << Time << "\", \"level\": \"" << LevelNames[Item.Level]
+        << "\", \"thread\": " << Item.Thread << ", \"msg\": ";
+    Quote(Item.Message);
+    for (size_t i = 0; i + 1 < Item.Fields.size(); i += 2) {
+        Output << ", ";
+        Quote(Item.Fields[i]);
+        Output << ": ";
+        Quote(Item.Fields[i + 1]);
+    }
+    Output << "}\n";
+}
+
+void
+AsyncLogger::Drain()
+{
+    bool Wrote = false;
+    Record* Item;
+    while ((Item = Pop()) != nullptr) {
+        WriteRecord(*Item);
+        delete Item;
+        Queued.fetch_sub(1, memory_order_relaxed);
+        Wrote = true;
+    }
+    uint64_t Lost = Dropped.exchange(0);
+    if (Lost != 0) {
+        cerr << "[logger] dropped " << Lost << " lines while the console was behind\n";
+        Wrote = true;
+    }
+    if (Wrote) {
+        cout.flush();
+        cerr.flush();
+    }
+}
+
+void
+AsyncLogger::Run()
+{
+    while (Running.load()) {
+        Pending.wait(0, memory_order_acquire);
+        Pending.exchange(0, memory_order_acq_rel);
+        Drain();
+    }
+}
+
+void
+AsyncLogger::Stop()
+{
+    if (!Running.exchange(false)) {
+        return;
+    }
+    Pending.fetch_add(1, memory_order_release);
+    Pending.notify_one();
+    Writer.join();
+    // Anything pushed while the writer was finishing up.
+    Drain();
+}
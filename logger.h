@@ -0,0 +1,144 @@
+#pragma once
+
+//
+// Leveled, structured logging off the calling thread. A log line is
+// formatted into its own buffer, pushed onto a lock-free queue, and
+// written by a background thread, so threads that log never wait on the
+// console or on each other. Errors and warnings go to stderr, the rest to
+// stdout, as text or as JSON lines.
+//
+enum LogLevel : uint8_t {
+    LogLevelDebug = 0,
+    LogLevelInfo = 1,
+    LogLevelWarning = 2,
+    LogLevelError = 3,
+};
+
+//
+// Lines queued beyond this are dropped, and counted, rather than letting a
+// stalled console grow the queue without bound.
+//
+const uint64_t LOG_QUEUE_MAX_RECORDS = 0x10000;
+
+class AsyncLogger {
+public:
+    struct Record {
+        std::atomic<Record*> Next;
+        uint64_t TimeUs;
+        uint32_t Thread;
+        LogLevel Level;
+        std::string Message;
+        // Key/value pairs, each stored as key then value.
+        std::vector<std::string> Fields;
+    };
+
+private:
+    // Multi-producer, single-consumer list: producers swap Head, the writer
+    // follows Next pointers from Tail. Stub keeps it from ever being empty.
+    std::atomic<Record*> Head;
+    Record* Tail;
+    Record Stub;
+    std::atomic_uint32_t Pending;
+    std::atomic_uint64_t Queued;
+    std::atomic_uint64_t Dropped;
+    std::atomic<LogLevel> MinimumLevel;
+    std::atomic_bool Json;
+    std::atomic_bool Running;
+    std::thread Writer;
+
+    Record* Pop();
+    void WriteRecord(const Record& Item);
+    void Drain();
+    void Run();
+
+public:
+    AsyncLogger();
+    AsyncLogger(const AsyncLogger&) = delete;
+    AsyncLogger& operator= (const AsyncLogger&) = delete;
+    ~AsyncLogger() { Stop(); }
+
+    void Configure(LogLevel MinimumLevel, bool Json);
+
+    bool
+    Enabled(
+        LogLevel Level) const
+    {
+        return Level >= MinimumLevel.load(std::memory_order_relaxed);
+    }
+
+    void Submit(Record* Item);
+
+    //
+    // Writes out everything queued and stops the writer; later lines are
+    // written synchronously.
+    //
+    void Stop();
+};
+
+extern AsyncLogger Logger;
+
+//
+// One line, built with << like a stream and submitted when it goes out of
+// scope. Nothing is formatted when its level is filtered out.
+//
+class LogLine {
+    LogLevel Level;
+    std::optional<std::ostringstream> Stream;
+    std::vector<std::string> Fields;
+
+public:
+    LogLine(LogLevel Level) : Level(Level)
+    {
+        if (Logger.Enabled(Level)) {
+            Stream.emplace();
+        }
+    }
+    LogLine(const LogLine&) = delete;
+    LogLine& operator= (const LogLine&) = delete;
+    ~LogLine();
+
+    template <typename T>
+    LogLine&
+    operator<<(
+        const T& Value)
+    {
+        if (Stream) {
+            *Stream << Value;
+        }
+        return *this;
+    }
+
+    LogLine&
+    operator<<(
+        std::ios_base& (*Manipulator)(std::ios_base&))
+    {
+        if (Stream) {
+            *Stream << Manipulator;
+        }
+        return *this;
+    }
+
+    //
+    // Attaches a key/value pair, kept apart from the message so it can be
+    // searched for, e.g. LogDebug().With("file", Path) << "Finished file".
+    //
+    template <typename T>
+    LogLine&
+    With(
+        const char* Key,
+        const T& Value)
+    {
+        if (Stream) {
+            std::ostringstream Formatted;
+            Formatted << Value;
+            Fields.emplace_back(Key);
+            Fields.emplace_back(Formatted.str());
+        }
+        return *this;
+    }
+};
+
+inline LogLine LogDebug() { return LogLine(LogLevelDebug); }
+inline LogLine LogInfo() { return LogLine(LogLevelInfo); }
+inline LogLine LogWarning() { return LogLine(LogLevelWarning); }
+inline LogLine LogError() { return LogLine(LogLevelError); }
@@ -0,0 +1,401 @@
+//
+// Syncs generated trees from a QsyncClient to a QsyncServer in this
+// process over localhost, and reports files/s, GB/s, CPU seconds per GB
+// and peak RSS for each workload. Results also go to a JSON file so runs
+// before and after a change can be compared, e.g.
+//
+//   loopback_bench /scratch -o after.json small mixed
+//
+// Impairment options (-d 40 -l 0.5 and so on; see ParseImpairmentArgument)
+// route the client through an ImpairmentProxy to see how it does over a
+// WAN path.
+//
+// Both sides share the process, so CPU time and RSS cover client and
+// server together. The full workloads need about 220 GB of scratch space;
+// -s divides every file count to make a quicker run.
+//
+#include "qsync.h"
+#include "impair.h"
+
+#include <random>
+#include <sys/resource.h>
+
+using namespace std;
+using namespace std::chrono;
+namespace fs = std::filesystem;
+
+MsQuicApi Api;
+const MsQuicApi* MsQuic;
+
+struct BenchWorkload {
+    const char* Name;
+    uint64_t FileCount;
+    // Zero for the mix of sizes in MixedFileSize.
+    uint64_t FileSize;
+    // Sync once untimed, change one file in RESCAN_CHANGE_EVERY, and time
+    // the second sync.
+    bool Rescan;
+};
+
+const BenchWorkload Workloads[] = {
+    {"small", 1000000, 1ull << 10, false},
+    {"large", 10000, 10ull << 20, false},
+    {"huge", 10, 10ull << 30, false},
+    {"mixed", 100000, 0, false},
+    {"rescan", 200000, 4ull << 10, true},
+};
+
+const uint32_t FILES_PER_DIR = 1000;
+const uint32_t RESCAN_CHANGE_EVERY = 100;
+const size_t NOISE_BYTES = 1 << 20;
+const uint16_t DEFAULT_BENCH_PORT = 4477;
+const auto SYNC_TIMEOUT = hours(4);
+const char* const BENCH_PASSWORD = "loopback_bench";
+
+struct BenchResult {
+    uint64_t Files;
+    uint64_t Bytes;
+    double Seconds;
+    double CpuSeconds;
+    uint64_t PeakRssBytes;
+    bool Completed;
+};
+
+uint64_t
+MixedFileSize(
+    uint64_t Index)
+{
+    // Mostly small files, some mid-sized, the odd large one.
+    if (Index % 1000 == 0) {
+        return 64ull << 20;
+    }
+    if (Index % 10 == 0) {
+        return 256ull << 10;
+    }
+    return 4ull << 10;
+}
+
+fs::path
+BenchFilePath(
+    const fs::path& Root,
+    uint64_t Index)
+{
+    return Root / ("d" + to_string(Index / FILES_PER_DIR)) / ("f" + to_string(Index));
+}
+
+//
+// Fills a file from the noise buffer, starting at an offset picked by Seed,
+// so files differ but none of them compress.
+//
+bool
+WriteBenchFile(
+    const fs::path& Path,
+    uint64_t Size,
+    uint64_t Seed,
+    const vector<uint8_t>& Noise)
+{
+    ofstream Output(Path, ios::binary | ios::out | ios::trunc);
+    size_t Offset = (size_t)((Seed * 0x9E3779B97F4A7C15ull) % Noise.size());
+    while (Size > 0 && Output.good()) {
+        size_t Part = (size_t)min<uint64_t>(Size, Noise.size() - Offset);
+        Output.write((const char*)Noise.data() + Offset, Part);
+        Size -= Part;
+        Offset = 0;
+    }
+    if (Output.fail()) {
+        cerr << "Failed to write " << Path << " " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+}
+
+bool
+GenerateTree(
+    const fs::path& Root,
+    const BenchWorkload& Workload,
+    uint64_t FileCount,
+    const vector<uint8_t>& Noise)
+{
+    error_code Error;
+    for (uint64_t i = 0; i < FileCount; ++i) {
+        if (i % FILES_PER_DIR == 0) {
+            fs::create_directories(BenchFilePath(Root, i).parent_path(), Error);
+            if (Error) {
+                cerr << "Failed to create " << BenchFilePath(Root, i).parent_path() << " " << Error << endl;
+                return false;
+            }
+        }
+        uint64_t Size = Workload.FileSize != 0 ? Workload.FileSize : MixedFileSize(i);
+        if (!WriteBenchFile(BenchFilePath(Root, i), Size, i, Noise)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//
+// Rewrites one file in RESCAN_CHANGE_EVERY with new contents, and moves its
+// modified time forward since the sync only compares whole seconds.
+//
+bool
+ChangeTree(
+    const fs::path& Root,
+    const BenchWorkload& Workload,
+    uint64_t FileCount,
+    const vector<uint8_t>& Noise)
+{
+    error_code Error;
+    for (uint64_t i = 0; i < FileCount; i += RESCAN_CHANGE_EVERY) {
+        auto Path = BenchFilePath(Root, i);
+        auto Modified = fs::last_write_time(Path, Error);
+        if (!Error && WriteBenchFile(Path, Workload.FileSize, i + FileCount, Noise)) {
+            fs::last_write_time(Path, Modified + seconds(10), Error);
+        }
+        if (Error) {
+            cerr << "Failed to change " << Path << " " << Error << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+double
+CpuSeconds()
+{
+    struct rusage Usage;
+    getrusage(RUSAGE_SELF, &Usage);
+    return Usage.ru_utime.tv_sec + Usage.ru_utime.tv_usec / 1e6 +
+        Usage.ru_stime.tv_sec + Usage.ru_stime.tv_usec / 1e6;
+}
+
+//
+// Linux keeps the peak RSS in VmHWM and resets it when 5 is written to
+// clear_refs; elsewhere this falls back to the peak of the whole run.
+//
+void
+ResetPeakRss()
+{
+    ofstream ClearRefs("/proc/self/clear_refs");
+    ClearRefs << "5";
+}
+
+uint64_t
+PeakRssBytes()
+{
+    ifstream Status("/proc/self/status");
+    string Line;
+    while (getline(Status, Line)) {
+        if (Line.rfind("VmHWM:", 0) == 0) {
+            return strtoull(Line.c_str() + 6, nullptr, 10) * 1024;
+        }
+    }
+    struct rusage Usage;
+    getrusage(RUSAGE_SELF, &Usage);
+    return (uint64_t)Usage.ru_maxrss * 1024;
+}
+
+bool
+RunSync(
+    const QsyncSettings& Settings,
+    const ImpairmentSettings& Impairment,
+    uint16_t Port,
+    const fs::path& Source,
+    const fs::path& Destination,
+    BenchResult& Result)
+{
+    auto Server = make_unique<QsyncServer>(Settings);
+    if (!Server->Start(Port, Destination.string(), BENCH_PASSWORD)) {
+        return false;
+    }
+    // The proxy takes the next port and forwards to the server's.
+    ImpairmentProxy Proxy(Impairment);
+    uint16_t ClientPort = Port;
+    if (Impairment.Any()) {
+        if (!Proxy.Start(Port + 1, "127.0.0.1", Port)) {
+            return false;
+        }
+        ClientPort = Port + 1;
+    }
+    uint64_t FilesBefore = Metrics.FilesScanned.Value();
+    uint64_t BytesBefore = Metrics.BytesWritten.Value();
+    ResetPeakRss();
+    double CpuBefore = CpuSeconds();
+    auto Start = steady_clock::now();
+
+    auto Client = make_unique<QsyncClient>(Settings);
+    Result.Completed =
+        Client->Start("127.0.0.1", ClientPort, Source.string(), BENCH_PASSWORD) &&
+        Client->WaitForAcks(SYNC_TIMEOUT);
+
+    Result.Seconds = duration<double>(steady_clock::now() - Start).count();
+    Result.CpuSeconds = CpuSeconds() - CpuBefore;
+    Result.PeakRssBytes = PeakRssBytes();
+    Result.Files = Metrics.FilesScanned.Value() - FilesBefore;
+    Result.Bytes = Metrics.BytesWritten.Value() - BytesBefore;
+    // The client goes first so the server sees its connections close.
+    Client.reset();
+    Server.reset();
+    if (Impairment.Any()) {
+        Proxy.Stop();
+        Proxy.PrintStatistics(cout);
+    }
+    return Result.Completed;
+}
+
+void
+PrintResult(
+    const char* Name,
+    const BenchResult& Result)
+{
+    double Gigabytes = Result.Bytes / 1e9;
+    // A run that failed before it was timed has no rates.
+    bool Timed = Result.Seconds > 0;
+    printf("%-7s %9llu files %9.2f GB %8.2f s %10.0f files/s %7.3f GB/s %8.2f cpu s/GB %8.1f MB peak RSS%s\n",
+        Name,
+        (unsigned long long)Result.Files,
+        Gigabytes,
+        Result.Seconds,
+        Timed ? Result.Files / Result.Seconds : 0.0,
+        Timed ? Gigabytes / Result.Seconds : 0.0,
+        Gigabytes > 0 ? Result.CpuSeconds / Gigabytes : 0.0,
+        Result.PeakRssBytes / 1e6,
+        Result.Completed ? "" : "  INCOMPLETE");
+}
+
+void
+WriteResultJson(
+    ostream& Output,
+    const char* Name,
+    const BenchResult& Result)
+{
+    double Gigabytes = Result.Bytes / 1e9;
+    // Zero rather than nan or inf, which aren't valid JSON.
+    bool Timed = Result.Seconds > 0;
+    Output << "{\"name\": \"" << Name << "\""
+        << ", \"completed\": " << (Result.Completed ? "true" : "false")
+        << ", \"files\": " << Result.Files
+        << ", \"bytes\": " << Result.Bytes
+        << ", \"seconds\": " << Result.Seconds
+        << ", \"cpu_seconds\": " << Result.CpuSeconds
+        << ", \"files_per_second\": " << (Timed ? Result.Files / Result.Seconds : 0.0)
+        << ", \"gigabytes_per_second\": " << (Timed ? Gigabytes / Result.Seconds : 0.0)
+        << ", \"cpu_seconds_per_gigabyte\": " << (Gigabytes > 0 ? Result.CpuSeconds / Gigabytes : 0.0)
+        << ", \"peak_rss_bytes\": " << Result.PeakRssBytes << "}";
+}
+
+int
+main(
+    int argc,
+    char** argv)
+{
+    QsyncSettings Settings = { };
+    ImpairmentSettings Impairment = { };
+    const char* WorkDir = nullptr;
+    const char* ResultsPath = "loopback_bench.json";
+    uint64_t Scale = 1;
+    uint16_t Port = DEFAULT_BENCH_PORT;
+    vector<const BenchWorkload*> Selected;
+    for (int i = 1; i < argc; ++i) {
+        string_view Arg(argv[i]);
+        if ((Arg == "-o" || Arg == "--output") && i + 1 < argc) {
+            ResultsPath = argv[++i];
+        } else if ((Arg == "-s" || Arg == "--scale") && i + 1 < argc) {
+            Scale = max<uint64_t>(strtoull(argv[++i], nullptr, 10), 1);
+        } else if ((Arg == "-p" || Arg == "--port") && i + 1 < argc) {
+            Port = (uint16_t)atol(argv[++i]);
+        } else if ((Arg == "-n" || Arg == "--connections") && i + 1 < argc) {
+            Settings.ClientSettings.Connections = (uint32_t)atol(argv[++i]);
+        } else if (Arg == "-z" || Arg == "--compress") {
+            Settings.ClientSettings.Compress = true;
+        } else if (Arg == "-u" || Arg == "--unpacked") {
+            Settings.ClientSettings.Unpacked = true;
+        } else if (ParseImpairmentArgument(Impairment, i, argc, argv)) {
+            continue;
+        } else if (WorkDir == nullptr) {
+            WorkDir = argv[i];
+        } else {
+            auto Match = find_if(begin(Workloads), end(Workloads),
+                [Arg](const BenchWorkload& Workload) { return Arg == Workload.Name; });
+            if (Match == end(Workloads)) {
+                cerr << "Unknown workload " << Arg << endl;
+                return -1;
+            }
+            Selected.push_back(&*Match);
+        }
+    }
+    if (WorkDir == nullptr) {
+        cerr << "Usage: " << argv[0]
+            << " scratch_dir [-o results.json] [-s scale] [-p port] [-n connections] [-z] [-u]"
+            << " [-d delay_ms] [-j jitter_ms] [-l loss_%] [-r reorder_%] [-b rate_mbps] [-q queue_kib]"
+            << " [small|large|huge|mixed|rescan ...]" << endl;
+        return -1;
+    }
+    if (Selected.empty()) {
+        for (auto& Workload : Workloads) {
+            Selected.push_back(&Workload);
+        }
+    }
+    if (QUIC_FAILED(Api.GetInitStatus())) {
+        cerr << "Failed to initialize MsQuic: " << Api.GetInitStatus() << endl;
+        return -1;
+    }
+    MsQuic = &Api;
+    // Per-file lines would measure the console rather than the sync.
+    Logger.Configure(LogLevelWarning, false);
+
+    vector<uint8_t> Noise(NOISE_BYTES);
+    mt19937_64 Random(0x5157594e43ull);
+    for (auto& Byte : Noise) {
+        Byte = (uint8_t)Random();
+    }
+
+    ofstream Results(ResultsPath, ios::out | ios::trunc);
+    if (!Results.good()) {
+        cerr << "Failed to open " << ResultsPath << " " << strerror(errno) << endl;
+        return -1;
+    }
+    Results << "{\"scale\": " << Scale
+        << ", \"connections\": " << max(Settings.ClientSettings.Connections, 1u)
+        << ", \"compress\": " << (Settings.ClientSettings.Compress ? "true" : "false")
+        << ", \"unpacked\": " << (Settings.ClientSettings.Unpacked ? "true" : "false")
+        << ", \"delay_us\": " << Impairment.DelayUs
+        << ", \"jitter_us\": " << Impairment.JitterUs
+        << ", \"loss_rate\": " << Impairment.LossRate
+        << ", \"reorder_rate\": " << Impairment.ReorderRate
+        << ", \"rate_bits_per_second\": " << Impairment.RateBitsPerSecond
+        << ", \"queue_bytes\": " << Impairment.QueueBytes
+        << ", \"workloads\": [";
+
+    int Failures = 0;
+    for (size_t w = 0; w < Selected.size(); ++w) {
+        auto& Workload = *Selected[w];
+        uint64_t FileCount = max<uint64_t>(Workload.FileCount / Scale, 1);
+        fs::path Root = fs::path(WorkDir) / (string("qsync_bench_") + Workload.Name);
+        fs::path Source = Root / "src";
+        fs::path Destination = Root / "dst";
+        error_code Error;
+        fs::remove_all(Root, Error);
+        fs::create_directories(Destination, Error);
+        printf("%s: generating %llu files\n", Workload.Name, (unsigned long long)FileCount);
+        fflush(stdout);
+        BenchResult Result = { };
+        bool Ready = GenerateTree(Source, Workload, FileCount, Noise);
+        if (Ready && Workload.Rescan) {
+            BenchResult Initial = { };
+            Ready =
+                RunSync(Settings, Impairment, Port, Source, Destination, Initial) &&
+                ChangeTree(Source, Workload, FileCount, Noise);
+        }
+        if (!Ready || !RunSync(Settings, Impairment, Port, Source, Destination, Result)) {
+            ++Failures;
+        }
+        PrintResult(Workload.Name, Result);
+        Results << (w == 0 ? "\n" : ",\n");
+        WriteResultJson(Results, Workload.Name, Result);
+        Results.flush();
+        fs::remove_all(Root, Error);
+    }
+    Results << "\n]}\n";
+    Logger.Stop();
+    return Failures == 0 ? 0 : -1;
+}
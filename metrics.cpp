@@ -0,0 +1,381 @@
+#include "qsync.h"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+using namespace std;
+
+QsyncMetrics Metrics;
+
+uint32_t
+MetricShard()
+{
+    static atomic_uint32_t NextShard{0};
+    static thread_local uint32_t Shard = NextShard.fetch_add(1, memory_order_relaxed) % METRIC_SHARDS;
+    return Shard;
+}
+
+Metric::Metric(
+    const char* Name,
+    const char* Help,
+    string Labels) :
+    Name(Name),
+    Help(Help),
+    Labels(std::move(Labels))
+{
+    MetricsRegistry::Get().Add(this);
+}
+
+Metric::~Metric()
+{
+    MetricsRegistry::Get().Remove(this);
+}
+
+//
+// Name{Labels,Extra} in Prometheus form.
+//
+void
+WriteSeries(
+    ostream& Output,
+    const Metric& Item,
+    const char* Suffix = "",
+    const string& Extra = "")
+{
+    Output << Item.Name << Suffix;
+    if (!Item.Labels.empty() || !Extra.empty()) {
+        Output << '{' << Item.Labels;
+        if (!Item.Labels.empty() && !Extra.empty()) {
+            Output << ',';
+        }
+        Output << Extra << '}';
+    }
+    Output << ' ';
+}
+
+//
+// "Name" or "Name{Labels}" as a JSON key, with the label quotes escaped.
+//
+void
+WriteJsonKey(
+    ostream& Output,
+    const Metric& Item)
+{
+    Output << '"' << Item.Name;
+    if (!Item.Labels.empty()) {
+        Output << '{';
+        for (auto c : Item.Labels) {
+            if (c == '"' || c == '\\') {
+                Output << '\\';
+            }
+            Output << c;
+        }
+        Output << '}';
+    }
+    Output << "\": ";
+}
+
+uint64_t
+MetricCounter::Value() const
+{
+    uint64_t Total = 0;
+    for (auto& Slot : Shards) {
+        Total += Slot.Value.load(memory_order_relaxed);
+    }
+    return Total;
+}
+
+void
+MetricCounter::WritePrometheus(
+    ostream& Output) const
+{
+    WriteSeries(Output, *this);
+    Output << Value() << '\n';
+}
+
+void
+MetricCounter::WriteJson(
+    ostream& Output) const
+{
+    WriteJsonKey(Output, *this);
+    Output << Value();
+}
+
+void
+MetricGauge::WritePrometheus(
+    ostream& Output) const
+{
+    WriteSeries(Output, *this);
+    Output << Value() << '\n';
+}
+
+void
+MetricGauge::WriteJson(
+    ostream& Output) const
+{
+    WriteJsonKey(Output, *this);
+    Output << Value();
+}
+
+MetricHistogram::MetricHistogram(
+    const char* Name,
+    const char* Help,
+    double Scale,
+    string Labels) :
+    Metric(Name, Help, std::move(Labels)),
+    Shards(new Shard[METRIC_SHARDS]),
+    Scale(Scale)
+{
+}
+
+uint32_t
+MetricHistogram::BucketOf(
+    uint64_t Value)
+{
+    if (Value < SubBuckets) {
+        return (uint32_t)Value;
+    }
+    uint32_t Exponent = (uint32_t)bit_width(Value) - 1;
+    uint32_t Sub = (uint32_t)(Value >> (Exponent - SubBucketBits)) & (SubBuckets - 1);
+    return (Exponent - SubBucketBits + 1) * SubBuckets + Sub;
+}
+
+uint64_t
+MetricHistogram::BucketLimit(
+    uint32_t Bucket)
+{
+    // Smallest value past the bucket.
+    if (Bucket < SubBuckets) {
+        return Bucket + 1;
+    }
+    uint32_t Exponent = Bucket / SubBuckets + SubBucketBits - 1;
+    uint64_t Sub = Bucket % SubBuckets;
+    if (Exponent == 63 && Sub == SubBuckets - 1) {
+        return UINT64_MAX;
+    }
+    return (SubBuckets + Sub + 1) << (Exponent - SubBucketBits);
+}
+
+void
+MetricHistogram::Merge(
+    vector<uint64_t>& Buckets,
+    uint64_t& Count,
+    uint64_t& Sum) const
+{
+    Buckets.assign(BucketCount, 0);
+    Count = 0;
+    Sum = 0;
+    for (auto i = 0u; i < METRIC_SHARDS; ++i) {
+        for (auto b = 0u; b < BucketCount; ++b) {
+            auto Value = Shards[i].Buckets[b].load(memory_order_relaxed);
+            Buckets[b] += Value;
+            Count += Value;
+        }
+        Sum += Shards[i].Sum.load(memory_order_relaxed);
+    }
+}
+
+uint64_t
+MetricHistogram::Percentile(
+    const vector<uint64_t>& Buckets,
+    uint64_t Count,
+    double Fraction)
+{
+    if (Count == 0) {
+        return 0;
+    }
+    uint64_t Rank = (uint64_t)ceil(Fraction * Count);
+    uint64_t Seen = 0;
+    for (auto b = 0u; b < BucketCount; ++b) {
+        Seen += Buckets[b];
+        if (Seen >= Rank) {
+            return BucketLimit(b) - 1;
+        }
+    }
+    return UINT64_MAX;
+}
+
+void
+MetricHistogram::WritePrometheus(
+    ostream& Output) const
+{
+    vector<uint64_t> Buckets;
+    uint64_t Count, Sum;
+    Merge(Buckets, Count, Sum);
+    uint32_t Last = 0;
+    for (auto b = 0u; b < BucketCount; ++b) {
+        if (Buckets[b] != 0) {
+            Last = b;
+        }
+    }
+    //
+    // One le per power of two is plenty for dashboards; the exact buckets
+    // are in the JSON percentiles.
+    //
+    uint64_t Cumulative = 0;
+    for (auto b = 0u; b <= Last; ++b) {
+        Cumulative += Buckets[b];
+        if (b % SubBuckets == SubBuckets - 1 || b == Last) {
+            ostringstream Le;
+            Le << "le=\"" << BucketLimit(b) * Scale << '"';
+            WriteSeries(Output, *this, "_bucket", Le.str());
+            Output << Cumulative << '\n';
+        }
+    }
+    WriteSeries(Output, *this, "_bucket", "le=\"+Inf\"");
+    Output << Count << '\n';
+    WriteSeries(Output, *this, "_sum");
+    Output << Sum * Scale << '\n';
+    WriteSeries(Output, *this, "_count");
+    Output << Count << '\n';
+}
+
+void
+MetricHistogram::WriteJson(
+    ostream& Output) const
+{
+    vector<uint64_t> Buckets;
+    uint64_t Count, Sum;
+    Merge(Buckets, Count, Sum);
+    WriteJsonKey(Output, *this);
+    Output << "{\"count\": " << Count
+        << ", \"sum\": " << Sum * Scale
+        << ", \"p50\": " << Percentile(Buckets, Count, 0.5) * Scale
+        << ", \"p90\": " << Percentile(Buckets, Count, 0.9) * Scale
+        << ", \"p99\": " << Percentile(Buckets, Count, 0.99) * Scale
+        << ", \"max\": " << Percentile(Buckets, Count, 1.0) * Scale << '}';
+}
+
+MetricsRegistry&
+MetricsRegistry::Get()
+{
+    static MetricsRegistry Registry;
+    return Registry;
+}
+
+void
+MetricsRegistry::Add(
+    Metric* Item)
+{
+    lock_guard<mutex> Lock(Mutex);
+    Items.push_back(Item);
+}
+
+void
+MetricsRegistry::Remove(
+    Metric* Item)
+{
+    lock_guard<mutex> Lock(Mutex);
+    Items.erase(std::remove(Items.begin(), Items.end(), Item), Items.end());
+}
+
+void
+MetricsRegistry::WritePrometheus(
+    ostream& Output)
+{
+    lock_guard<mutex> Lock(Mutex);
+    // Series of one name have to be together, under one HELP and TYPE.
+    auto Sorted = Items;
+    stable_sort(Sorted.begin(), Sorted.end(), [](Metric* a, Metric* b) { return strcmp(a->Name, b->Name) < 0; });
+    const char* Previous = nullptr;
+    for (auto Item : Sorted) {
+        if (Previous == nullptr || strcmp(Previous, Item->Name) != 0) {
+            Output << "# HELP " << Item->Name << ' ' << Item->Help << '\n';
+            Output << "# TYPE " << Item->Name << ' ' << Item->Type() << '\n';
+            Previous = Item->Name;
+        }
+        Item->WritePrometheus(Output);
+    }
+}
+
+void
+MetricsRegistry::WriteJson(
+    ostream& Output)
+{
+    lock_guard<mutex> Lock(Mutex);
+    Output << "{\n";
+    for (size_t i = 0; i < Items.size(); ++i) {
+        Output << "  ";
+        Items[i]->WriteJson(Output);
+        Output << (i + 1 < Items.size() ? ",\n" : "\n");
+    }
+    Output << "}\n";
+}
+
+void
+RecordConnectionStatistics(
+    MsQuicConnection* Connection)
+{
+    QUIC_STATISTICS_V2 QuicStats{};
+    if (QUIC_FAILED(Connection->GetStatistics(&QuicStats))) {
+        return;
+    }
+    Metrics.ConnectionRtt.Record(QuicStats.Rtt);
+    Metrics.PacketsSent.Add(QuicStats.SendTotalPackets);
+    Metrics.PacketsLost.Add(QuicStats.SendSuspectedLostPackets);
+    Metrics.PacketsReceived.Add(QuicStats.RecvTotalPackets);
+}
+
+MetricsExporter::MetricsExporter(
+    string Path,
+    chrono::milliseconds Interval) :
+    Path(std::move(Path)),
+    Interval(Interval),
+    Stopping(false)
+{
+    Thread = thread(&MetricsExporter::Run, this);
+}
+
+void
+MetricsExporter::Run()
+{
+    unique_lock<mutex> Lock(Mutex);
+    while (!Cv.wait_for(Lock, Interval, [this]{return Stopping;})) {
+        Lock.unlock();
+        WriteNow(false);
+        Lock.lock();
+    }
+}
+
+void
+MetricsExporter::Stop()
+{
+    {
+        lock_guard<mutex> Lock(Mutex);
+        if (Stopping) {
+            return;
+        }
+        Stopping = true;
+    }
+    Cv.notify_all();
+    Thread.join();
+    WriteNow(true);
+}
+
+bool
+MetricsExporter::WriteNow(
+    bool Json)
+{
+    auto TempPath = Path + ".tmp";
+    {
+        ofstream Output(TempPath, ios::out | ios::trunc);
+        MetricsRegistry::Get().WritePrometheus(Output);
+        if (Output.fail()) {
+            LogError() << "Failed to write metrics to " << TempPath << " " << strerror(errno);
+            return false;
+        }
+    }
+    if (rename(TempPath.c_str(), Path.c_str()) != 0) {
+        LogError() << "Failed to replace " << Path << " " << strerror(errno);
+        return false;
+    }
+    if (Json) {
+        ofstream Output(Path + ".json", ios::out | ios::trunc);
+        MetricsRegistry::Get().WriteJson(Output);
+        if (Output.fail()) {
+            LogError() << "Failed to write metrics to " << Path << ".json " << strerror(errno);
+            return false;
+        }
+    }
+    return true;
+}
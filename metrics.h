@@ -0,0 +1,210 @@
+#pragma once
+
+//
+// Process-wide counters, gauges and latency histograms, cheap enough to
+// update on the data path. Updates land in one of METRIC_SHARDS
+// cache-line-sized slots picked per thread, so threads rarely share a
+// line; readers sum the shards. MetricsExporter writes everything
+// registered as Prometheus text, and as JSON.
+//
+const uint32_t METRIC_SHARDS = 16;
+
+//
+// The calling thread's shard.
+//
+uint32_t
+MetricShard();
+
+inline
+uint64_t
+MetricNowUs()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline
+uint64_t
+MetricNowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class Metric {
+public:
+    const char* Name;
+    const char* Help;
+    // Prometheus labels without the braces, e.g. pool="io", or empty.
+    std::string Labels;
+
+    Metric(const char* Name, const char* Help, std::string Labels = "");
+    Metric(const Metric&) = delete;
+    Metric& operator= (const Metric&) = delete;
+    virtual ~Metric();
+
+    virtual const char* Type() const = 0;
+    virtual void WritePrometheus(std::ostream& Output) const = 0;
+    virtual void WriteJson(std::ostream& Output) const = 0;
+};
+
+class MetricCounter : public Metric {
+    struct alignas(64) Shard {
+        std::atomic_uint64_t Value{0};
+    };
+    Shard Shards[METRIC_SHARDS];
+
+public:
+    using Metric::Metric;
+
+    void
+    Add(
+        uint64_t Amount = 1)
+    {
+        Shards[MetricShard()].Value.fetch_add(Amount, std::memory_order_relaxed);
+    }
+
+    uint64_t
+    Value() const;
+
+    const char* Type() const override { return "counter"; }
+    void WritePrometheus(std::ostream& Output) const override;
+    void WriteJson(std::ostream& Output) const override;
+};
+
+//
+// A level that goes up and down, or one read from elsewhere at export.
+//
+class MetricGauge : public Metric {
+    std::atomic_int64_t Current;
+    std::function<int64_t()> Read;
+
+public:
+    MetricGauge(const char* Name, const char* Help, std::string Labels = "", std::function<int64_t()> Read = nullptr) :
+        Metric(Name, Help, std::move(Labels)), Current(0), Read(std::move(Read)) {}
+
+    void Add(int64_t Amount) { Current.fetch_add(Amount, std::memory_order_relaxed); }
+    void Set(int64_t Amount) { Current.store(Amount, std::memory_order_relaxed); }
+    int64_t Value() const { return Read ? Read() : Current.load(std::memory_order_relaxed); }
+
+    const char* Type() const override { return "gauge"; }
+    void WritePrometheus(std::ostream& Output) const override;
+    void WriteJson(std::ostream& Output) const override;
+};
+
+//
+// Log-linear buckets, eight per power of two, so any recorded value is
+// known to within 12.5% from 1 up to 2^64. Values are recorded in the
+// histogram's base unit (microseconds for latencies) and exported scaled
+// by Scale (to seconds, for Prometheus).
+//
+class MetricHistogram : public Metric {
+public:
+    static constexpr uint32_t SubBucketBits = 3;
+    static constexpr uint32_t SubBuckets = 1u << SubBucketBits;
+    static constexpr uint32_t BucketCount = (64 - SubBucketBits + 1) * SubBuckets;
+
+private:
+    struct alignas(64) Shard {
+        std::atomic_uint64_t Buckets[BucketCount]{};
+        std::atomic_uint64_t Sum{0};
+    };
+    std::unique_ptr<Shard[]> Shards;
+    double Scale;
+
+    static uint32_t BucketOf(uint64_t Value);
+    static uint64_t BucketLimit(uint32_t Bucket);
+    void Merge(std::vector<uint64_t>& Buckets, uint64_t& Count, uint64_t& Sum) const;
+    static uint64_t Percentile(const std::vector<uint64_t>& Buckets, uint64_t Count, double Fraction);
+
+public:
+    MetricHistogram(const char* Name, const char* Help, double Scale = 1.0, std::string Labels = "");
+
+    void
+    Record(
+        uint64_t Value)
+    {
+        auto& Slot = Shards[MetricShard()];
+        Slot.Buckets[BucketOf(Value)].fetch_add(1, std::memory_order_relaxed);
+        Slot.Sum.fetch_add(Value, std::memory_order_relaxed);
+    }
+
+    const char* Type() const override { return "histogram"; }
+    void WritePrometheus(std::ostream& Output) const override;
+    void WriteJson(std::ostream& Output) const override;
+};
+
+class MetricsRegistry {
+    std::mutex Mutex;
+    std::vector<Metric*> Items;
+
+public:
+    static
+    MetricsRegistry&
+    Get();
+
+    void Add(Metric* Item);
+    void Remove(Metric* Item);
+
+    void WritePrometheus(std::ostream& Output);
+    void WriteJson(std::ostream& Output);
+};
+
+//
+// What qsync itself reports. Pools register their own metrics under the
+// name they were given.
+//
+struct QsyncMetrics {
+    MetricCounter FilesScanned{"qsync_files_scanned_total", "Entries the client's scan produced."};
+    MetricCounter FilesSent{"qsync_files_sent_total", "FileInfos the client sent on the control stream."};
+    MetricCounter FilesReceived{"qsync_files_received_total", "FileInfos the server received."};
+    MetricCounter FilesSkipped{"qsync_files_skipped_total", "Files the server already had current."};
+    MetricCounter FilesTransferred{"qsync_files_transferred_total", "Files the server received and renamed into place."};
+    MetricCounter BytesSent{"qsync_bytes_sent_total", "File data bytes the client sent, after compression."};
+    MetricCounter BytesWritten{"qsync_bytes_written_total", "File data bytes the server wrote."};
+    MetricGauge ControlSendBytes{"qsync_control_send_bytes", "Control stream bytes the client sent and the server hasn't acknowledged."};
+    MetricGauge ControlIncoming{"qsync_control_incoming_records", "FileInfos the server received and hasn't processed yet."};
+    MetricHistogram StatLatency{"qsync_stat_latency_seconds", "Time the client's scan spent in stat() per entry.", 1e-9};
+    MetricHistogram TransferLatency{"qsync_file_transfer_seconds", "Time from the server deciding to fetch a file to it being in place.", 1e-6};
+    MetricHistogram ConnectionRtt{"qsync_connection_rtt_seconds", "Smoothed RTT of connections, sampled periodically and at shutdown.", 1e-6};
+    MetricCounter PacketsSent{"qsync_quic_packets_sent_total", "Packets sent by connections that have shut down."};
+    MetricCounter PacketsLost{"qsync_quic_packets_lost_total", "Packets suspected lost by connections that have shut down."};
+    MetricCounter PacketsReceived{"qsync_quic_packets_received_total", "Packets received by connections that have shut down."};
+    MetricCounter ConnectionsResumed{"qsync_connections_resumed_total", "Connections that resumed an earlier TLS session."};
+    MetricCounter SigningKeysDerived{"qsync_signing_keys_derived_total", "Certificate signing keys derived with PBKDF2."};
+    MetricCounter SigningKeyCacheHits{"qsync_signing_key_cache_hits_total", "Certificate checks that found their signing key cached."};
+};
+
+extern QsyncMetrics Metrics;
+
+//
+// Adds a finished connection's MsQuic statistics to Metrics.
+//
+void
+RecordConnectionStatistics(
+    MsQuicConnection* Connection);
+
+//
+// Rewrites a Prometheus text file every Interval, replacing it atomically
+// so a collector never sees half of it, and writes it along with a JSON
+// copy (Path + ".json") once more on Stop.
+//
+class MetricsExporter {
+    std::string Path;
+    std::chrono::milliseconds Interval;
+    std::thread Thread;
+    std::mutex Mutex;
+    std::condition_variable Cv;
+    bool Stopping;
+
+    void Run();
+
+public:
+    MetricsExporter(std::string Path, std::chrono::milliseconds Interval);
+    MetricsExporter(const MetricsExporter&) = delete;
+    MetricsExporter& operator= (const MetricsExporter&) = delete;
+    ~MetricsExporter() { Stop(); }
+
+    void Stop();
+    bool WriteNow(bool Json);
+};
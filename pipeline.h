@@ -0,0 +1,121 @@
+#pragma once
+
+//
+// Building blocks for staged pipelines whose memory use is bounded in
+// bytes rather than items, so a stage that falls behind slows down the
+// ones feeding it instead of letting work pile up.
+//
+
+//
+// A count of bytes in use, capped at Limit. Acquire blocks until the bytes
+// fit; something bigger than Limit is let through once nothing else is in
+// use, so it can't wait forever.
+//
+class ByteBudget {
+    std::mutex Mutex;
+    std::condition_variable Cv;
+    uint64_t Used;
+    uint64_t Limit;
+
+public:
+    ByteBudget(uint64_t Limit) : Used(0), Limit(Limit) {};
+    ByteBudget(const ByteBudget&) = delete;
+    ByteBudget& operator= (const ByteBudget&) = delete;
+
+    void
+    Acquire(
+        uint64_t Bytes)
+    {
+        std::unique_lock<std::mutex> Lock(Mutex);
+        Cv.wait(Lock, [this, Bytes]{return Used == 0 || Used + Bytes <= Limit;});
+        Used += Bytes;
+    }
+
+    void
+    Release(
+        uint64_t Bytes)
+    {
+        {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            Used -= Bytes;
+        }
+        Cv.notify_all();
+    }
+
+    uint64_t
+    InUse()
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        return Used;
+    }
+};
+
+//
+// A queue between two pipeline stages holding at most Capacity bytes of
+// items. Push blocks while it is full; PopBatch blocks while it is empty
+// and hands out as many items as fit in MaxBytes at once.
+//
+template<typename T>
+class BoundedQueue {
+    std::mutex Mutex;
+    std::condition_variable NotEmpty;
+    std::condition_variable NotFull;
+    std::deque<std::pair<T, uint64_t>> Items;
+    uint64_t Bytes;
+    uint64_t Capacity;
+    bool Closed;
+
+public:
+    BoundedQueue(uint64_t Capacity) : Bytes(0), Capacity(Capacity), Closed(false) {};
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator= (const BoundedQueue&) = delete;
+
+    void
+    Push(
+        T&& Item,
+        uint64_t Size)
+    {
+        std::unique_lock<std::mutex> Lock(Mutex);
+        NotFull.wait(Lock, [this, Size]{return Items.empty() || Bytes + Size <= Capacity;});
+        Items.emplace_back(std::move(Item), Size);
+        Bytes += Size;
+        Lock.unlock();
+        NotEmpty.notify_one();
+    }
+
+    //
+    // Returns false once the queue is closed and drained. Always hands out
+    // at least one item, even one bigger than MaxBytes.
+    //
+    bool
+    PopBatch(
+        std::vector<T>& Out,
+        uint64_t MaxBytes)
+    {
+        std::unique_lock<std::mutex> Lock(Mutex);
+        NotEmpty.wait(Lock, [this]{return !Items.empty() || Closed;});
+        if (Items.empty()) {
+            return false;
+        }
+        uint64_t Taken = 0;
+        while (!Items.empty() && (Taken == 0 || Taken + Items.front().second <= MaxBytes)) {
+            Taken += Items.front().second;
+            Out.push_back(std::move(Items.front().first));
+            Items.pop_front();
+        }
+        Bytes -= Taken;
+        Lock.unlock();
+        NotFull.notify_all();
+        return true;
+    }
+
+    void
+    Close()
+    {
+        {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            Closed = true;
+        }
+        NotEmpty.notify_all();
+    }
+};
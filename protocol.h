@@ -0,0 +1,134 @@
+#pragma once
+
+//
+// Largest chunk, before or after compression, either side will put in a
+// single DataChunkHeader. Anything bigger is treated as a protocol error.
+//
+const uint32_t DATA_CHUNK_MAX_LENGTH = 0x100000;
+
+//
+// Data streams the server lets the client open on each connection. The
+// server decides how many ranges to ask for at once; see AdaptiveConcurrency.
+//
+const uint16_t DATA_STREAM_CREDIT = 256;
+
+//
+// Most DataRequests the server puts in one want list.
+//
+const uint32_t MAX_WANT_LIST_ENTRIES = 256;
+
+//
+// Largest single record accepted on the control stream.
+//
+const uint32_t CONTROL_MESSAGE_MAX_LENGTH = 0x10000;
+
+enum DataChunkFlags : uint32_t {
+    DataChunkNone = 0,
+    DataChunkCompressed = 1,
+};
+
+//
+// File data on a data stream is sent as a sequence of chunks, each prefixed
+// by this header. A compressed chunk is exactly one zstd frame which inflates
+// to RawLength bytes; an uncompressed chunk has Length == RawLength.
+// Offset is where the chunk lands in the file, so holes in sparse files are
+// never sent; chunks are always sent in increasing Offset order. Every range
+// ends with an empty chunk at the range's end offset, so a stream that
+// finishes early can't pass for a complete one.
+//
+#pragma pack(push, 1)
+struct DataChunkHeader {
+    uint64_t Offset;
+    uint32_t Flags;
+    uint32_t Length;
+    uint32_t RawLength;
+};
+#pragma pack(pop)
+
+enum DataRequestFlags : uint16_t {
+    DataRequestNone = 0,
+    DataRequestFailed = 1,
+    DataRequestSpeculative = 2,
+};
+
+//
+// Asks the client for Length bytes of the file with FileId starting at
+// Offset. Large files are requested as RangeCount ranges; a single range
+// starts past zero when resuming an interrupted transfer. The client sends
+// the range with QUIC stream priority Priority, or the default priority if
+// it is zero.
+//
+// The server sends these in want lists on the control stream. For each
+// one the client opens a data stream of its own, which starts with the
+// same DataRequest followed by the range's chunks. If the client can't
+// send the range, the stream carries only the DataRequest with
+// DataRequestFailed set.
+//
+// The client also opens streams unasked, with DataRequestSpeculative set,
+// for files it flagged as speculative in their FileInfo. These always
+// carry the whole file. The server aborts the ones it doesn't need.
+//
+#pragma pack(push, 1)
+struct DataRequest {
+    uint64_t FileId;
+    uint64_t Offset;
+    uint64_t Length;
+    uint32_t RangeCount;
+    uint16_t Priority;
+    uint16_t Flags;
+};
+#pragma pack(pop)
+
+enum ControlFrameType : uint32_t {
+    ControlFrameFileAck = 1,  // Followed by uint64_t file ids.
+    ControlFrameWantList = 2, // Followed by DataRequests.
+    ControlFrameSessionAccepted = 3, // No entries.
+    ControlFrameFileFailed = 4, // Followed by uint64_t file ids.
+};
+
+//
+// The server's records on the control stream use the same length prefix
+// as the client's FileInfo records; each one holds a frame type and an
+// array of entries. A FileAck tells the client a file needs nothing more:
+// it was already current, or its data has been put in place. A FileFailed
+// tells it the file could not be synced this time; either way the server
+// is done with it. SessionAccepted tells it the session's token is
+// registered, so connections can join it.
+//
+#pragma pack(push, 1)
+struct ControlFrameHeader {
+    ControlFrameType Type;
+};
+#pragma pack(pop)
+
+const char SessionHelloMagic[4] = {'Q', 'S', 'H', 'I'};
+const uint32_t SESSION_TOKEN_LENGTH = 16;
+
+enum SessionRole : uint8_t {
+    SessionControl = 0,
+    SessionJoin = 1,
+};
+
+enum SessionFlags : uint8_t {
+    SessionFlagNone = 0,
+    // FileInfo records on the control stream are plain, word-aligned capnp
+    // messages rather than packed ones.
+    SessionFlagUnpacked = 1,
+};
+
+//
+// First bytes the client sends on the first stream of every connection.
+// The connection that carries the control stream names the session with a
+// random Token; any further connections present the same Token with
+// SessionJoin and only carry data streams, which the server spreads across
+// all of the session's connections.
+//
+#pragma pack(push, 1)
+struct SessionHello {
+    char Magic[4];
+    uint8_t Role;
+    uint8_t Flags;
+    uint8_t Reserved[2];
+    uint8_t Token[SESSION_TOKEN_LENGTH];
+};
+#pragma pack(pop)
@@ -5,61 +5,84 @@ using namespace std;
 MsQuicApi Api;
 const MsQuicApi* MsQuic;
 
-void ParseArguments(QsyncSettings &Settings, int argc, char **argv) {
-    UNREFERENCED_PARAMETER(Settings);
-    UNREFERENCED_PARAMETER(argc);
-    UNREFERENCED_PARAMETER(argv);
+const auto METRICS_INTERVAL = chrono::seconds(10);
+const uint32_t DEFAULT_TRACE_SAMPLE_RATE = 16;
+
+void ParseArguments(QsyncSettings &Settings, int& argc, char **argv) {
+    //
+    // Options can appear anywhere on the command line. They are removed from
+    // argv so that main() only has to dispatch on the positional arguments.
+    //
+    int Positional = 1;
+    for (int i = 1; i < argc; ++i) {
+        string_view Arg(argv[i]);
+        if (Arg == "-z" || Arg == "--compress") {
+            // qsync c ... -z
+            Settings.ClientSettings.Compress = true;
+        } else if ((Arg == "-m" || Arg == "--manifest") && i + 1 < argc) {
+            // qsync c ... -m manifest_path
+            Settings.ClientSettings.ManifestPath = argv[++i];
+        } else if ((Arg == "-o" || Arg == "--order") && i + 1 < argc) {
+            // qsync s ... -o small|large|mixed|scan
+            string_view Order(argv[++i]);
+            if (Order == "small") {
+                Settings.ServerSettings.TransferOrder = TransferOrderSmallest;
+            } else if (Order == "large") {
+                Settings.ServerSettings.TransferOrder = TransferOrderLargest;
+            } else if (Order == "scan") {
+                Settings.ServerSettings.TransferOrder = TransferOrderScan;
+            } else {
+                Settings.ServerSettings.TransferOrder = TransferOrderMixed;
+            }
+        } else if ((Arg == "-n" || Arg == "--connections") && i + 1 < argc) {
+            // qsync c ... -n connection_count
+            Settings.ClientSettings.Connections = (uint32_t)atol(argv[++i]);
+        } else if (Arg == "-p" || Arg == "--speculate") {
+            // qsync c ... -m manifest_path -p
+            Settings.ClientSettings.Speculate = true;
+        } else if ((Arg == "-M" || Arg == "--metrics") && i + 1 < argc) {
+            // qsync c|s ... -M metrics_path
+            Settings.MetricsPath = argv[++i];
+        } else if ((Arg == "-t" || Arg == "--trace") && i + 1 < argc) {
+            // qsync c|s ... -t trace_path
+            Settings.TracePath = argv[++i];
+        } else if ((Arg == "-r" || Arg == "--trace-rate") && i + 1 < argc) {
+            // qsync c|s ... -t trace_path -r files_per_sample
+            Settings.TraceSampleRate = (uint32_t)atol(argv[++i]);
+        } else if (Arg == "-u" || Arg == "--unpacked") {
+            // qsync c ... -u
+            Settings.ClientSettings.Unpacked = true;
+        } else if ((Arg == "-c" || Arg == "--capture") && i + 1 < argc) {
+            // qsync s ... -c capture_path
+            Settings.ServerSettings.CapturePath = argv[++i];
+        } else if ((Arg == "-R" || Arg == "--resume") && i + 1 < argc) {
+            // qsync c ... -R ticket_path
+            Settings.ClientSettings.ResumptionPath = argv[++i];
+        } else if ((Arg == "-i" || Arg == "--identity") && i + 1 < argc) {
+            // qsync c|s ... -i identity_path
+            Settings.IdentityPath = argv[++i];
+        } else if (Arg == "-v" || Arg == "--verbose") {
+            // qsync c|s ... -v
+            Settings.Verbose = true;
+        } else if (Arg == "-j" || Arg == "--log-json") {
+            // qsync c|s ... -j
+            Settings.LogJson = true;
+        } else {
+            argv[Positional++] = argv[i];
+        }
+    }
+    argc = Positional;
 }
 
 void PrintFilesAndDirs(
     uint64_t Id,
-    SerializedFileInfo&& File)
+    SerializedFileInfo&& File,
+    bool Unpacked)
 {
-    // for (auto& Buf : Files) {
-        // kj::ArrayPtr<const uint8_t> Ptr((const uint8_t*)Files.data(), Files.size());
-        // kj::ArrayPtr<const capnp::word> Ptr((const capnp::word*)Buf.data(), Buf.size());
-        // kj::ArrayPtr<const capnp::word> Ptr((capnp::word*)Buf.data(), Buf.size() / sizeof (capnp::word));
-
-        // works
-        // auto Message = capnp::FlatArrayMessageReader(Buf);
-
-        // works
-        kj::ArrayPtr<const uint8_t> Ptr(File.data(), File.size());
-        auto Array = kj::ArrayInputStream(Ptr);
-        auto Message = capnp::PackedMessageReader(Array);
-
-        auto ParsedFile = Message.getRoot<FileInfo>();
-        // auto File = capnp::readDataStruct<FileInfo>(Ptr);
-        // if (File.getType() == FileInfo::Type::FILE) {
-            // cout << Buf.size() * sizeof(Buf.front())<< endl;
-            string_view Path(ParsedFile.getPath().cStr(), ParsedFile.getPath().size());
-            // cout << "Path len: " << File.getPath().size() << " File Size: " << File.getSize() << endl;
-            // cout << "Object: " << Buf.size() << " " << Path << endl;
-            cout << std::hex << setw(16) << setfill('0') << Id << " " << Path << endl;
-        // }
-    // }
-    // cout << "+++++++++++++++++++++++++++" << endl;
-    // for (auto& Buf : Files) {
-        // kj::ArrayPtr<const capnp::word> Ptr((capnp::word*)Buf.data(), Buf.size() / sizeof (capnp::word));
-
-        // works
-        // auto Message = capnp::FlatArrayMessageReader(Buf);
-
-        // works
-        // kj::ArrayPtr<const uint8_t> Ptr(Buf.data(), Buf.size());
-        // auto Array = kj::ArrayInputStream(Ptr);
-        // auto Message = capnp::PackedMessageReader(Array);
-
-        // kj::ArrayPtr<const capnp::word> Ptr((const capnp::word*)Buf.data(), Buf.size()); // doesn't work
-        // auto Message = capnp::FlatArrayMessageReader(Ptr);                               // doesn't work
-        // auto Dir = Message.getRoot<FileInfo>();
-        // if (Dir.getType() == FileInfo::Type::DIR) {
-            // cout << Buf.size() * sizeof(Buf.front()) << endl;
-            // string_view Path(Dir.getPath().cStr(), Dir.getPath().size());
-            // cout << Path << endl;
-        // }
-    // }
-    // cout << "---------------------------" << endl;
+    FileInfoMessage Message(File, Unpacked);
+    auto ParsedFile = Message.Get();
+    string_view Path(ParsedFile.getPath().cStr(), ParsedFile.getPath().size());
+    cout << std::hex << setw(16) << setfill('0') << Id << " " << Path << endl;
 }
 
 int main(
@@ -68,57 +91,80 @@ int main(
 {
     QsyncSettings Settings = { };
     ParseArguments(Settings, argc, argv);
+    Logger.Configure(Settings.Verbose ? LogLevelDebug : LogLevelInfo, Settings.LogJson);
     
     MASSERT(QUIC_SUCCEEDED(Api.GetInitStatus()));
     MsQuic = &Api;
     std::unique_ptr<QsyncServer> Server;
     std::unique_ptr<QsyncClient> Client;
+    // After Server and Client, so it's gone before their pools are.
+    std::unique_ptr<MetricsExporter> Exporter;
+    if (Settings.MetricsPath != nullptr) {
+        Exporter = make_unique<MetricsExporter>(Settings.MetricsPath, METRICS_INTERVAL);
+    }
+    if (Settings.TracePath != nullptr) {
+        Tracer.Start(
+            Settings.TraceSampleRate != 0 ? Settings.TraceSampleRate : DEFAULT_TRACE_SAMPLE_RATE,
+            argc > 1 && *argv[1] == 's' ? QsyncPerspective::Server : QsyncPerspective::Client);
+    }
     
     if (argc == 2) {
-        if (!FindFiles(argv[1], PrintFilesAndDirs)) {
-            cout << "Failed to finish parsing!" << endl;
+        // qsync path [-u]
+        bool Unpacked = Settings.ClientSettings.Unpacked;
+        auto Print = [Unpacked](uint64_t Id, SerializedFileInfo&& File, bool /*Speculative*/) {
+            PrintFilesAndDirs(Id, std::move(File), Unpacked);
+        };
+        if (!FindFiles(argv[1], Print, nullptr, false, Unpacked)) {
+            LogError() << "Failed to finish parsing!";
         }
     } else if (argc == 3) {
         if (*argv[1] == 's') {
             // qsync s port_number
             uint16_t Port = (uint16_t)atol(argv[2]);
-            Server = make_unique<QsyncServer>();
+            Server = make_unique<QsyncServer>(Settings);
             Server->Start(Port, "", "");
         }
     } else if (argc == 4) {
         if (*argv[1] == 's') {
             // qsync s port_number password
             uint16_t Port = (uint16_t)atol(argv[2]);
-            Server = make_unique<QsyncServer>();
+            Server = make_unique<QsyncServer>(Settings);
             Server->Start(Port, "", argv[3]);
         } else if (*argv[1] == 'c') {
             // qsync c addr port_number
             uint16_t Port = (uint16_t)atol(argv[3]);
-            Client = make_unique<QsyncClient>();
+            Client = make_unique<QsyncClient>(Settings);
             Client->Start(argv[2], Port, "", "");
         }
     } else if (argc == 5) {
         if (*argv[1] == 'c') {
             // qsync c addr port_number password
             uint16_t Port = (uint16_t)atol(argv[3]);
-            Client = make_unique<QsyncClient>();
+            Client = make_unique<QsyncClient>(Settings);
             Client->Start(argv[2], Port, "", argv[4]);
         } else if (*argv[1] == 's') {
             // qsync s port_number password path
             uint16_t Port = (uint16_t)atol(argv[2]);
-            Server = make_unique<QsyncServer>();
+            Server = make_unique<QsyncServer>(Settings);
             Server->Start(Port, argv[4], argv[3]);
         }
     } else if (argc == 6) {
         if (*argv[1] == 'c') {
             // qsync c addr port_number password path
             uint16_t Port = (uint16_t)atol(argv[3]);
-            Client = make_unique<QsyncClient>();
+            Client = make_unique<QsyncClient>(Settings);
             Client->Start(argv[2], Port, argv[5], argv[4]);
         }
     }
     do {
         cout << "Press enter to exit..." << endl;
     } while (getchar() != '\n');
+    if (Exporter) {
+        Exporter->Stop();
+    }
+    if (Settings.TracePath != nullptr) {
+        Tracer.Write(Settings.TracePath);
+    }
+    Logger.Stop();
     return 0;
 }
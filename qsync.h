@@ -2,6 +2,7 @@
 
 #define _CRT_SECURE_NO_WARNINGS
 #include <stdio.h>
+#include <cstddef>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -9,10 +10,17 @@
 #include <functional>
 #include <deque>
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
+#include <condition_variable>
 #include <thread>
 #include <atomic>
+#include <bit>
+#include <map>
 #include <fstream>
+#include <optional>
+#include <chrono>
+#include <sstream>
 
 #include <msquic.hpp>
 
@@ -21,12 +29,7 @@
 #include <capnp/serialize-packed.h>
 #include "fileinfo.capnp.h"
 
-#include "threadpool.h"
-#include "vector_stream.h"
-#include "auth.h"
-#include "files.h"
-#include "server.h"
-#include "client.h"
+#include <zstd.h>
 
 #define QSYNC_ALPN "qsync"
 
@@ -41,13 +44,62 @@ enum QsyncPerspective {
     Server = 1,
 };
 
+//
+// Order the server requests pending files in once a session has more than
+// it can have in flight.
+//
+enum QsyncTransferOrder {
+    TransferOrderMixed = 0,    // Mostly smallest first, every few picks the largest.
+    TransferOrderSmallest = 1, // Most files per second.
+    TransferOrderLargest = 2,  // Shortest tail.
+    TransferOrderScan = 3,     // As the client scanned them.
+};
+
 typedef struct _Settings {
     enum QsyncPerspective Perspective;
+    // Prometheus text file rewritten while running; see MetricsExporter.
+    char *MetricsPath;
+    // Chrome trace of one file in TraceSampleRate, written at exit.
+    char *TracePath;
+    uint32_t TraceSampleRate;
+    // Debug-level logging, which includes a line per file transferred.
+    bool Verbose;
+    bool LogJson;
+    // PKCS#12 identity kept across runs; see QcGetAuthCertificate.
+    char *IdentityPath;
     struct {
         char *ServerAddress;
         uint16_t ServerPort;
+        bool Compress;
+        char *ManifestPath;
+        uint32_t Connections;
+        bool Speculate;
+        bool Unpacked;
+        // Resumption ticket from the last sync, so the next can use 0-RTT.
+        char *ResumptionPath;
     } ClientSettings;
     struct {
-    
+        enum QsyncTransferOrder TransferOrder;
+        // Where each control session's raw bytes are recorded; see capture.h.
+        char *CapturePath;
     } ServerSettings;
 } QsyncSettings;
+
+#include "logger.h"
+#include "metrics.h"
+#include "trace.h"
+#include "affinity.h"
+#include "threadpool.h"
+#include "pipeline.h"
+#include "vector_stream.h"
+#include "protocol.h"
+#include "capture.h"
+#include "stream_parser.h"
+#include "compression.h"
+#include "concurrency.h"
+#include "auth.h"
+#include "files.h"
+#include "file_table.h"
+#include "server.h"
+#include "session.h"
+#include "client.h"
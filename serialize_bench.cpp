@@ -0,0 +1,134 @@
+//
+// Compares the packed and unpacked FileInfo wire formats: bytes on the
+// control stream, time to serialize, and time to read back. Run it with
+// a record count, e.g. `serialize_bench 1000000`.
+//
+#include "qsync.h"
+
+#include <chrono>
+
+using namespace std;
+using namespace std::chrono;
+
+const uint64_t LinkSpeedsMbps[] = {1000, 10000, 40000};
+
+struct BenchResult {
+    uint64_t Bytes;
+    double SerializeSeconds;
+    double ParseSeconds;
+};
+
+void
+BuildRecords(
+    uint32_t Count,
+    bool Unpacked,
+    vector<SerializedFileInfo>& Records,
+    BenchResult& Result)
+{
+    Records.clear();
+    Records.reserve(Count);
+    Result.Bytes = 0;
+    char Path[64];
+    auto Start = steady_clock::now();
+    for (uint32_t i = 0; i < Count; i++) {
+        capnp::MallocMessageBuilder Message;
+        auto Builder = Message.initRoot<FileInfo>();
+        snprintf(Path, sizeof(Path), "dir%u/sub%u/file%u.dat", i / 10000, i / 100, i);
+        Builder.setPath(Path);
+        Builder.setId(i);
+        Builder.setType(i % 16 ? FileInfo::Type::FILE : FileInfo::Type::DIR);
+        // Mostly small files, the odd large one, as a source tree looks.
+        Builder.setSize(i % 64 ? (i * 2654435761u) % 65536 : (uint64_t)i << 20);
+        Builder.setModifiedTime(1700000000000000000ull + i * 1000003ull);
+        Builder.setDevice(2049);
+        Builder.setInode(1000000 + i);
+
+        SerializedFileInfo Data;
+        Data.reserve(Message.sizeInWords() * sizeof(capnp::word));
+        VectorStream Stream(Data);
+        if (Unpacked) {
+            capnp::writeMessage(Stream, Message);
+        } else {
+            capnp::writePackedMessage(Stream, Message);
+        }
+        // Each record also carries its length on the control stream.
+        Result.Bytes += Data.size() + sizeof(uint32_t);
+        Records.push_back(std::move(Data));
+    }
+    Result.SerializeSeconds = duration<double>(steady_clock::now() - Start).count();
+}
+
+uint64_t
+ParseRecords(
+    const vector<SerializedFileInfo>& Records,
+    bool Unpacked,
+    BenchResult& Result)
+{
+    // Summed so the reads can't be optimized away.
+    uint64_t Checksum = 0;
+    auto Start = steady_clock::now();
+    for (const auto& Record : Records) {
+        FileInfoMessage Message(Record, Unpacked);
+        auto File = Message.Get();
+        Checksum += File.getId() + File.getSize() + File.getPath().size();
+    }
+    Result.ParseSeconds = duration<double>(steady_clock::now() - Start).count();
+    return Checksum;
+}
+
+void
+PrintResult(
+    const char* Name,
+    uint32_t Count,
+    const BenchResult& Result)
+{
+    printf("%-9s %10llu bytes %6.1f B/file  serialize %7.1f ns/file  parse %7.1f ns/file\n",
+        Name,
+        (unsigned long long)Result.Bytes,
+        (double)Result.Bytes / Count,
+        Result.SerializeSeconds * 1e9 / Count,
+        Result.ParseSeconds * 1e9 / Count);
+}
+
+int
+main(
+    int argc,
+    char** argv)
+{
+    uint32_t Count = argc > 1 ? (uint32_t)strtoul(argv[1], nullptr, 10) : 1000000;
+    if (Count == 0) {
+        cerr << "Usage: " << argv[0] << " [record count]" << endl;
+        return -1;
+    }
+
+    vector<SerializedFileInfo> Records;
+    BenchResult Packed, Unpacked;
+    BuildRecords(Count, false, Records, Packed);
+    auto PackedChecksum = ParseRecords(Records, false, Packed);
+    BuildRecords(Count, true, Records, Unpacked);
+    auto UnpackedChecksum = ParseRecords(Records, true, Unpacked);
+    if (PackedChecksum != UnpackedChecksum) {
+        cerr << "Packed and unpacked records read back differently!" << endl;
+        return -1;
+    }
+
+    PrintResult("packed", Count, Packed);
+    PrintResult("unpacked", Count, Unpacked);
+
+    //
+    // Total per-file cost on the server's side of the control stream at a
+    // few link speeds: time on the wire plus time to read the record. Where
+    // unpacked comes out ahead, the link is fast enough to use -u.
+    //
+    for (auto Mbps : LinkSpeedsMbps) {
+        double BytesPerSecond = Mbps * 1e6 / 8;
+        double PackedCost = Packed.Bytes / BytesPerSecond + Packed.ParseSeconds;
+        double UnpackedCost = Unpacked.Bytes / BytesPerSecond + Unpacked.ParseSeconds;
+        printf("%6llu Mbps: packed %7.1f ns/file, unpacked %7.1f ns/file -> %s\n",
+            (unsigned long long)Mbps,
+            PackedCost * 1e9 / Count,
+            UnpackedCost * 1e9 / Count,
+            UnpackedCost < PackedCost ? "unpacked" : "packed");
+    }
+    return 0;
+}
@@ -1,29 +1,17 @@
 #pragma once
 
-class QsyncServer {
-    struct DataStreamContext {
-        QsyncServer* Server;
-        MsQuicStream* Stream;
-        std::atomic_uint64_t RefCount;
-        QUIC_BUFFER Buffers[2];
-        uint32_t BufferCount;
-        SerializedFileInfo FileInfo;
-        uintmax_t NewFileSize;
-        uint64_t BytesWritten;
-        std::chrono::file_time<std::chrono::seconds> FileTime;
-        std::filesystem::path DestinationPath;
-        std::filesystem::path TempDestinationPath;
-        std::fstream FileWriteStream;
-        uint64_t SnapshotDestSize;
-        std::filesystem::file_time_type SnapshotDestModTime;
-        bool FinalReceive;
-        bool FileExists;
-
-        DataStreamContext() = default;
-        ~DataStreamContext() = default;
+//
+// What replaying a capture decided; see QsyncServer::Replay.
+//
+struct ReplayResult {
+    uint64_t FilesReceived;
+    uint64_t FilesCurrent;
+    uint64_t FilesWanted;
+    double Seconds;
+};
 
-        void FileIoWorker();
-    };
+class QsyncServer {
+    friend class QsyncSession;
 
     uint32_t Pkcs12Length;
     std::filesystem::path BasePath;
@@ -36,23 +24,28 @@ class QsyncServer {
     std::unique_ptr<MsQuicRegistration> Reg;
     std::unique_ptr<MsQuicListener> Listener;
     std::unique_ptr<MsQuicConfiguration> Config;
-    std::unique_ptr<MsQuicConnection> Connection;
-    std::unique_ptr<MsQuicStream> ControlStream;
-    uint32_t SkipMessageBytes;
-    union {
-        uint32_t RemainderSize;
-        uint8_t RemainderSizeBytes[4];
-        QUIC_BUFFER RemainderMessage;
-    };
-    uint32_t RemainderFilled;
-    enum PartialData : uint8_t {
-        NoPartialData = 0,
-        PartialSize = 1,
-        PartialMessage = 2,
-    } PartialData;
+    std::mutex SessionsMutex;
+    std::unordered_set<QsyncSession*> Sessions;
+    // Sessions by the token their control connection presented.
+    std::unordered_map<std::string, QsyncSession*> SessionTokens;
+    // Data streams open across all sessions, bounded by MAX_ACTIVE_TRANSFERS.
+    std::mutex TransferMutex;
+    uint32_t ActiveTransfers;
+    std::deque<QsyncSession*> WaitingSessions;
+    QsyncTransferOrder TransferOrder;
+    std::string CapturePath;
+    std::atomic_uint32_t CaptureCount;
+    std::string IdentityPath;
 
 public:
-    QsyncServer() : Pool(1), IoPool(8) {};
+    QsyncServer(const QsyncSettings& Settings) :
+        Pool(4, true, "server"),
+        IoPool(8, true, "io"),
+        ActiveTransfers(0),
+        TransferOrder(Settings.ServerSettings.TransferOrder),
+        CapturePath(Settings.ServerSettings.CapturePath ? Settings.ServerSettings.CapturePath : ""),
+        CaptureCount(0),
+        IdentityPath(Settings.IdentityPath ? Settings.IdentityPath : "") {};
     QsyncServer(const QsyncServer&) = delete;
     QsyncServer(QsyncServer&&) = default;
     ~QsyncServer() = default;
@@ -63,7 +56,34 @@ public:
         const std::string& Root,
         const std::string& Password);
 
+    //
+    // Runs a captured control stream through a session with no connection:
+    // the hello and FileInfos are parsed and decided on as if a client sent
+    // them, FragmentBytes per receive buffer (0 for the buffers as captured)
+    // and BuffersPerReceive buffers at a time. Directories and links are
+    // applied under Root; files that need data are queued but never fetched.
+    //
+    bool
+    Replay(
+        const std::string& Root,
+        const ControlCapture& Capture,
+        uint32_t FragmentBytes,
+        uint32_t BuffersPerReceive,
+        ReplayResult& Result);
+
 private:
+    bool
+    SetBasePath(
+        const std::string& Root);
+
+    //
+    // Opens the capture for a new control session, if capturing: the first
+    // goes to CapturePath, later ones to CapturePath.1, .2 and so on.
+    //
+    std::unique_ptr<ControlCaptureWriter>
+    OpenCapture(
+        const SessionHello& Hello);
+
     static
     QUIC_STATUS
     QsyncListenerCallback(
@@ -71,34 +91,29 @@ private:
         _In_opt_ void* Context,
         _Inout_ QUIC_LISTENER_EVENT* Event);
 
-    static
-    QUIC_STATUS
-    QsyncServerConnectionCallback(
-        _In_ MsQuicConnection* /*Connection*/,
-        _In_opt_ void* Context,
-        _Inout_ QUIC_CONNECTION_EVENT* Event);
-
-    static
-    QUIC_STATUS
-    QSyncServerControlStreamCallback(
-        _In_ MsQuicStream* /*Stream*/,
-        _In_opt_ void* Context,
-        _Inout_ QUIC_STREAM_EVENT* Event);
+    bool
+    AcquireTransferSlot(
+        QsyncSession* Session);
 
-    static
-    QUIC_STATUS
-    QSyncServerDataStreamCallback(
-        _In_ MsQuicStream* /*Stream*/,
-        _In_opt_ void* Context,
-        _Inout_ QUIC_STREAM_EVENT* Event);
+    void
+    TakeTransferSlot();
 
     void
-    QSyncServerWorkerCallback(
-        _In_ const ReceivedFileInfo& Info);
+    ReleaseTransferSlot();
+
+    //
+    // Returns false if another session already holds Token.
+    //
+    bool
+    RegisterSession(
+        const std::string& Token,
+        QsyncSession* Session);
+
+    QsyncSession*
+    FindSession(
+        const std::string& Token);
 
     void
-    AddFileToList(
-        QsyncServer* Server,
-        uint8_t* Buffer,
-        uint32_t Length);
+    RemoveSession(
+        QsyncSession* Session);
 };
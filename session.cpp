@@ -0,0 +1,1575 @@
+#include "qsync.h"
+
+using namespace std;
+namespace fs = std::filesystem;
+
+//
+// Files at least RANGE_SPLIT_MIN_SIZE bytes are transferred as up to
+// MAX_RANGES_PER_FILE ranges of at least RANGE_MIN_LENGTH bytes each.
+//
+const uint64_t RANGE_SPLIT_MIN_SIZE = 0x4000000;
+const uint64_t RANGE_MIN_LENGTH = 0x2000000;
+const uint64_t RANGE_ALIGNMENT = 0x100000;
+const uint32_t MAX_RANGES_PER_FILE = 8;
+
+//
+// In mixed order, every MIXED_LARGEST_INTERVAL-th transfer started is the
+// largest one pending, so big files make progress alongside small ones.
+//
+const uint32_t MIXED_LARGEST_INTERVAL = 4;
+
+//
+// Data streams go below the client's control stream priority (0x7FFF),
+// one step per power of two of file size.
+//
+const uint16_t DATA_STREAM_PRIORITY_BASE = 0x7F00;
+
+uint16_t
+TransferPriority(
+    QsyncTransferOrder Order,
+    uint64_t FileSize,
+    bool LargestPick)
+{
+    uint16_t SizeClass = (uint16_t)bit_width(FileSize);
+    switch (Order) {
+    case TransferOrderSmallest:
+        return DATA_STREAM_PRIORITY_BASE - SizeClass;
+    case TransferOrderLargest:
+        return DATA_STREAM_PRIORITY_BASE - (64 - SizeClass);
+    case TransferOrderMixed:
+        // Smallest first, but the periodic largest pick goes ahead of them
+        // all, or it would only move once the small files ran out.
+        return LargestPick ? DATA_STREAM_PRIORITY_BASE + 1 : DATA_STREAM_PRIORITY_BASE - SizeClass;
+    default:
+        // Scan order is already in the order streams start, so they share
+        // the link evenly, still below the control stream.
+        return DATA_STREAM_PRIORITY_BASE;
+    }
+}
+
+const char ResumeMagic[4] = {'Q', 'S', 'R', 'S'};
+
+//
+// Sidecar kept next to a partial temp file when its transfer is cut short,
+// recording which source version it belongs to and how much of it is valid.
+//
+#pragma pack(push, 1)
+struct ResumeRecord {
+    char Magic[4];
+    uint64_t SourceSize;
+    uint64_t SourceModifiedTime;
+    uint64_t VerifiedBytes;
+};
+#pragma pack(pop)
+
+fs::path
+ResumePathFor(
+    const fs::path& TempPath)
+{
+    auto ResumePath = TempPath;
+    return ResumePath += ".resume";
+}
+
+uint64_t
+FindResumeOffset(
+    const fs::path& TempPath,
+    const FileInfo::Reader& File)
+{
+    auto ResumePath = ResumePathFor(TempPath);
+    error_code Error;
+    if (!fs::exists(ResumePath, Error)) {
+        return 0;
+    }
+    ResumeRecord Record;
+    ifstream Input(ResumePath, ios::binary | ios::in);
+    Input.read((char*)&Record, sizeof(Record));
+    Input.close();
+    auto TempSize = fs::file_size(TempPath, Error);
+    if (!Error &&
+        Input.gcount() == sizeof(Record) &&
+        memcmp(Record.Magic, ResumeMagic, sizeof(ResumeMagic)) == 0 &&
+        Record.SourceSize == File.getSize() &&
+        Record.SourceModifiedTime == File.getModifiedTime() &&
+        TempSize == File.getSize() &&
+        Record.VerifiedBytes <= TempSize) {
+        return Record.VerifiedBytes;
+    }
+    // The source changed since the partial copy was made; start over.
+    fs::remove(ResumePath, Error);
+    return 0;
+}
+
+QsyncSession::QsyncSession(
+    QsyncServer* Server) :
+    Server(Server),
+    RefCount(1), // Ref for the connection.
+    HelloFilled(0),
+    Primary(nullptr),
+    IncomingScheduled(false),
+    HoldIncoming(false),
+    HandshakeConfirmed(false),
+    PendingSequence(0),
+    PickCount(0),
+    ActiveTransfers(0),
+    Closed(false),
+    WaitingForSlot(false)
+{
+}
+
+QsyncSession::~QsyncSession()
+{
+    ASSERT(PendingTransfers.empty());
+}
+
+void
+QsyncSession::Release()
+{
+    if (--RefCount == 0) {
+        delete this;
+    }
+}
+
+QUIC_STATUS
+QsyncSession::Accept(
+    HQUIC NewConnection)
+{
+    Connection =
+        make_unique<MsQuicConnection>(
+            NewConnection,
+            CleanUpManual,
+            QsyncSessionConnectionCallback,
+            this);
+    QUIC_STATUS Status = Connection->SetConfiguration(*Server->Config);
+    if (QUIC_FAILED(Status)) {
+        LogError() << "Failed to set configuration on connection: " << Status;
+        // The connection is being rejected; MsQuic frees the handle.
+        Connection->Handle = nullptr;
+        return QUIC_STATUS_CONNECTION_REFUSED;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+void
+QsyncSession::AddFileToList(
+    const uint8_t* Buffer,
+    uint32_t Length)
+{
+    lock_guard<mutex> Lock(IncomingMutex);
+    Incoming.emplace_back(Buffer, Buffer + Length);
+    Metrics.ControlIncoming.Add(1);
+    if (!IncomingScheduled && !HoldIncoming) {
+        // One drain at a time keeps this session's entries in order while
+        // other sessions use the rest of the pool.
+        IncomingScheduled = true;
+        AddRef();
+        Server->Pool.Enqueue(&QsyncSession::ProcessIncoming, this);
+    }
+}
+
+void
+QsyncSession::ProcessIncoming()
+{
+    deque<SerializedFileInfo> Batch;
+    for (;;) {
+        {
+            lock_guard<mutex> Lock(IncomingMutex);
+            if (Incoming.empty()) {
+                IncomingScheduled = false;
+                IncomingDrained.notify_all();
+                break;
+            }
+            Batch.swap(Incoming);
+        }
+        Metrics.ControlIncoming.Add(-(int64_t)Batch.size());
+        for (const auto& Info : Batch) {
+            QSyncServerWorkerCallback(Info);
+        }
+        Batch.clear();
+    }
+    Release();
+}
+
+void
+QsyncSession::ConfirmHandshake()
+{
+    lock_guard<mutex> Lock(IncomingMutex);
+    HandshakeConfirmed = true;
+    if (!HoldIncoming) {
+        return;
+    }
+    HoldIncoming = false;
+    if (!Incoming.empty() && !IncomingScheduled) {
+        IncomingScheduled = true;
+        AddRef();
+        Server->Pool.Enqueue(&QsyncSession::ProcessIncoming, this);
+    }
+}
+
+void
+QsyncSession::WaitForIncoming()
+{
+    unique_lock<mutex> Lock(IncomingMutex);
+    IncomingDrained.wait(Lock, [this]() { return Incoming.empty() && !IncomingScheduled; });
+}
+
+void
+QsyncSession::QueueTransfer(
+    DataStreamContext* Context)
+{
+    {
+        unique_lock<mutex> Lock(TransferMutex);
+        if (Closed) {
+            // Outside the lock, since dropping the transfer reports it failed.
+            Lock.unlock();
+            Context->Discard();
+            return;
+        }
+        uint64_t Key =
+            Server->TransferOrder == TransferOrderScan ?
+                PendingSequence++ : Context->Transfer->NewFileSize;
+        PendingTransfers.emplace(Key, Context);
+    }
+    StartPendingTransfers();
+}
+
+QsyncSession::DataStreamContext*
+QsyncSession::NextPendingTransfer(
+    bool& LargestPick)
+{
+    auto Next = PendingTransfers.begin();
+    bool Largest =
+        Server->TransferOrder == TransferOrderLargest ||
+        (Server->TransferOrder == TransferOrderMixed &&
+            ++PickCount % MIXED_LARGEST_INTERVAL == 0);
+    if (Largest) {
+        // First of the largest, so a big file's ranges still go in order.
+        Next = PendingTransfers.lower_bound(prev(PendingTransfers.end())->first);
+    }
+    LargestPick = Largest;
+    auto Context = Next->second;
+    PendingTransfers.erase(Next);
+    return Context;
+}
+
+void
+QsyncSession::StartPendingTransfers(
+    bool HasGrantedSlot)
+{
+    // Everything started in one pass goes out in the same want list.
+    vector<DataRequest> Wanted;
+    for (;;) {
+        DataStreamContext* Context;
+        bool LargestPick;
+        {
+            lock_guard<mutex> Lock(TransferMutex);
+            if (Closed ||
+                PendingTransfers.empty() ||
+                ActiveTransfers >= Concurrency.Window()) {
+                break;
+            }
+            if (!HasGrantedSlot && !Server->AcquireTransferSlot(this)) {
+                // The server queued this session; it is called back with a slot.
+                break;
+            }
+            HasGrantedSlot = false;
+            Context = NextPendingTransfer(LargestPick);
+            ++ActiveTransfers;
+        }
+        Wanted.push_back(RequestRange(Context, LargestPick));
+    }
+    if (!Wanted.empty()) {
+        SendWantList(Wanted);
+    }
+    if (HasGrantedSlot) {
+        // Nothing left to use it on; pass it to the next session in line.
+        Server->ReleaseTransferSlot();
+    }
+}
+
+bool
+QsyncSession::AttachConnection(
+    QsyncSession* Joined)
+{
+    {
+        lock_guard<mutex> Lock(TransferMutex);
+        if (Closed) {
+            return false;
+        }
+        Joined->AddRef();
+        DataConnections.push_back(Joined);
+    }
+    // More connections means room for more streams.
+    StartPendingTransfers();
+    return true;
+}
+
+void
+QsyncSession::DetachConnection(
+    QsyncSession* Joined)
+{
+    {
+        lock_guard<mutex> Lock(TransferMutex);
+        auto Found = find(DataConnections.begin(), DataConnections.end(), Joined);
+        if (Found == DataConnections.end()) {
+            return;
+        }
+        DataConnections.erase(Found);
+    }
+    Joined->Release();
+}
+
+bool
+QsyncSession::OnHello()
+{
+    if (memcmp(Hello.Magic, SessionHelloMagic, sizeof(SessionHelloMagic)) != 0) {
+        LogError() << "[CONTROL] Connection did not start with a session hello";
+        return false;
+    }
+    Token.assign((const char*)Hello.Token, sizeof(Hello.Token));
+    if (Hello.Role == SessionControl) {
+        if (!Server->RegisterSession(Token, this)) {
+            LogError() << "[CONTROL] Session token is already in use";
+            Token.clear();
+            return false;
+        }
+        Capture = Server->OpenCapture(Hello);
+        // Joins presenting the token can only be matched from here on.
+        SendControlFrame(ControlFrameSessionAccepted, nullptr, 0, 0);
+        return true;
+    }
+    if (Hello.Role != SessionJoin) {
+        LogError() << "[CONTROL] Unknown session role " << (uint32_t)Hello.Role;
+        return false;
+    }
+    Primary = Server->FindSession(Token);
+    if (Primary == nullptr) {
+        LogError() << "[CONTROL] Connection tried to join an unknown session";
+        return false;
+    }
+    if (!Primary->AttachConnection(this)) {
+        Primary->Release();
+        Primary = nullptr;
+        return false;
+    }
+    Token.clear();
+    return true;
+}
+
+void
+QsyncSession::SplitRanges(
+    FileTransfer* Transfer)
+{
+    //
+    // Files big enough to benefit get split into up to MAX_RANGES_PER_FILE
+    // ranges so their data moves over several streams, client reads and
+    // server writes at once. A resumed transfer only splits what is left.
+    //
+    uint64_t Start = Transfer->ResumeOffset;
+    uint64_t Remaining = Transfer->NewFileSize - Start;
+    uint64_t RangeCount = 1;
+    if (Transfer->NewFileSize >= RANGE_SPLIT_MIN_SIZE) {
+        RangeCount = clamp<uint64_t>(Remaining / RANGE_MIN_LENGTH, 1, MAX_RANGES_PER_FILE);
+    }
+    uint64_t RangeLength = (Remaining + RangeCount - 1) / RangeCount;
+    RangeLength = (RangeLength + RANGE_ALIGNMENT - 1) & ~(RANGE_ALIGNMENT - 1);
+    do {
+        uint64_t End = min<uint64_t>(Start + RangeLength, Transfer->NewFileSize);
+        Transfer->RangeStarts.push_back(Start);
+        Transfer->RangeEnds.push_back(End);
+        Transfer->RangeProgress.push_back(Start);
+        Start = End;
+    } while (Start < Transfer->NewFileSize);
+    Transfer->RangesRemaining = (uint32_t)Transfer->RangeStarts.size();
+}
+
+DataRequest
+QsyncSession::RequestRange(
+    DataStreamContext* Context,
+    bool LargestPick)
+{
+    DataRequest Request{};
+    Request.FileId = Context->Transfer->FileId;
+    Request.Offset = Context->RangeOffset;
+    Request.Length = Context->RangeEnd - Context->RangeOffset;
+    Request.RangeCount = (uint32_t)Context->Transfer->RangeStarts.size();
+    Request.Priority = TransferPriority(Server->TransferOrder, Context->Transfer->NewFileSize, LargestPick);
+    AddRef(); // Ref for the transfer; dropped in TransferFinished.
+    Context->RefCount = 1; // Ref for the stream, held here until it arrives.
+    lock_guard<mutex> Lock(TransferMutex);
+    RequestedRanges.emplace(make_pair(Request.FileId, Request.Offset), Context);
+    return Request;
+}
+
+QsyncSession::DataStreamContext*
+QsyncSession::ClaimRequestedRange(
+    const DataRequest& Request)
+{
+    lock_guard<mutex> Lock(TransferMutex);
+    auto Found = RequestedRanges.find(make_pair(Request.FileId, Request.Offset));
+    if (Found == RequestedRanges.end() ||
+        Found->second->RangeEnd - Found->second->RangeOffset != Request.Length) {
+        return nullptr;
+    }
+    auto Context = Found->second;
+    RequestedRanges.erase(Found);
+    return Context;
+}
+
+QsyncSession::DataStreamContext*
+QsyncSession::ClaimSpeculativeRange(
+    PushStreamContext* Push,
+    bool& Parked)
+{
+    lock_guard<mutex> Lock(TransferMutex);
+    Parked = false;
+    auto FileId = Push->Header.FileId;
+    auto Waiting = SpeculativeStreams.find(FileId);
+    if (Waiting != SpeculativeStreams.end() && Waiting->second == Push) {
+        if (Push->Data == nullptr) {
+            // Still undecided.
+            Parked = true;
+            return nullptr;
+        }
+        SpeculativeStreams.erase(Waiting);
+        auto Context = Push->Data;
+        Push->Data = nullptr;
+        return Context;
+    }
+    if (DeclinedSpeculative.erase(FileId) != 0) {
+        return nullptr;
+    }
+    auto Found = RequestedRanges.find(make_pair(FileId, 0));
+    if (Found != RequestedRanges.end()) {
+        auto Context = Found->second;
+        RequestedRanges.erase(Found);
+        return Context;
+    }
+    if (Closed || Waiting != SpeculativeStreams.end()) {
+        // Nothing will decide it, or the client pushed the file twice.
+        return nullptr;
+    }
+    SpeculativeStreams.emplace(FileId, Push);
+    Parked = true;
+    return nullptr;
+}
+
+void
+QsyncSession::RetrySpeculative(
+    DataStreamContext* Context)
+{
+    // Back to the want list like any other file; the client kept its FileInfo.
+    Context->RefCount = 0;
+    QueueTransfer(Context);
+    // Gives back the slot, active count and ref ResolveSpeculative took.
+    TransferFinished();
+}
+
+void
+QsyncSession::ResolveSpeculative(
+    uint64_t FileId,
+    DataStreamContext* Context)
+{
+    bool Retry = false;
+    if (Context != nullptr) {
+        // Already on its way, so it skips the want list and the window.
+        Server->TakeTransferSlot();
+        AddRef(); // Ref for the transfer; dropped in TransferFinished.
+        Context->RefCount = 1; // Ref for the stream.
+    }
+    {
+        lock_guard<mutex> Lock(TransferMutex);
+        if (Context != nullptr) {
+            ++ActiveTransfers;
+        }
+        auto Waiting = SpeculativeStreams.find(FileId);
+        if (Waiting != SpeculativeStreams.end()) {
+            auto Push = Waiting->second;
+            if (Context != nullptr && !(Push->Header.Flags & DataRequestFailed)) {
+                // Its receive handler binds the stream once it resumes.
+                Push->Data = Context;
+                Push->Stream->ReceiveSetEnabled(true);
+                return;
+            }
+            // Removed from SpeculativeStreams once the stream shuts down.
+            Push->Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_ABORTED);
+            // Needed, but the client couldn't push it.
+            Retry = Context != nullptr && !Closed;
+        } else if (!Closed) {
+            if (Context != nullptr) {
+                RequestedRanges.emplace(make_pair(FileId, 0), Context);
+            } else {
+                DeclinedSpeculative.insert(FileId);
+            }
+            return;
+        }
+    }
+    if (Retry) {
+        RetrySpeculative(Context);
+    } else if (Context != nullptr) {
+        Context->Release();
+    }
+}
+
+void
+QsyncSession::SendControlFrame(
+    ControlFrameType Type,
+    const void* Entries,
+    uint32_t EntrySize,
+    uint32_t Count)
+{
+    if (ControlStream == nullptr) {
+        // A replayed session; there is no client to tell.
+        return;
+    }
+    uint32_t Length = sizeof(ControlFrameHeader) + EntrySize * Count;
+    QUIC_BUFFER* Buffer = (QUIC_BUFFER*)malloc(sizeof(QUIC_BUFFER) + sizeof(Length) + Length);
+    if (Buffer == nullptr) {
+        LogError() << "[CONTROL] Failed to allocate control frame";
+        return;
+    }
+    Buffer->Buffer = (uint8_t*)(Buffer + 1);
+    Buffer->Length = sizeof(Length) + Length;
+    ControlFrameHeader Header{Type};
+    memcpy(Buffer->Buffer, &Length, sizeof(Length));
+    memcpy(Buffer->Buffer + sizeof(Length), &Header, sizeof(Header));
+    if (Count > 0) {
+        memcpy(Buffer->Buffer + sizeof(Length) + sizeof(Header), Entries, EntrySize * Count);
+    }
+    QUIC_STATUS Status;
+    if (QUIC_FAILED(Status = ControlStream->Send(Buffer, 1, QUIC_SEND_FLAG_NONE, Buffer))) {
+        LogError() << "[CONTROL] Failed to send control frame with error: " << std::hex << Status;
+        free(Buffer);
+    }
+}
+
+void
+QsyncSession::SendWantList(
+    const vector<DataRequest>& Wanted)
+{
+    for (size_t i = 0; i < Wanted.size(); i += MAX_WANT_LIST_ENTRIES) {
+        uint32_t Count = (uint32_t)min<size_t>(Wanted.size() - i, MAX_WANT_LIST_ENTRIES);
+        SendControlFrame(ControlFrameWantList, Wanted.data() + i, sizeof(DataRequest), Count);
+    }
+}
+
+void
+QsyncSession::UpdateConcurrency()
+{
+    bool Limited;
+    uint32_t MaxWindow;
+    {
+        lock_guard<mutex> Lock(TransferMutex);
+        if (Closed) {
+            return;
+        }
+        Limited = !PendingTransfers.empty() && ActiveTransfers >= Concurrency.Window();
+        MaxWindow = DATA_STREAM_CREDIT * (uint32_t)(1 + DataConnections.size());
+    }
+    QUIC_STATISTICS_V2 QuicStats{};
+    if (QUIC_FAILED(Connection->GetStatistics(&QuicStats))) {
+        QuicStats.Rtt = 0;
+    } else {
+        Metrics.ConnectionRtt.Record(QuicStats.Rtt);
+    }
+    Concurrency.Update(
+        QuicStats.Rtt,
+        Server->IoPool.QueueDepth(),
+        Server->IoPool.ThreadCount(),
+        Limited,
+        MaxWindow);
+}
+
+void
+QsyncSession::TransferFinished()
+{
+    {
+        lock_guard<mutex> Lock(TransferMutex);
+        --ActiveTransfers;
+    }
+    Server->ReleaseTransferSlot();
+    UpdateConcurrency();
+    StartPendingTransfers();
+    Release();
+}
+
+void
+QsyncSession::Close()
+{
+    multimap<uint64_t, DataStreamContext*> Abandoned;
+    map<pair<uint64_t, uint64_t>, DataStreamContext*> Unanswered;
+    vector<QsyncSession*> Joined;
+    {
+        lock_guard<mutex> Lock(TransferMutex);
+        Closed = true;
+        Abandoned.swap(PendingTransfers);
+        Unanswered.swap(RequestedRanges);
+        // Nothing will come for these now.
+        DeclinedSpeculative.clear();
+        Joined = DataConnections;
+        for (auto Data : Joined) {
+            Data->AddRef();
+        }
+    }
+    {
+        lock_guard<mutex> Lock(IncomingMutex);
+        if (HoldIncoming) {
+            // Never confirmed, so likely a replay; none of it is applied.
+            Metrics.ControlIncoming.Add(-(int64_t)Incoming.size());
+            Incoming.clear();
+            HoldIncoming = false;
+            IncomingDrained.notify_all();
+        }
+    }
+    for (auto& Pending : Abandoned) {
+        Pending.second->Discard();
+    }
+    for (auto& Requested : Unanswered) {
+        // Requested but the client never opened a stream for it.
+        Requested.second->Release();
+    }
+    for (auto Data : Joined) {
+        // Detached, and released, once each finishes shutting down.
+        Data->Connection->Shutdown((QUIC_UINT62)QUIC_STATUS_SUCCESS);
+        Data->Release();
+    }
+    if (Primary != nullptr) {
+        Primary->DetachConnection(this);
+        Primary->Release();
+        Primary = nullptr;
+    } else {
+        LogInfo()
+            .With("files_received", Stats.FilesReceived)
+            .With("files_current", Stats.FilesCurrent)
+            .With("files_wanted", Stats.FilesWanted)
+            .With("files_transferred", Stats.FilesTransferred)
+            .With("bytes_written", Stats.BytesWritten)
+            << "Connection shutdown";
+    }
+    if (Connection != nullptr) {
+        RecordConnectionStatistics(Connection.get());
+    }
+    Server->RemoveSession(this);
+    Release();
+}
+
+QUIC_STATUS
+QsyncSession::QsyncSessionConnectionCallback(
+    _In_ MsQuicConnection* /*Connection*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_CONNECTION_EVENT* Event)
+{
+    auto This = (QsyncSession*)Context;
+    switch (Event->Type) {
+    case QUIC_CONNECTION_EVENT_CONNECTED:
+        if (Event->CONNECTED.SessionResumed) {
+            Metrics.ConnectionsResumed.Add();
+        }
+        // For the client to resume with next sync; it only keeps the control connection's.
+        MsQuic->ConnectionSendResumptionTicket(This->Connection->Handle, QUIC_SEND_RESUMPTION_FLAG_NONE, 0, nullptr);
+        This->ConfirmHandshake();
+        break;
+    case QUIC_CONNECTION_EVENT_PEER_CERTIFICATE_RECEIVED:
+        if (!QcVerifyCertificate(This->Server->CertPw, Event->PEER_CERTIFICATE_RECEIVED.Certificate)) {
+            return QUIC_STATUS_BAD_CERTIFICATE;
+        }
+        break;
+    case QUIC_CONNECTION_EVENT_PEER_STREAM_STARTED: {
+        if (This->ControlStream == nullptr) {
+            This->ControlStream = make_unique<MsQuicStream>(
+                Event->PEER_STREAM_STARTED.Stream,
+                CleanUpManual,
+                QSyncServerControlStreamCallback,
+                This);
+            break;
+        }
+        // Every later stream is the client pushing a range it was asked for.
+        auto Push = new PushStreamContext{};
+        Push->Carrier = This;
+        This->AddRef();
+        auto Stream = new MsQuicStream(
+            Event->PEER_STREAM_STARTED.Stream,
+            CleanUpAutoDelete,
+            QSyncServerPushStreamCallback,
+            Push);
+        if (QUIC_FAILED(Stream->GetInitStatus())) {
+            LogError() << "[DATA] Failed to accept data stream: " << Stream->GetInitStatus();
+            delete Stream;
+            This->Release();
+            delete Push;
+            return QUIC_STATUS_INTERNAL_ERROR;
+        }
+        Push->Stream = Stream;
+        break;
+    }
+    case QUIC_CONNECTION_EVENT_SHUTDOWN_COMPLETE:
+        This->Close();
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+bool
+QsyncSession::OnControlReceive(
+    const QUIC_BUFFER* Buffers,
+    uint32_t BufferCount,
+    bool EarlyData)
+{
+    if (EarlyData) {
+        //
+        // Anyone who saw the client's first flight can send it again, and
+        // the records in it move, link and create paths. The hello is still
+        // taken, since a duplicate token is refused, but the records wait
+        // until the handshake proves the client is really there.
+        //
+        lock_guard<mutex> Lock(IncomingMutex);
+        if (!HandshakeConfirmed) {
+            HoldIncoming = true;
+        }
+    }
+    for (auto BufIdx = 0u; BufIdx < BufferCount; ++BufIdx) {
+        QUIC_BUFFER Remaining = Buffers[BufIdx];
+        if (HelloFilled < sizeof(Hello)) {
+            uint32_t HelloPart = min((uint32_t)sizeof(Hello) - HelloFilled, Remaining.Length);
+            memcpy(HelloBytes + HelloFilled, Remaining.Buffer, HelloPart);
+            HelloFilled += HelloPart;
+            Remaining.Buffer += HelloPart;
+            Remaining.Length -= HelloPart;
+            if (HelloFilled < sizeof(Hello)) {
+                continue;
+            }
+            if (!OnHello()) {
+                return false;
+            }
+        }
+        if (Primary != nullptr) {
+            // Joined connections only carry data streams.
+            continue;
+        }
+        if (Capture != nullptr) {
+            Capture->Write(Remaining.Buffer, Remaining.Length);
+        }
+        if (!Parser.Parse(
+                &Remaining,
+                1,
+                [this](const uint8_t* Message, uint32_t Length) {
+                    AddFileToList(Message, Length);
+                })) {
+            LogError() << "[CONTROL] Malformed control stream, closing connection";
+            return false;
+        }
+    }
+    return true;
+}
+
+QUIC_STATUS
+QsyncSession::QSyncServerControlStreamCallback(
+    _In_ MsQuicStream* Stream,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event)
+{
+    auto This = (QsyncSession*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_RECEIVE:
+        if (!This->OnControlReceive(
+                Event->RECEIVE.Buffers,
+                Event->RECEIVE.BufferCount,
+                (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_0_RTT) != 0)) {
+            Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INTERNAL_ERROR);
+            This->Connection->Shutdown((QUIC_UINT62)QUIC_STATUS_INTERNAL_ERROR);
+        }
+        break;
+    case QUIC_STREAM_EVENT_SEND_COMPLETE:
+        free(Event->SEND_COMPLETE.ClientContext);
+        break;
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+bool
+QsyncSession::FileTransfer::Prepare()
+{
+    lock_guard<mutex> Lock(Mutex);
+    if (Prepared) {
+        return !PrepareFailed;
+    }
+    Prepared = true;
+    if (ResumeOffset > 0) {
+        // The partial file from an interrupted transfer is already sized.
+        return true;
+    }
+    ofstream Create(TempDestinationPath, ios::binary | ios::out | ios::trunc);
+    if (!Create.good()) {
+        LogError() << "Failed to open file for writing " << TempDestinationPath << " " << strerror(errno);
+        PrepareFailed = true;
+        return false;
+    }
+    Create.close();
+    // Size the file up front without allocating blocks, so holes the
+    // client skips stay holes here too, and ranges can land in any order.
+    error_code Error;
+    fs::resize_file(TempDestinationPath, NewFileSize, Error);
+    if (Error) {
+        LogError() << "Failed to preallocate " << TempDestinationPath << " " << Error;
+        PrepareFailed = true;
+        return false;
+    }
+    return true;
+}
+
+void
+QsyncSession::FileTransfer::RangeFinished(
+    uint32_t Index)
+{
+    {
+        lock_guard<mutex> Lock(Mutex);
+        RangeProgress[Index] = RangeEnds[Index];
+        if (--RangesRemaining != 0) {
+            return;
+        }
+    }
+    Finish();
+}
+
+void
+QsyncSession::FileTransfer::RangeStopped(
+    uint32_t Index,
+    uint64_t WriteOffset)
+{
+    lock_guard<mutex> Lock(Mutex);
+    RangeProgress[Index] = max(RangeProgress[Index], WriteOffset);
+}
+
+void
+QsyncSession::FileTransfer::Finish()
+{
+    TraceScope Span(FileId, TraceFinish);
+    error_code Error;
+    auto StillExists = fs::exists(DestinationPath, Error);
+    if (Error) {
+        LogError() << "Failed to test if " << DestinationPath << " still exists " << Error;
+        StillExists = false;
+    }
+    if (FileExists && StillExists) {
+        // TODO: validate file hasn't changed
+        auto FileSize = fs::file_size(DestinationPath, Error);
+        if (Error) {
+            LogError() << "Failed to get file size for existing file " << DestinationPath << " why " << Error;
+            fs::remove(TempDestinationPath);
+            return;
+        }
+        if (FileSize != SnapshotDestSize) {
+            LogError() << DestinationPath << " changed in size " << FileSize << " vs " << SnapshotDestSize;
+            fs::remove(TempDestinationPath);
+            return;
+        }
+        auto CurrentFileTime = fs::last_write_time(DestinationPath, Error);
+        if (Error) {
+            LogError() << "Failed to get last mod time for existing file " << DestinationPath << " why " << Error;
+            fs::remove(TempDestinationPath);
+            return;
+        }
+        if (CurrentFileTime != SnapshotDestModTime) {
+            LogError() << DestinationPath << " modified " << CurrentFileTime << " vs " << SnapshotDestModTime;
+            fs::remove(TempDestinationPath);
+            return;
+        }
+    }
+    fs::rename(TempDestinationPath, DestinationPath, Error);
+    if (Error) {
+        LogError() << "Failed to rename " << TempDestinationPath << " to " << DestinationPath << " why " << Error;
+        fs::remove(TempDestinationPath);
+        return;
+    }
+    fs::last_write_time(DestinationPath, FileTime, Error);
+    if (Error) {
+        LogError() << "Failed to set time on " << DestinationPath << " to " << FileTime << " why " << Error;
+        return;
+    }
+    Completed = true;
+    if (ResumeOffset > 0) {
+        fs::remove(ResumePathFor(TempDestinationPath), Error);
+    }
+    LogDebug().With("file", (char*)DestinationPath.u8string().c_str()) << "Finished file";
+}
+
+void
+QsyncSession::FileTransfer::SaveResumeState()
+{
+    error_code Error;
+    if (!Prepared || PrepareFailed || !fs::exists(TempDestinationPath, Error)) {
+        return;
+    }
+    //
+    // Chunks arrive in offset order within a range and holes were never
+    // written, so the valid prefix runs through every finished range and
+    // the written part of the first unfinished one.
+    //
+    uint64_t VerifiedBytes = 0;
+    for (auto i = 0u; i < RangeStarts.size(); ++i) {
+        VerifiedBytes = RangeProgress[i];
+        if (RangeProgress[i] != RangeEnds[i]) {
+            break;
+        }
+    }
+    if (VerifiedBytes <= ResumeOffset) {
+        return;
+    }
+    ResumeRecord Record;
+    memcpy(Record.Magic, ResumeMagic, sizeof(ResumeMagic));
+    Record.SourceSize = NewFileSize;
+    Record.SourceModifiedTime = SourceModifiedTime;
+    Record.VerifiedBytes = VerifiedBytes;
+    ofstream Output(ResumePathFor(TempDestinationPath), ios::binary | ios::out | ios::trunc);
+    Output.write((const char*)&Record, sizeof(Record));
+    if (Output.fail()) {
+        LogError() << "Failed to save resume state for " << TempDestinationPath;
+        return;
+    }
+    LogInfo() << "Transfer interrupted, " << VerifiedBytes << " bytes of " << TempDestinationPath << " kept for resume";
+}
+
+void
+QsyncSession::FileTransfer::Release()
+{
+    if (--RefCount == 0) {
+        if (!Completed) {
+            SaveResumeState();
+            Session->SendFileFailed(FileId);
+        } else {
+            ++Session->Stats.FilesTransferred;
+            Metrics.FilesTransferred.Add();
+            Metrics.TransferLatency.Record(MetricNowUs() - StartedAt);
+            Session->SendFileAck(FileId);
+        }
+        Session->CompleteHardLinks(FileId, Completed);
+        delete this;
+    }
+}
+
+bool
+QsyncSession::DataStreamContext::WriteData(
+    const uint8_t* Data,
+    uint32_t Length)
+{
+    FileWriteStream.write((const char*)Data, Length);
+    if (FileWriteStream.fail()) {
+        LogError() << "Failed to write to file " << Transfer->TempDestinationPath << " " << strerror(errno);
+        return false;
+    }
+    BytesWritten += Length;
+    WriteOffset += Length;
+    Metrics.BytesWritten.Add(Length);
+    return true;
+}
+
+bool
+QsyncSession::DataStreamContext::WriteCompressedChunk(
+    const uint8_t* Frame)
+{
+    if (DCtx == nullptr) {
+        DCtx = ZSTD_createDCtx();
+        if (DCtx == nullptr) {
+            LogError() << "Failed to allocate decompression context for " << Transfer->TempDestinationPath;
+            return false;
+        }
+    }
+    DecompressedChunk.resize(ChunkHeader.RawLength);
+    size_t Result =
+        ZSTD_decompressDCtx(
+            DCtx,
+            DecompressedChunk.data(),
+            DecompressedChunk.size(),
+            Frame,
+            ChunkHeader.Length);
+    if (ZSTD_isError(Result) || Result != ChunkHeader.RawLength) {
+        LogError() << "Failed to decompress chunk for " << Transfer->TempDestinationPath << " "
+            << (ZSTD_isError(Result) ? ZSTD_getErrorName(Result) : "length mismatch");
+        return false;
+    }
+    return WriteData(DecompressedChunk.data(), ChunkHeader.RawLength);
+}
+
+bool
+QsyncSession::DataStreamContext::ConsumeChunks(
+    const uint8_t* Data,
+    uint32_t Length)
+{
+    while (Length > 0) {
+        if (ChunkHeaderBytes < sizeof(ChunkHeader)) {
+            uint32_t HeaderPart = min((uint32_t)sizeof(ChunkHeader) - ChunkHeaderBytes, Length);
+            memcpy((uint8_t*)&ChunkHeader + ChunkHeaderBytes, Data, HeaderPart);
+            ChunkHeaderBytes += HeaderPart;
+            Data += HeaderPart;
+            Length -= HeaderPart;
+            if (ChunkHeaderBytes < sizeof(ChunkHeader)) {
+                break;
+            }
+            bool Compressed = !!(ChunkHeader.Flags & DataChunkCompressed);
+            if (ChunkHeader.Length > DATA_CHUNK_MAX_LENGTH ||
+                ChunkHeader.RawLength > DATA_CHUNK_MAX_LENGTH ||
+                (!Compressed && ChunkHeader.Length != ChunkHeader.RawLength) ||
+                (Compressed && ChunkHeader.Length == 0) ||
+                ChunkHeader.Offset < WriteOffset ||
+                ChunkHeader.Offset > RangeEnd ||
+                ChunkHeader.RawLength > RangeEnd - ChunkHeader.Offset) {
+                LogError() << "Invalid chunk header for " << Transfer->TempDestinationPath;
+                return false;
+            }
+            if (ChunkHeader.Offset != WriteOffset) {
+                // Skipping a hole; the temp file is already sized, so it stays sparse.
+                FileWriteStream.seekp(ChunkHeader.Offset);
+                WriteOffset = ChunkHeader.Offset;
+            }
+            ChunkBytesRemaining = ChunkHeader.Length;
+            CompressedChunk.clear();
+            if (ChunkBytesRemaining == 0) {
+                // Nothing follows, as with the range's end marker.
+                ChunkHeaderBytes = 0;
+                continue;
+            }
+        }
+        uint32_t Available = min(ChunkBytesRemaining, Length);
+        if (!(ChunkHeader.Flags & DataChunkCompressed)) {
+            if (!WriteData(Data, Available)) {
+                return false;
+            }
+        } else if (Available == ChunkHeader.Length) {
+            // The whole frame is in this receive buffer; no need to stage it.
+            if (!WriteCompressedChunk(Data)) {
+                return false;
+            }
+        } else {
+            CompressedChunk.insert(CompressedChunk.end(), Data, Data + Available);
+            if (CompressedChunk.size() == ChunkHeader.Length &&
+                !WriteCompressedChunk(CompressedChunk.data())) {
+                return false;
+            }
+        }
+        Data += Available;
+        Length -= Available;
+        ChunkBytesRemaining -= Available;
+        if (ChunkBytesRemaining == 0) {
+            ChunkHeaderBytes = 0;
+        }
+    }
+    return true;
+}
+
+void
+QsyncSession::DataStreamContext::FileIoWorker()
+{
+    if (!FileWriteStream.is_open()) {
+        Tracer.Instant(Transfer->FileId, TraceFirstByte);
+        if (!Transfer->Prepare()) {
+            Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INTERNAL_ERROR);
+            goto Deref;
+        }
+        // Every range writes through its own handle on the shared temp file.
+        FileWriteStream.open(Transfer->TempDestinationPath, ios::binary | ios::in | ios::out);
+        FileWriteStream.seekp(RangeOffset);
+        WriteOffset = RangeOffset;
+        if (!FileWriteStream.good()) {
+            LogError() << "Failed to open file for writing " << Transfer->TempDestinationPath << " " << strerror(errno);
+            Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INTERNAL_ERROR);
+            goto Deref;
+        }
+    }
+    {
+        // Once ReceiveComplete is called the next receive may overwrite this.
+        bool Final = FinalReceive;
+        uint64_t TotalConsumed = 0;
+        for (auto i = 0u; i < BufferCount; ++i) {
+            if (!ConsumeChunks(Buffers[i].Buffer, Buffers[i].Length)) {
+                Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INTERNAL_ERROR);
+                goto Deref;
+            }
+            TotalConsumed += Buffers[i].Length;
+        }
+        // Cleared first, or the next receive would skip real chunk data.
+        uint32_t Skipped = SkipBytes;
+        SkipBytes = 0;
+        Stream->ReceiveComplete(TotalConsumed + Skipped);
+        Transfer->Session->Concurrency.OnWritten(TotalConsumed);
+        if (Final) {
+            Tracer.Instant(Transfer->FileId, TraceLastByte);
+            FileWriteStream.flush();
+            FileWriteStream.close();
+            if (ChunkHeaderBytes != 0 || ChunkBytesRemaining != 0) {
+                LogError() << "Data stream ended in the middle of a chunk! " << Transfer->TempDestinationPath;
+                goto Deref;
+            }
+            if (WriteOffset != RangeEnd) {
+                // The temp file is presized, so the rest would be zeros.
+                LogError() << "Data stream ended at " << WriteOffset << " before its range end "
+                    << RangeEnd << "! " << Transfer->TempDestinationPath;
+                goto Deref;
+            }
+            Completed = true;
+            Transfer->Session->Concurrency.OnRangeFinished();
+            Transfer->RangeFinished(RangeIndex);
+        }
+    }
+Deref:
+    Release();
+}
+
+void
+QsyncSession::DataStreamContext::Release()
+{
+    if (--RefCount == 0) {
+        if (FileWriteStream.is_open()) {
+            FileWriteStream.flush();
+            FileWriteStream.close();
+        }
+        if (!Completed) {
+            Transfer->RangeStopped(RangeIndex, WriteOffset);
+        }
+        auto Owner = Transfer->Session;
+        Owner->Stats.BytesWritten += BytesWritten;
+        Transfer->Release();
+        if (Carrier != nullptr) {
+            Carrier->Release();
+        }
+        delete this;
+        Owner->TransferFinished();
+    }
+}
+
+void
+QsyncSession::DataStreamContext::Discard()
+{
+    // For ranges that were never requested.
+    Transfer->Release();
+    delete this;
+}
+
+void
+QsyncSession::SendFileAck(
+    uint64_t Id)
+{
+    Tracer.Instant(Id, TraceAcked);
+    Tracer.End(Id, TraceFile);
+    SendControlFrame(ControlFrameFileAck, &Id, sizeof(Id), 1);
+}
+
+void
+QsyncSession::SendFileFailed(
+    uint64_t Id)
+{
+    {
+        // Transfers dropped as the session closes; there's no one to tell.
+        lock_guard<mutex> Lock(TransferMutex);
+        if (Closed) {
+            return;
+        }
+    }
+    Tracer.End(Id, TraceFile);
+    SendControlFrame(ControlFrameFileFailed, &Id, sizeof(Id), 1);
+}
+
+void
+QsyncSession::CompleteHardLinks(
+    uint64_t Id,
+    bool Linked)
+{
+    vector<SerializedFileInfo> Links;
+    {
+        lock_guard<mutex> Lock(HardLinkMutex);
+        auto Pending = PendingHardLinks.find(Id);
+        if (Pending == PendingHardLinks.end()) {
+            return;
+        }
+        Links = std::move(Pending->second);
+        PendingHardLinks.erase(Pending);
+    }
+    for (const auto& Link : Links) {
+        FileInfoMessage Message(Link, Hello.Flags & SessionFlagUnpacked);
+        auto File = Message.Get();
+        if (!Linked) {
+            // Linking now would point it at the old copy, or at nothing.
+            SendFileFailed(File.getId());
+        } else if (!DoesFileNeedUpdate(Server->BasePath, File) ||
+                   CreateHardLink(Server->BasePath, File)) {
+            SendFileAck(File.getId());
+        } else {
+            SendFileFailed(File.getId());
+        }
+    }
+}
+
+void
+QsyncSession::QSyncServerWorkerCallback(
+    _In_ const SerializedFileInfo& Info)
+{
+    // Info is its own allocation, so an unpacked record is word aligned.
+    FileInfoMessage Message(Info, Hello.Flags & SessionFlagUnpacked);
+    auto File = Message.Get();
+    ++Stats.FilesReceived;
+    Metrics.FilesReceived.Add();
+    auto Id = File.getId();
+    Tracer.Begin(Id, TraceFile);
+    Tracer.Instant(Id, TraceReceived);
+    TraceScope Decide(Id, TraceDecide);
+    // The client is already pushing this one; it has to be taken or declined.
+    bool Speculative = File.getSpeculative() && File.getType() == FileInfo::Type::FILE;
+    // Other names of this file wait on it; see CompleteHardLinks.
+    bool FirstName = File.getType() == FileInfo::Type::FILE && File.getLinkId() == Id;
+
+    if (File.getType() == FileInfo::Type::HARDLINK) {
+        //
+        // Decided before comparing with the first name, which may be about
+        // to be replaced by new data. Names scanned in parallel can get a
+        // lower id than the first name, and so arrive before it.
+        //
+        lock_guard<mutex> Lock(HardLinkMutex);
+        auto Pending = PendingHardLinks.find(File.getLinkId());
+        if (Pending != PendingHardLinks.end() || File.getLinkId() > Id) {
+            PendingHardLinks[File.getLinkId()].push_back(Info);
+            return;
+        }
+    }
+
+    if (DoesFileNeedUpdate(Server->BasePath, File)) {
+        u8string_view PathView((char8_t*)File.getPath().cStr());
+        auto DestinationPath = Server->BasePath / PathView;
+        error_code Error;
+        if (File.hasPreviousPath() && MoveFromPreviousPath(Server->BasePath, File) &&
+            File.getType() == FileInfo::Type::FILE) {
+            // The old copy was moved into place; no data needs to be sent.
+            if (Speculative) {
+                ResolveSpeculative(Id, nullptr);
+            }
+            SendFileAck(Id);
+            if (FirstName) {
+                CompleteHardLinks(Id, true);
+            }
+            return;
+        }
+        if (File.getType() == FileInfo::Type::DIR) {
+            if (fs::exists(DestinationPath, Error)) {
+                if (Error) {
+                    LogError() << "Failed to test whether the folder exists (success?) " << DestinationPath << " why " << Error;
+                    SendFileFailed(Id);
+                    return;
+                }
+            } else {
+                if (Error) {
+                    LogError() << "Failed to test whether the folder exists (failed?) " << DestinationPath << " why " << Error;
+                    SendFileFailed(Id);
+                    return;
+                }
+                fs::create_directory(DestinationPath, Error);
+                if (Error) {
+                    LogError() << "Failed to create directory " << DestinationPath << " why " << Error;
+                    SendFileFailed(Id);
+                    return;
+                }
+            }
+            chrono::utc_time<chrono::seconds> FileTime(chrono::seconds(File.getModifiedTime()));
+            fs::last_write_time(DestinationPath, chrono::file_clock::from_utc(FileTime), Error);
+            if (Error) {
+                LogError() << "Failed to set directory modified time " << DestinationPath << " why " << Error;
+                SendFileFailed(Id);
+                return;
+            }
+            // Lets the client drop the record; nothing will ask for it.
+            SendFileAck(Id);
+            return;
+        } else if (File.getType() == FileInfo::Type::FILESYMLINK) {
+            if (fs::exists(DestinationPath, Error)) {
+                if (Error) {
+                    LogError() << "Failed to test whether the file symlink exists (success?) " << DestinationPath << " why " << Error;
+                    SendFileFailed(Id);
+                    return;
+                }
+            } else {
+                if (Error) {
+                    LogError() << "Failed to test whether the file symlink exists (failure?) " << DestinationPath << " why " << Error;
+                    SendFileFailed(Id);
+                    return;
+                }
+                u8string_view LinkDestView((char8_t*)File.getLinkPath().cStr());
+                fs::path LinkDest(LinkDestView);
+                fs::create_symlink(LinkDest, DestinationPath, Error);
+                if (Error) {
+                    LogError() << "Failed to create file symlink " << DestinationPath << " -> " << LinkDest << " why " << Error;
+                    SendFileFailed(Id);
+                    return;
+                }
+            }
+            SendFileAck(Id);
+            return;
+        } else if (File.getType() == FileInfo::Type::DIRSYMLINK) {
+            if (fs::exists(DestinationPath, Error)) {
+                if (Error) {
+                    LogError() << "Failed to test whether the dirsymlink exists (success?) " << DestinationPath << " why " << Error;
+                    SendFileFailed(Id);
+                    return;
+                }
+            } else {
+                if (Error) {
+                    LogError() << "Failed to test whether the dirsymlink exists (failure?) " << DestinationPath << " why " << Error;
+                    SendFileFailed(Id);
+                    return;
+                }
+                u8string_view LinkDestView((char8_t*)File.getLinkPath().cStr());
+                fs::path LinkDest(LinkDestView);
+                fs::create_directory_symlink(LinkDest, DestinationPath, Error);
+                if (Error) {
+                    LogError() << "Failed to create dirsymlink " << DestinationPath << " -> " << LinkDest << " why " << Error;
+                    SendFileFailed(Id);
+                    return;
+                }
+            }
+            SendFileAck(Id);
+            return;
+        } else if (File.getType() == FileInfo::Type::HARDLINK) {
+            if (CreateHardLink(Server->BasePath, File)) {
+                SendFileAck(Id);
+            } else {
+                SendFileFailed(Id);
+            }
+            return;
+        }
+        ASSERT(File.getType() == FileInfo::Type::FILE);
+        auto Transfer = new FileTransfer();
+        Transfer->Session = this;
+        Transfer->StartedAt = MetricNowUs();
+        Transfer->FileId = Id;
+        Transfer->FileTime =
+            chrono::file_clock::from_utc(
+                chrono::utc_time<chrono::seconds>(chrono::seconds(File.getModifiedTime())));
+        Transfer->NewFileSize = File.getSize();
+        Transfer->FileInfo = Info;
+        Transfer->SourceModifiedTime = File.getModifiedTime();
+        auto TempPath = DestinationPath;
+        Transfer->TempDestinationPath = std::move(TempPath += ".qsync");
+        // Speculative pushes always carry the whole file.
+        Transfer->ResumeOffset = Speculative ? 0 : FindResumeOffset(Transfer->TempDestinationPath, File);
+        if (fs::exists(DestinationPath, Error)) {
+            Transfer->FileExists = true;
+            if (Error) {
+                LogError() << "Failed to test whether " << DestinationPath << " exists. " << Error;
+                delete Transfer;
+                if (Speculative) {
+                    ResolveSpeculative(Id, nullptr);
+                }
+                SendFileFailed(Id);
+                if (FirstName) {
+                    CompleteHardLinks(Id, false);
+                }
+                return;
+            }
+            Transfer->SnapshotDestModTime = fs::last_write_time(DestinationPath, Error);
+            if (Error) {
+                LogError() << "Failed to get lastwritetime on " << DestinationPath << " error: " << Error;
+                delete Transfer;
+                if (Speculative) {
+                    ResolveSpeculative(Id, nullptr);
+                }
+                SendFileFailed(Id);
+                if (FirstName) {
+                    CompleteHardLinks(Id, false);
+                }
+                return;
+            }
+            Transfer->SnapshotDestSize = fs::file_size(DestinationPath, Error);
+            if (Error) {
+                LogError() << "Failed to get file size from " << DestinationPath << " error: " << Error;
+                delete Transfer;
+                if (Speculative) {
+                    ResolveSpeculative(Id, nullptr);
+                }
+                SendFileFailed(Id);
+                if (FirstName) {
+                    CompleteHardLinks(Id, false);
+                }
+                return;
+            }
+        }
+        ++Stats.FilesWanted;
+        Transfer->DestinationPath = std::move(DestinationPath);
+        if (Speculative) {
+            Transfer->RangeStarts.push_back(0);
+            Transfer->RangeEnds.push_back(Transfer->NewFileSize);
+            Transfer->RangeProgress.push_back(0);
+            Transfer->RangesRemaining = 1;
+        } else {
+            SplitRanges(Transfer);
+        }
+        if (FirstName) {
+            // Other names of this file are linked once its data is written.
+            lock_guard<mutex> Lock(HardLinkMutex);
+            PendingHardLinks.try_emplace(Id);
+        }
+        // Take every range's ref up front so the transfer outlives them all.
+        Transfer->RefCount = (uint32_t)Transfer->RangeStarts.size();
+        for (auto i = 0u; i < Transfer->RangeStarts.size(); ++i) {
+            auto Context = new DataStreamContext();
+            Context->Transfer = Transfer;
+            Context->RangeIndex = i;
+            Context->RangeOffset = Transfer->RangeStarts[i];
+            Context->RangeEnd = Transfer->RangeEnds[i];
+            if (Speculative) {
+                ResolveSpeculative(Id, Context);
+            } else {
+                QueueTransfer(Context);
+            }
+        }
+    } else {
+        ++Stats.FilesCurrent;
+        Metrics.FilesSkipped.Add();
+        if (Speculative) {
+            ResolveSpeculative(Id, nullptr);
+        }
+        SendFileAck(Id);
+        if (FirstName) {
+            CompleteHardLinks(Id, true);
+        }
+    }
+}
+
+QUIC_STATUS
+QsyncSession::QSyncServerPushStreamCallback(
+    _In_ MsQuicStream* Stream,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event)
+{
+    auto This = (PushStreamContext*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_RECEIVE: {
+        uint32_t Used = 0;
+        for (auto BufIdx = 0u;
+             BufIdx < Event->RECEIVE.BufferCount && This->HeaderFilled < sizeof(This->Header);
+             ++BufIdx) {
+            uint32_t Part = min((uint32_t)sizeof(This->Header) - This->HeaderFilled, Event->RECEIVE.Buffers[BufIdx].Length);
+            memcpy(This->HeaderBytes + This->HeaderFilled, Event->RECEIVE.Buffers[BufIdx].Buffer, Part);
+            This->HeaderFilled += Part;
+            Used += Part;
+        }
+        if (This->HeaderFilled < sizeof(This->Header)) {
+            if (Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN) {
+                LogError() << "[DATA] Data stream ended before its request header";
+                Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INTERNAL_ERROR);
+            }
+            break;
+        }
+        auto Owner = This->Carrier->Primary != nullptr ? This->Carrier->Primary : This->Carrier;
+        DataStreamContext* Data;
+        if (This->Header.Flags & DataRequestSpeculative) {
+            bool Parked;
+            This->Owner = Owner;
+            Data = Owner->ClaimSpeculativeRange(This, Parked);
+            if (Parked) {
+                // Leave the rest unconsumed, which pauses receives until
+                // ResolveSpeculative turns them back on.
+                Event->RECEIVE.TotalBufferLength = Used;
+                break;
+            }
+            if (Data == nullptr) {
+                // The file is current, or this session is closing.
+                Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_ABORTED);
+                break;
+            }
+        } else {
+            Data = Owner->ClaimRequestedRange(This->Header);
+            if (Data == nullptr) {
+                LogError() << "[DATA] Client pushed a range that was not requested";
+                Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_INTERNAL_ERROR);
+                break;
+            }
+        }
+        if (This->Header.Flags & DataRequestFailed) {
+            Stream->Shutdown((QUIC_UINT62)QUIC_STATUS_SUCCESS, QUIC_STREAM_SHUTDOWN_FLAG_GRACEFUL);
+            if (This->Header.Flags & DataRequestSpeculative) {
+                // Ask for it on the want list instead.
+                Owner->RetrySpeculative(Data);
+            } else {
+                // The client could not read the file; drop the range.
+                Data->Release();
+            }
+            break;
+        }
+        // Hand the stream, and the ref on its carrier, over to the range.
+        Tracer.Instant(Data->Transfer->FileId, TraceStreamStart);
+        Data->Carrier = This->Carrier;
+        Data->Stream = Stream;
+        Data->SkipBytes = Used;
+        Stream->Context = Data;
+        Stream->Callback = QSyncServerDataStreamCallback;
+        delete This;
+        return QSyncServerDataStreamCallback(Stream, Data, Event);
+    }
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE: {
+        DataStreamContext* Data = nullptr;
+        if (This->Owner != nullptr) {
+            lock_guard<mutex> Lock(This->Owner->TransferMutex);
+            auto Waiting = This->Owner->SpeculativeStreams.find(This->Header.FileId);
+            if (Waiting != This->Owner->SpeculativeStreams.end() && Waiting->second == This) {
+                This->Owner->SpeculativeStreams.erase(Waiting);
+            }
+            Data = This->Data;
+        }
+        if (Data != nullptr) {
+            // Needed, but the stream went away before it could be bound.
+            Data->Release();
+        }
+        This->Carrier->Release();
+        delete This;
+        break;
+    }
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
+
+QUIC_STATUS
+QsyncSession::QSyncServerDataStreamCallback(
+    _In_ MsQuicStream* /*Stream*/,
+    _In_opt_ void* Context,
+    _Inout_ QUIC_STREAM_EVENT* Event)
+{
+    auto This = (DataStreamContext*)Context;
+    switch (Event->Type) {
+    case QUIC_STREAM_EVENT_START_COMPLETE:
+        if (QUIC_FAILED(Event->START_COMPLETE.Status)) {
+            LogError() << "Failed to start data stream: " << std::hex << Event->START_COMPLETE.Status;
+        }
+        break;
+    case QUIC_STREAM_EVENT_RECEIVE:
+        ASSERT(Event->RECEIVE.BufferCount <= 2);
+        This->FinalReceive = !!(Event->RECEIVE.Flags & QUIC_RECEIVE_FLAG_FIN);
+        memcpy(This->Buffers, Event->RECEIVE.Buffers, sizeof(QUIC_BUFFER) * Event->RECEIVE.BufferCount);
+        This->BufferCount = Event->RECEIVE.BufferCount;
+        // Step over the DataRequest the push stream started with.
+        for (uint32_t i = 0, Skip = This->SkipBytes; i < This->BufferCount && Skip > 0; ++i) {
+            uint32_t Part = min(Skip, This->Buffers[i].Length);
+            This->Buffers[i].Buffer += Part;
+            This->Buffers[i].Length -= Part;
+            Skip -= Part;
+        }
+        ++This->RefCount;
+        // Write it out on the node whose MsQuic worker received it.
+        This->Transfer->Session->Server->IoPool.EnqueueNear(
+            CpuTopology::Get().CurrentNode(),
+            &QsyncSession::DataStreamContext::FileIoWorker,
+            This);
+        return QUIC_STATUS_PENDING;
+    case QUIC_STREAM_EVENT_SEND_COMPLETE:
+        free(Event->SEND_COMPLETE.ClientContext);
+        break;
+    case QUIC_STREAM_EVENT_SHUTDOWN_COMPLETE:
+        This->Release();
+        break;
+    default:
+        break;
+    }
+    return QUIC_STATUS_SUCCESS;
+}
@@ -0,0 +1,337 @@
+#pragma once
+
+//
+// Everything tied to one client connection: its control stream parser,
+// file ids, pending transfers and stats. Thread pools, credentials and the
+// transfer budget are shared through the owning QsyncServer.
+//
+class QsyncSession {
+    friend class QsyncServer;
+
+    //
+    // One file being received. Large files are split into ranges that are
+    // requested on separate data streams and written into the same temp
+    // file; the file is renamed into place once every range has landed.
+    //
+    struct FileTransfer {
+        QsyncSession* Session;
+        std::atomic_uint32_t RefCount; // One per range.
+        SerializedFileInfo FileInfo;
+        uintmax_t NewFileSize;
+        uint64_t FileId;
+        uint64_t ResumeOffset;
+        uint64_t SourceModifiedTime;
+        uint64_t StartedAt; // MetricNowUs() when the server decided to fetch it.
+        std::chrono::file_time<std::chrono::seconds> FileTime;
+        std::filesystem::path DestinationPath;
+        std::filesystem::path TempDestinationPath;
+        uint64_t SnapshotDestSize;
+        std::filesystem::file_time_type SnapshotDestModTime;
+        std::mutex Mutex;
+        // Start, end and bytes known good of each range, guarded by Mutex.
+        std::vector<uint64_t> RangeStarts;
+        std::vector<uint64_t> RangeEnds;
+        std::vector<uint64_t> RangeProgress;
+        uint32_t RangesRemaining;
+        bool Prepared;
+        bool PrepareFailed;
+        bool FileExists;
+        bool Completed;
+
+        FileTransfer() = default;
+
+        bool Prepare();
+        void RangeFinished(uint32_t Index);
+        void RangeStopped(uint32_t Index, uint64_t WriteOffset);
+        void Finish();
+        void SaveResumeState();
+        void Release();
+    };
+
+    struct DataStreamContext {
+        FileTransfer* Transfer;
+        QsyncSession* Carrier; // Owns the connection the stream is on.
+        MsQuicStream* Stream;
+        std::atomic_uint64_t RefCount;
+        QUIC_BUFFER Buffers[2];
+        uint32_t BufferCount;
+        uint32_t SkipBytes; // Stream header bytes at the front of Buffers.
+        uint32_t RangeIndex;
+        uint64_t RangeOffset;
+        uint64_t RangeEnd;
+        uint64_t BytesWritten;
+        uint64_t WriteOffset;
+        std::fstream FileWriteStream;
+        DataChunkHeader ChunkHeader;
+        uint32_t ChunkHeaderBytes;
+        uint32_t ChunkBytesRemaining;
+        std::vector<uint8_t> CompressedChunk;
+        std::vector<uint8_t> DecompressedChunk;
+        ZSTD_DCtx* DCtx;
+        bool FinalReceive;
+        bool Completed;
+
+        DataStreamContext() = default;
+        ~DataStreamContext() { ZSTD_freeDCtx(DCtx); }
+
+        void FileIoWorker();
+        void Release();
+        void Discard();
+        bool WriteData(const uint8_t* Data, uint32_t Length);
+        bool WriteCompressedChunk(const uint8_t* Frame);
+        bool ConsumeChunks(const uint8_t* Data, uint32_t Length);
+    };
+
+    //
+    // A data stream the client opened, until its DataRequest header has
+    // arrived and it can be matched with the range it carries.
+    //
+    struct PushStreamContext {
+        QsyncSession* Carrier;
+        MsQuicStream* Stream;
+        union {
+            DataRequest Header;
+            uint8_t HeaderBytes[sizeof(DataRequest)];
+        };
+        uint32_t HeaderFilled;
+        // Speculative streams that arrive before the server has decided on
+        // their file wait with receives paused. Set, under the owning
+        // session's TransferMutex, once the file turns out to be needed.
+        QsyncSession* Owner;
+        DataStreamContext* Data;
+    };
+
+    QsyncServer* Server;
+    std::atomic_uint32_t RefCount;
+    std::unique_ptr<MsQuicConnection> Connection;
+    std::unique_ptr<MsQuicStream> ControlStream;
+    union {
+        SessionHello Hello;
+        uint8_t HelloBytes[sizeof(SessionHello)];
+    };
+    uint32_t HelloFilled;
+    std::string Token;
+    // Set when this connection joined another session to carry its data.
+    QsyncSession* Primary;
+    // Joined connections data streams are spread over, guarded by TransferMutex.
+    std::vector<QsyncSession*> DataConnections;
+    ControlStreamParser Parser;
+    // FileInfos from the control stream, processed in order on the Pool.
+    std::mutex IncomingMutex;
+    std::deque<SerializedFileInfo> Incoming;
+    bool IncomingScheduled;
+    // Records that came in 0-RTT may be a replay, so none are processed
+    // until the handshake is confirmed. Both guarded by IncomingMutex.
+    bool HoldIncoming;
+    bool HandshakeConfirmed;
+    std::condition_variable IncomingDrained;
+    // Raw control stream bytes, when the server was started with --capture.
+    std::unique_ptr<ControlCaptureWriter> Capture;
+    std::mutex HardLinkMutex;
+    // Links waiting for the file they point at to be final, by its id.
+    std::unordered_map<uint64_t, std::vector<SerializedFileInfo>> PendingHardLinks;
+    std::mutex TransferMutex;
+    // Keyed by the server's TransferOrder; equal keys stay in arrival order.
+    std::multimap<uint64_t, DataStreamContext*> PendingTransfers;
+    uint64_t PendingSequence;
+    uint32_t PickCount;
+    // Ranges in the want lists sent to the client, by file id and offset.
+    std::map<std::pair<uint64_t, uint64_t>, DataStreamContext*> RequestedRanges;
+    // Speculative streams waiting on a decision, and files decided against
+    // before their speculative stream arrived, by file id.
+    std::unordered_map<uint64_t, PushStreamContext*> SpeculativeStreams;
+    std::unordered_set<uint64_t> DeclinedSpeculative;
+    uint32_t ActiveTransfers;
+    AdaptiveConcurrency Concurrency;
+    bool Closed;
+    bool WaitingForSlot; // Guarded by the server's TransferMutex.
+    struct {
+        std::atomic_uint64_t FilesReceived;
+        std::atomic_uint64_t FilesCurrent;
+        std::atomic_uint64_t FilesWanted;
+        std::atomic_uint64_t FilesTransferred;
+        std::atomic_uint64_t BytesWritten;
+    } Stats;
+
+public:
+    QsyncSession(QsyncServer* Server);
+    QsyncSession(const QsyncSession&) = delete;
+    QsyncSession& operator= (const QsyncSession&) = delete;
+    ~QsyncSession();
+
+    QUIC_STATUS
+    Accept(
+        HQUIC NewConnection);
+
+    void
+    AddRef() { ++RefCount; }
+
+    void
+    Release();
+
+    void
+    StartPendingTransfers(
+        bool HasGrantedSlot = false);
+
+private:
+    static
+    QUIC_STATUS
+    QsyncSessionConnectionCallback(
+        _In_ MsQuicConnection* /*Connection*/,
+        _In_opt_ void* Context,
+        _Inout_ QUIC_CONNECTION_EVENT* Event);
+
+    static
+    QUIC_STATUS
+    QSyncServerControlStreamCallback(
+        _In_ MsQuicStream* /*Stream*/,
+        _In_opt_ void* Context,
+        _Inout_ QUIC_STREAM_EVENT* Event);
+
+    static
+    QUIC_STATUS
+    QSyncServerPushStreamCallback(
+        _In_ MsQuicStream* Stream,
+        _In_opt_ void* Context,
+        _Inout_ QUIC_STREAM_EVENT* Event);
+
+    static
+    QUIC_STATUS
+    QSyncServerDataStreamCallback(
+        _In_ MsQuicStream* /*Stream*/,
+        _In_opt_ void* Context,
+        _Inout_ QUIC_STREAM_EVENT* Event);
+
+    void
+    QSyncServerWorkerCallback(
+        _In_ const SerializedFileInfo& Info);
+
+    //
+    // Takes control stream bytes as they arrive. EarlyData is set for bytes
+    // that came in 0-RTT. Returns false if the connection should be closed.
+    //
+    bool
+    OnControlReceive(
+        const QUIC_BUFFER* Buffers,
+        uint32_t BufferCount,
+        bool EarlyData = false);
+
+    //
+    // Starts on records held back because they came in 0-RTT.
+    //
+    void
+    ConfirmHandshake();
+
+    //
+    // Waits until every FileInfo received so far has been decided on.
+    //
+    void
+    WaitForIncoming();
+
+    //
+    // Drops pending transfers and detaches from the server once the
+    // connection is gone, and releases the connection's ref.
+    //
+    void
+    Close();
+
+    void
+    AddFileToList(
+        const uint8_t* Buffer,
+        uint32_t Length);
+
+    void
+    ProcessIncoming();
+
+    bool
+    OnHello();
+
+    bool
+    AttachConnection(
+        QsyncSession* Joined);
+
+    void
+    DetachConnection(
+        QsyncSession* Joined);
+
+    void
+    SendFileAck(
+        uint64_t Id);
+
+    //
+    // Tells the client the file could not be synced this time, so it stops
+    // waiting on it. The reason is only in the server's log.
+    //
+    void
+    SendFileFailed(
+        uint64_t Id);
+
+    //
+    // Settles the other names of file Id once it is final here: links them
+    // to it if Linked, and otherwise fails them.
+    //
+    void
+    CompleteHardLinks(
+        uint64_t Id,
+        bool Linked);
+
+    void
+    SplitRanges(
+        FileTransfer* Transfer);
+
+    void
+    QueueTransfer(
+        DataStreamContext* Context);
+
+    //
+    // LargestPick is set when the order took the largest pending transfer
+    // rather than its usual pick.
+    //
+    DataStreamContext*
+    NextPendingTransfer(
+        bool& LargestPick);
+
+    DataRequest
+    RequestRange(
+        DataStreamContext* Context,
+        bool LargestPick);
+
+    DataStreamContext*
+    ClaimRequestedRange(
+        const DataRequest& Request);
+
+    DataStreamContext*
+    ClaimSpeculativeRange(
+        PushStreamContext* Push,
+        bool& Parked);
+
+    //
+    // Requeues a transfer ResolveSpeculative bound to a speculative push
+    // that then failed.
+    //
+    void
+    RetrySpeculative(
+        DataStreamContext* Context);
+
+    void
+    ResolveSpeculative(
+        uint64_t FileId,
+        DataStreamContext* Context);
+
+    void
+    SendControlFrame(
+        ControlFrameType Type,
+        const void* Entries,
+        uint32_t EntrySize,
+        uint32_t Count);
+
+    void
+    SendWantList(
+        const std::vector<DataRequest>& Wanted);
+
+    void
+    UpdateConcurrency();
+
+    void
+    TransferFinished();
+};
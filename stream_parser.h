@@ -0,0 +1,69 @@
+#pragma once
+
+//
+// Reassembles the control stream's length-prefixed records
+// ([uint32_t Length][Length bytes]) from receive buffers of any size.
+// Records contained in a single buffer are handed out in place; records
+// that straddle buffers are staged and handed out once complete.
+//
+class ControlStreamParser {
+    union {
+        uint32_t MessageSize;
+        uint8_t MessageSizeBytes[sizeof(uint32_t)];
+    };
+    uint32_t SizeFilled;
+    std::vector<uint8_t> PartialMessage;
+
+public:
+    ControlStreamParser() : MessageSize(0), SizeFilled(0) {};
+
+    //
+    // Calls OnMessage(const uint8_t* Message, uint32_t Length) for every
+    // complete record. Returns false if the stream is malformed.
+    //
+    template<typename F>
+    bool
+    Parse(
+        const QUIC_BUFFER* Buffers,
+        uint32_t BufferCount,
+        F&& OnMessage)
+    {
+        for (auto BufIdx = 0u; BufIdx < BufferCount; ++BufIdx) {
+            const uint8_t* Data = Buffers[BufIdx].Buffer;
+            uint32_t Length = Buffers[BufIdx].Length;
+            while (Length > 0) {
+                if (SizeFilled < sizeof(MessageSize)) {
+                    uint32_t SizePart = std::min((uint32_t)sizeof(MessageSize) - SizeFilled, Length);
+                    memcpy(MessageSizeBytes + SizeFilled, Data, SizePart);
+                    SizeFilled += SizePart;
+                    Data += SizePart;
+                    Length -= SizePart;
+                    if (SizeFilled < sizeof(MessageSize)) {
+                        break;
+                    }
+                    if (MessageSize > CONTROL_MESSAGE_MAX_LENGTH) {
+                        return false;
+                    }
+                    PartialMessage.clear();
+                }
+                if (PartialMessage.empty() && Length >= MessageSize) {
+                    OnMessage(Data, MessageSize);
+                    Data += MessageSize;
+                    Length -= MessageSize;
+                    SizeFilled = 0;
+                    continue;
+                }
+                uint32_t MessagePart = std::min(MessageSize - (uint32_t)PartialMessage.size(), Length);
+                PartialMessage.insert(PartialMessage.end(), Data, Data + MessagePart);
+                Data += MessagePart;
+                Length -= MessagePart;
+                if (PartialMessage.size() == MessageSize) {
+                    OnMessage(PartialMessage.data(), MessageSize);
+                    PartialMessage.clear();
+                    SizeFilled = 0;
+                }
+            }
+        }
+        return true;
+    }
+};
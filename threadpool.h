@@ -1,18 +1,263 @@
 #pragma once
 
+//
+// A move-only callable that keeps small closures inline rather than on the
+// heap. Most of what the pools run is a member function pointer and one or
+// two pointers, which fits.
+//
+class ThreadpoolTask {
+    static constexpr size_t InlineSize = 40;
+
+    struct Operations {
+        void (*Invoke)(void* Storage);
+        void (*MoveTo)(void* From, void* To);
+        void (*Destroy)(void* Storage);
+    };
+
+    template <typename Fn>
+    static constexpr bool FitsInline =
+        sizeof(Fn) <= InlineSize &&
+        alignof(Fn) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible_v<Fn>;
+
+    template <typename Fn>
+    static constexpr Operations InlineOperations = {
+        [](void* Storage) { (*(Fn*)Storage)(); },
+        [](void* From, void* To) { new (To) Fn(std::move(*(Fn*)From)); ((Fn*)From)->~Fn(); },
+        [](void* Storage) { ((Fn*)Storage)->~Fn(); },
+    };
+
+    template <typename Fn>
+    static constexpr Operations HeapOperations = {
+        [](void* Storage) { (**(Fn**)Storage)(); },
+        [](void* From, void* To) { *(Fn**)To = *(Fn**)From; },
+        [](void* Storage) { delete *(Fn**)Storage; },
+    };
+
+    alignas(std::max_align_t) unsigned char Storage[InlineSize];
+    const Operations* Ops;
+
+public:
+    // When it was queued, for pools that report wait time.
+    uint64_t QueuedAt = 0;
+
+    ThreadpoolTask() : Ops(nullptr) {}
+
+    template <typename Fn, typename = std::enable_if_t<!std::is_same_v<std::decay_t<Fn>, ThreadpoolTask>>>
+    ThreadpoolTask(Fn&& Callable)
+    {
+        using Stored = std::decay_t<Fn>;
+        if constexpr (FitsInline<Stored>) {
+            new (Storage) Stored(std::forward<Fn>(Callable));
+            Ops = &InlineOperations<Stored>;
+        } else {
+            *(Stored**)Storage = new Stored(std::forward<Fn>(Callable));
+            Ops = &HeapOperations<Stored>;
+        }
+    }
+    ThreadpoolTask(ThreadpoolTask&& Other) noexcept : Ops(Other.Ops), QueuedAt(Other.QueuedAt)
+    {
+        if (Ops != nullptr) {
+            Ops->MoveTo(Other.Storage, Storage);
+            Other.Ops = nullptr;
+        }
+    }
+    ThreadpoolTask& operator= (ThreadpoolTask&& Other) noexcept
+    {
+        if (this != &Other) {
+            Reset();
+            if (Other.Ops != nullptr) {
+                Other.Ops->MoveTo(Other.Storage, Storage);
+                Ops = Other.Ops;
+                Other.Ops = nullptr;
+            }
+            QueuedAt = Other.QueuedAt;
+        }
+        return *this;
+    }
+    ThreadpoolTask(const ThreadpoolTask&) = delete;
+    ThreadpoolTask& operator= (const ThreadpoolTask&) = delete;
+    ~ThreadpoolTask() { Reset(); }
+
+    void operator()() { Ops->Invoke(Storage); }
+    explicit operator bool() const { return Ops != nullptr; }
+
+    void Reset()
+    {
+        if (Ops != nullptr) {
+            Ops->Destroy(Storage);
+            Ops = nullptr;
+        }
+    }
+};
+
+//
+// Bounded multi-producer, multi-consumer FIFO of tasks; each cell's
+// sequence number says whether it is free to write or ready to read, so
+// producers and consumers only contend on the position they claim.
+//
+class ThreadpoolQueue {
+    struct Cell {
+        std::atomic<size_t> Sequence;
+        ThreadpoolTask Task;
+    };
+
+    std::unique_ptr<Cell[]> Cells;
+    size_t Mask;
+    alignas(64) std::atomic<size_t> EnqueuePosition;
+    alignas(64) std::atomic<size_t> DequeuePosition;
+
+public:
+    ThreadpoolQueue(size_t Capacity) :
+        Cells(new Cell[Capacity]), Mask(Capacity - 1), EnqueuePosition(0), DequeuePosition(0)
+    {
+        // Capacity must be a power of two.
+        for (size_t i = 0; i < Capacity; ++i) {
+            Cells[i].Sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    ThreadpoolQueue(const ThreadpoolQueue&) = delete;
+    ThreadpoolQueue& operator= (const ThreadpoolQueue&) = delete;
+
+    //
+    // Leaves Task alone and returns false when the queue is full.
+    //
+    bool Push(ThreadpoolTask& Task)
+    {
+        Cell* Slot;
+        size_t Position = EnqueuePosition.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot = &Cells[Position & Mask];
+            auto Sequence = Slot->Sequence.load(std::memory_order_acquire);
+            auto Difference = (intptr_t)Sequence - (intptr_t)Position;
+            if (Difference == 0) {
+                if (EnqueuePosition.compare_exchange_weak(Position, Position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (Difference < 0) {
+                return false;
+            } else {
+                Position = EnqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+        Slot->Task = std::move(Task);
+        Slot->Sequence.store(Position + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(ThreadpoolTask& Task)
+    {
+        Cell* Slot;
+        size_t Position = DequeuePosition.load(std::memory_order_relaxed);
+        for (;;) {
+            Slot = &Cells[Position & Mask];
+            auto Sequence = Slot->Sequence.load(std::memory_order_acquire);
+            auto Difference = (intptr_t)Sequence - (intptr_t)(Position + 1);
+            if (Difference == 0) {
+                if (DequeuePosition.compare_exchange_weak(Position, Position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (Difference < 0) {
+                return false;
+            } else {
+                Position = DequeuePosition.load(std::memory_order_relaxed);
+            }
+        }
+        Task = std::move(Slot->Task);
+        Slot->Sequence.store(Position + Mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t Size() const
+    {
+        auto Enqueued = EnqueuePosition.load(std::memory_order_relaxed);
+        auto Dequeued = DequeuePosition.load(std::memory_order_relaxed);
+        return Enqueued > Dequeued ? Enqueued - Dequeued : 0;
+    }
+};
+
+const size_t THREADPOOL_QUEUE_CAPACITY = 1024;
+
+//
+// Each worker has its own queue. Work enqueued from one of the pool's own
+// threads goes on that thread's queue; anything else is spread round-robin.
+// Idle workers steal from the others' queues before going to sleep, and
+// the mutex is only taken to sleep and to wake a sleeper. Work that doesn't
+// fit in the queues spills into a locked overflow list.
+//
+// With NodeAffinity, workers are spread evenly over the NUMA nodes and
+// pinned there, EnqueueNear places work with a worker on a given node, and
+// workers steal from their own node before going further.
+//
+const uint32_t THREADPOOL_ANY_NODE = UINT32_MAX;
+
 struct Threadpool {
-    std::deque<std::function<void()>> Workitems;
+    std::vector<std::unique_ptr<ThreadpoolQueue>> Queues;
     std::vector<std::thread> Threads;
+    std::atomic_uint32_t NextQueue;
+    bool NodeAffinity;
+    std::vector<uint32_t> WorkerNodes;
+    std::vector<std::vector<uint32_t>> NodeWorkers;
+    // Queues each worker tries in turn: its own, its node's, then the rest.
+    std::vector<std::vector<uint32_t>> VictimOrder;
+    // Overflow is only touched while OverflowCount says it isn't empty.
+    std::mutex OverflowMutex;
+    std::deque<ThreadpoolTask> Overflow;
+    std::atomic<size_t> OverflowCount;
     std::condition_variable Cv;
     std::mutex Mutex;
-    bool WorkerContinue;
+    std::atomic_uint32_t Sleepers;
+    // Bumped under Mutex on every wake, so a worker that's about to sleep
+    // can tell it missed one.
+    uint64_t WakeEpoch;
+    std::atomic_bool WorkerContinue;
+    // Only for pools given a name; declared last so they go first.
+    std::unique_ptr<MetricGauge> QueueLengthMetric;
+    std::unique_ptr<MetricHistogram> WaitMetric;
+
+    static inline thread_local Threadpool* CurrentPool = nullptr;
+    static inline thread_local uint32_t CurrentWorker = 0;
 
     Threadpool() = delete;
-    Threadpool(size_t ThreadCount = 1) : WorkerContinue(true)
+    Threadpool(size_t ThreadCount = 1, bool NodeAffinity = false, const char* Name = nullptr) :
+        NextQueue(0), NodeAffinity(NodeAffinity), OverflowCount(0), Sleepers(0), WakeEpoch(0), WorkerContinue(true)
     {
+        if (Name != nullptr) {
+            auto Labels = std::string("pool=\"") + Name + "\"";
+            QueueLengthMetric = std::make_unique<MetricGauge>(
+                "qsync_threadpool_queue_length",
+                "Work items queued and not yet started.",
+                Labels,
+                [this]() { return (int64_t)QueueDepth(); });
+            WaitMetric = std::make_unique<MetricHistogram>(
+                "qsync_threadpool_wait_seconds",
+                "Time work items spent queued.",
+                1e-6,
+                Labels);
+        }
+        ThreadCount = std::max<size_t>(ThreadCount, 1);
+        uint32_t NodeCount = NodeAffinity ? CpuTopology::Get().NodeCount() : 1;
+        NodeWorkers.resize(NodeCount);
+        Queues.reserve(ThreadCount);
+        for (auto i = 0u; i < ThreadCount; ++i) {
+            Queues.emplace_back(std::make_unique<ThreadpoolQueue>(THREADPOOL_QUEUE_CAPACITY));
+            WorkerNodes.push_back(i % NodeCount);
+            NodeWorkers[i % NodeCount].push_back(i);
+        }
+        VictimOrder.resize(ThreadCount);
+        for (auto i = 0u; i < ThreadCount; ++i) {
+            for (auto Near : {true, false}) {
+                for (auto j = 0u; j < ThreadCount; ++j) {
+                    auto Victim = (uint32_t)((i + j) % ThreadCount);
+                    if ((WorkerNodes[Victim] == WorkerNodes[i]) == Near) {
+                        VictimOrder[i].push_back(Victim);
+                    }
+                }
+            }
+        }
         Threads.reserve(ThreadCount);
         for (auto i = 0u; i < ThreadCount; ++i) {
-            Threads.emplace_back(std::thread(&Threadpool::ThreadpoolWorker, this));
+            Threads.emplace_back(std::thread(&Threadpool::ThreadpoolWorker, this, i));
         }
     }
     Threadpool(const Threadpool&) = delete;
@@ -23,6 +268,7 @@ struct Threadpool {
         {
             std::unique_lock<std::mutex> Lock(Mutex);
             WorkerContinue = false;
+            ++WakeEpoch;
             Lock.unlock();
             Cv.notify_all();
         }
@@ -31,27 +277,157 @@ struct Threadpool {
         }
     }
 
-    void ThreadpoolWorker()
+    bool FindWork(uint32_t Worker, ThreadpoolTask& Task)
     {
+        // Own queue first, then steal, nearest first.
+        for (auto Victim : VictimOrder[Worker]) {
+            if (Queues[Victim]->Pop(Task)) {
+                return true;
+            }
+        }
+        if (OverflowCount.load(std::memory_order_acquire) != 0) {
+            std::lock_guard<std::mutex> Lock(OverflowMutex);
+            if (!Overflow.empty()) {
+                Task = std::move(Overflow.front());
+                Overflow.pop_front();
+                OverflowCount.fetch_sub(1, std::memory_order_release);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Run(ThreadpoolTask& Workitem)
+    {
+        if (WaitMetric) {
+            WaitMetric->Record(MetricNowUs() - Workitem.QueuedAt);
+        }
+        Workitem();
+        Workitem.Reset();
+    }
+
+    void ThreadpoolWorker(uint32_t Worker)
+    {
+        CurrentPool = this;
+        CurrentWorker = Worker;
+        if (NodeAffinity) {
+            CpuTopology::Get().PinCurrentThread(WorkerNodes[Worker]);
+        }
+        ThreadpoolTask Workitem;
         while (WorkerContinue) {
-            std::unique_lock<std::mutex> Lock(Mutex);
-            Cv.wait(Lock, [this]{return Workitems.size() > 0 || !WorkerContinue;});
-            if (!WorkerContinue) {
-                break;
+            if (FindWork(Worker, Workitem)) {
+                Run(Workitem);
+                continue;
             }
-            auto Workitem = std::move(Workitems.front());
-            Workitems.pop_front();
+            std::unique_lock<std::mutex> Lock(Mutex);
+            Sleepers.fetch_add(1);
+            auto Epoch = WakeEpoch;
             Lock.unlock();
-            Workitem();
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            // Anything enqueued before Sleepers went up is found here; anything
+            // after it bumps WakeEpoch.
+            if (FindWork(Worker, Workitem)) {
+                Sleepers.fetch_sub(1);
+                Run(Workitem);
+                continue;
+            }
+            Lock.lock();
+            Cv.wait(Lock, [this, Epoch]{return WakeEpoch != Epoch || !WorkerContinue;});
+            Sleepers.fetch_sub(1);
         }
     }
 
+    void Wake(size_t Count)
+    {
+        // Pairs with the fence in ThreadpoolWorker: either the sleeper sees the
+        // new work or this sees the sleeper.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (Sleepers.load() == 0) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> Lock(Mutex);
+            ++WakeEpoch;
+        }
+        if (Count > 1) {
+            Cv.notify_all();
+        } else {
+            Cv.notify_one();
+        }
+    }
+
+    void Push(ThreadpoolTask&& Task, uint32_t Node = THREADPOOL_ANY_NODE)
+    {
+        uint32_t First;
+        if (WaitMetric) {
+            Task.QueuedAt = MetricNowUs();
+        }
+        if (Node >= NodeWorkers.size()) {
+            Node = THREADPOOL_ANY_NODE;
+        }
+        if (CurrentPool == this && (Node == THREADPOOL_ANY_NODE || WorkerNodes[CurrentWorker] == Node)) {
+            First = CurrentWorker;
+        } else if (Node == THREADPOOL_ANY_NODE) {
+            First = NextQueue.fetch_add(1, std::memory_order_relaxed) % Queues.size();
+        } else {
+            auto& Near = NodeWorkers[Node];
+            First = Near[NextQueue.fetch_add(1, std::memory_order_relaxed) % Near.size()];
+        }
+        for (auto Target : VictimOrder[First]) {
+            if (Queues[Target]->Push(Task)) {
+                return;
+            }
+        }
+        std::lock_guard<std::mutex> Lock(OverflowMutex);
+        Overflow.emplace_back(std::move(Task));
+        OverflowCount.fetch_add(1, std::memory_order_release);
+    }
+
+    size_t QueueDepth()
+    {
+        size_t Depth = OverflowCount.load(std::memory_order_relaxed);
+        for (auto& Queue : Queues) {
+            Depth += Queue->Size();
+        }
+        return Depth;
+    }
+
+    size_t ThreadCount() const { return Threads.size(); }
+
     template <typename Callable, typename... Args>
     void Enqueue(Callable&& Fn, Args&&... Parms)
     {
-        std::unique_lock<std::mutex> Lock(Mutex);
-        Workitems.emplace_back(std::bind(Fn, std::forward<Args>(Parms)...));
-        Lock.unlock();
-        Cv.notify_one();
+        Push(ThreadpoolTask(
+            [Fn = std::forward<Callable>(Fn), ...Parms = std::forward<Args>(Parms)]() mutable {
+                std::invoke(Fn, Parms...);
+            }));
+        Wake(1);
+    }
+
+    //
+    // Like Enqueue, but prefers a worker on Node, e.g. the node an MsQuic
+    // callback is running on, so the data it hands over stays node-local.
+    //
+    template <typename Callable, typename... Args>
+    void EnqueueNear(uint32_t Node, Callable&& Fn, Args&&... Parms)
+    {
+        Push(ThreadpoolTask(
+            [Fn = std::forward<Callable>(Fn), ...Parms = std::forward<Args>(Parms)]() mutable {
+                std::invoke(Fn, Parms...);
+            }),
+            Node);
+        Wake(1);
+    }
+
+    //
+    // Queues all of Tasks and wakes as many sleepers as needed at once.
+    //
+    void EnqueueBatch(std::vector<ThreadpoolTask>&& Tasks)
+    {
+        for (auto& Task : Tasks) {
+            Push(std::move(Task));
+        }
+        Wake(Tasks.size());
+        Tasks.clear();
     }
 };
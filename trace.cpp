@@ -0,0 +1,110 @@
+#include "qsync.h"
+
+using namespace std;
+
+FileTracer Tracer;
+
+static const char* const TraceNames[TraceNameCount] = {
+    "file",
+    "scanned",
+    "control_sent",
+    "push_start",
+    "push_done",
+    "received",
+    "decide",
+    "stream_start",
+    "first_byte",
+    "last_byte",
+    "finish",
+    "acked",
+};
+
+void
+FileTracer::Start(
+    uint32_t SampleRate,
+    QsyncPerspective Perspective)
+{
+    this->SampleRate = max(SampleRate, 1u);
+    this->Perspective = Perspective;
+    Enabled = true;
+}
+
+FileTracer::Ring*
+FileTracer::ThreadRing()
+{
+    static thread_local Ring* Current = nullptr;
+    if (Current == nullptr) {
+        auto Created = make_unique<Ring>();
+        Created->Written = 0;
+        lock_guard<mutex> Lock(RingsMutex);
+        Created->ThreadIndex = (uint32_t)Rings.size() + 1;
+        Current = Created.get();
+        Rings.push_back(std::move(Created));
+    }
+    return Current;
+}
+
+void
+FileTracer::Record(
+    uint64_t FileId,
+    TraceName Name,
+    char Phase,
+    uint64_t TimeUs,
+    uint32_t DurationUs)
+{
+    auto Current = ThreadRing();
+    auto Index = Current->Written.load(memory_order_relaxed);
+    auto& Slot = Current->Events[Index % TRACE_RING_EVENTS];
+    Slot.TimeUs = TimeUs;
+    Slot.FileId = FileId;
+    Slot.DurationUs = DurationUs;
+    Slot.Name = Name;
+    Slot.Phase = Phase;
+    Current->Written.store(Index + 1, memory_order_release);
+}
+
+bool
+FileTracer::Write(
+    const string& Path)
+{
+    //
+    // Recording stops first; a thread already inside Record may still
+    // finish its event, which at worst garbles that one entry.
+    //
+    Enabled = false;
+    uint32_t ProcessId = Perspective + 1;
+    ofstream Output(Path, ios::out | ios::trunc);
+    if (!Output.good()) {
+        LogError() << "Failed to open trace file " << Path << " " << strerror(errno);
+        return false;
+    }
+    Output << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    Output << "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": " << ProcessId
+        << ", \"args\": {\"name\": \"" << (Perspective == Client ? "qsync client" : "qsync server") << "\"}}";
+    lock_guard<mutex> Lock(RingsMutex);
+    for (auto& Current : Rings) {
+        uint64_t Written = Current->Written.load(memory_order_acquire);
+        uint64_t First = Written > TRACE_RING_EVENTS ? Written - TRACE_RING_EVENTS : 0;
+        for (auto i = First; i < Written; ++i) {
+            auto& Item = Current->Events[i % TRACE_RING_EVENTS];
+            Output << ",\n{\"name\": \"" << TraceNames[Item.Name]
+                << "\", \"cat\": \"file\", \"ph\": \"" << Item.Phase
+                << "\", \"ts\": " << Item.TimeUs
+                << ", \"pid\": " << ProcessId
+                << ", \"tid\": " << Current->ThreadIndex;
+            if (Item.Phase == 'X') {
+                Output << ", \"dur\": " << Item.DurationUs;
+            } else {
+                // Async events with one id share a track: one per file.
+                Output << ", \"id\": \"0x" << std::hex << Item.FileId << std::dec << '"';
+            }
+            Output << ", \"args\": {\"file\": " << Item.FileId << "}}";
+        }
+    }
+    Output << "\n]}\n";
+    if (Output.fail()) {
+        LogError() << "Failed to write trace file " << Path;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,157 @@
+#pragma once
+
+//
+// Per-file lifecycle tracing in the Chrome trace-event format, which
+// chrome://tracing and Perfetto open directly. Events go into a ring per
+// thread, so recording is a clock read and a few stores, and only a
+// sample of files is traced: the same files on both sides, since the
+// choice depends only on the file id. Timestamps are wall-clock, so a
+// client's and a server's trace can be merged into one timeline.
+//
+enum TraceName : uint16_t {
+    TraceFile,          // Async span: one file's whole life on this side.
+    TraceScanned,
+    TraceControlSent,
+    TracePushStart,
+    TracePushDone,
+    TraceReceived,
+    TraceDecide,        // QSyncServerWorkerCallback.
+    TraceStreamStart,
+    TraceFirstByte,
+    TraceLastByte,
+    TraceFinish,        // The checks and rename into place.
+    TraceAcked,
+    TraceNameCount,
+};
+
+const uint32_t TRACE_RING_EVENTS = 1u << 15;
+
+class FileTracer {
+    struct Event {
+        uint64_t TimeUs;
+        uint64_t FileId;
+        uint32_t DurationUs;
+        uint16_t Name;
+        char Phase;
+    };
+
+    struct Ring {
+        uint32_t ThreadIndex;
+        // Events written so far; the last TRACE_RING_EVENTS are kept.
+        std::atomic_uint64_t Written;
+        Event Events[TRACE_RING_EVENTS];
+    };
+
+    std::atomic_bool Enabled;
+    uint32_t SampleRate;
+    QsyncPerspective Perspective;
+    std::mutex RingsMutex;
+    std::vector<std::unique_ptr<Ring>> Rings;
+
+    Ring* ThreadRing();
+    void Record(uint64_t FileId, TraceName Name, char Phase, uint64_t TimeUs, uint32_t DurationUs);
+
+public:
+    FileTracer() : Enabled(false), SampleRate(1), Perspective(Client) {};
+    FileTracer(const FileTracer&) = delete;
+    FileTracer& operator= (const FileTracer&) = delete;
+
+    //
+    // Traces one file in SampleRate. Client and server events get their
+    // own pid, so they stay apart once merged.
+    //
+    void Start(uint32_t SampleRate, QsyncPerspective Perspective);
+
+    bool
+    Sampled(
+        uint64_t FileId) const
+    {
+        if (!Enabled.load(std::memory_order_relaxed)) {
+            return false;
+        }
+        // Ids are sequential; mix them so sampling doesn't follow the tree.
+        uint64_t Mixed = FileId * 0x9E3779B97F4A7C15ull;
+        return (Mixed >> 32) % SampleRate == 0;
+    }
+
+    static
+    uint64_t
+    Now()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    void
+    Instant(
+        uint64_t FileId,
+        TraceName Name)
+    {
+        if (Sampled(FileId)) {
+            Record(FileId, Name, 'n', Now(), 0);
+        }
+    }
+
+    void
+    Begin(
+        uint64_t FileId,
+        TraceName Name)
+    {
+        if (Sampled(FileId)) {
+            Record(FileId, Name, 'b', Now(), 0);
+        }
+    }
+
+    void
+    End(
+        uint64_t FileId,
+        TraceName Name)
+    {
+        if (Sampled(FileId)) {
+            Record(FileId, Name, 'e', Now(), 0);
+        }
+    }
+
+    //
+    // A span on the calling thread that started at StartUs (from Now()).
+    //
+    void
+    Complete(
+        uint64_t FileId,
+        TraceName Name,
+        uint64_t StartUs)
+    {
+        if (Sampled(FileId)) {
+            uint64_t End = Now();
+            Record(FileId, Name, 'X', StartUs, (uint32_t)(End > StartUs ? End - StartUs : 0));
+        }
+    }
+
+    //
+    // Stops recording and writes what the rings hold to Path.
+    //
+    bool Write(const std::string& Path);
+};
+
+extern FileTracer Tracer;
+
+//
+// Records a TraceDecide-style span for the rest of a scope.
+//
+class TraceScope {
+    uint64_t FileId;
+    TraceName Name;
+    uint64_t StartUs;
+
+public:
+    TraceScope(uint64_t FileId, TraceName Name) :
+        FileId(FileId), Name(Name), StartUs(Tracer.Sampled(FileId) ? FileTracer::Now() : 0) {}
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator= (const TraceScope&) = delete;
+    ~TraceScope()
+    {
+        if (StartUs != 0) {
+            Tracer.Complete(FileId, Name, StartUs);
+        }
+    }
+};